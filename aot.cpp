@@ -0,0 +1,627 @@
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <sstream>
+#include <spawn.h>
+#include <sys/wait.h>
+#include "vm.h"
+
+using namespace std;
+
+// Compiles a .pvm file ahead of time into a standalone program: the code goes through the IR of the
+// JIT (jit_ir.h), which is then written out as C, and the system C compiler makes the executable.
+// VM memory is a static array, PRINT goes through a buffer of the runtime below and the program ends
+// the way it ends in the VM, with the same output and messages. Every function becomes a C function,
+// the code before the first one becomes pvm_main(), so the C compiler sees whole loops and calls.
+// Workers and host functions only exist in the VM, programs with SPAWN, JOIN or NATIVE are turned down,
+// and the results of POP_RES are dropped.
+//   ./aot [--no-loop-opt] [--memory-size CELLS] program.pvm program
+// writes program.c and compiles it with $CC (cc by default); an output ending in .c is only written.
+
+// What every compiled program starts with, after MEMORY_SIZE and MAX_CALL_DEPTH. pvm_stop() takes the
+// jit_stop_reason values
+static const char* const runtime_source = R"(
+static int memory[MEMORY_SIZE];
+
+static char output[1 << 16];
+static size_t output_size;
+
+static inline void pvm_flush(void) {
+    size_t written = 0;
+    while (written < output_size) {
+        ssize_t size = write(1, output + written, output_size - written);
+        if (size <= 0) {
+            break;
+        }
+        written += size;
+    }
+    output_size = 0;
+}
+
+static inline void pvm_message(const char* text) {
+    size_t size = strlen(text);
+    if (sizeof(output) - output_size < size) {
+        pvm_flush();
+    }
+    memcpy(output + output_size, text, size);
+    output_size += size;
+}
+
+static inline void pvm_print(int n) {
+    char text[12];
+    char* start = text + sizeof(text);
+    unsigned value = n < 0 ? 0u - (unsigned) n : (unsigned) n;
+    *--start = '\n';
+    do {
+        *--start = (char) ('0' + value % 10);
+        value /= 10;
+    } while (value);
+    if (n < 0) {
+        *--start = '-';
+    }
+    if (sizeof(output) - output_size < sizeof(text)) {
+        pvm_flush();
+    }
+    memcpy(output + output_size, start, text + sizeof(text) - start);
+    output_size += text + sizeof(text) - start;
+}
+
+// errors go out before the buffered output, as in the VM
+static inline void pvm_stop(int reason, int value) {
+    switch (reason) {
+        case 0:
+            pvm_message("program DONE\n");
+            break;
+        case 1:
+            fputs("OP_ABORT called\n", stderr);
+            break;
+        case 2:
+            fputs("ZERO DIVISION\n", stderr);
+            break;
+        case 3:
+            fprintf(stderr, "BAD MEMORY ACCESS: %d\n", value);
+            break;
+        case 4:
+            fputs("CALL STACK OVERFLOW\n", stderr);
+            break;
+        case 6:
+            fputs("DIVISION OVERFLOW\n", stderr);
+            break;
+    }
+    pvm_flush();
+    exit(0);
+}
+
+// where the VM would go on in code that isn't compiled
+static inline void pvm_outside(int ip) {
+    fprintf(stderr, "JUMP OUT OF COMPILED CODE: %d\n", ip);
+    pvm_flush();
+    exit(1);
+}
+
+static inline int pvm_clamp(int64_t cell) {
+    return cell < INT_MIN ? INT_MIN : cell > INT_MAX ? INT_MAX : (int) cell;
+}
+
+// FILL, COPY and the SCANs, see bulk_memory.h
+static inline void pvm_fill(int addr, int count, int stride, int value) {
+    if (count <= 0) {
+        return;
+    }
+    if (addr < 0 || addr >= MEMORY_SIZE) {
+        pvm_stop(3, addr);
+    }
+    int64_t last = addr + (int64_t) (count - 1) * stride;
+    if (last < 0 || last >= MEMORY_SIZE) {
+        int64_t steps = stride > 0 ? (MEMORY_SIZE - addr + stride - 1) / stride : addr / -(int64_t) stride + 1;
+        pvm_stop(3, pvm_clamp(addr + steps * stride));
+    }
+    if (stride == 0) {
+        memory[addr] = value;
+        return;
+    }
+    for (int64_t i = 0; i < count; i++) {
+        memory[addr + i * stride] = value;
+    }
+}
+
+static inline void pvm_check_range(int from, int count) {
+    if (from < 0 || from >= MEMORY_SIZE) {
+        pvm_stop(3, from);
+    }
+    if ((int64_t) from + count > MEMORY_SIZE) {
+        pvm_stop(3, MEMORY_SIZE);
+    }
+}
+
+static inline void pvm_copy(int dst, int src, int count) {
+    if (count <= 0) {
+        return;
+    }
+    pvm_check_range(src, count);
+    pvm_check_range(dst, count);
+    memmove(memory + dst, memory + src, (size_t) count * sizeof(int));
+}
+
+static inline int pvm_scan(int addr, int end, int zero) {
+    if (addr >= end) {
+        return addr;
+    }
+    if (addr < 0 || addr >= MEMORY_SIZE) {
+        pvm_stop(3, addr);
+    }
+    int last = end < MEMORY_SIZE ? end : MEMORY_SIZE;
+    for (int cell = addr; cell < last; cell++) {
+        if ((memory[cell] == 0) == zero) {
+            return cell;
+        }
+    }
+    if (end > MEMORY_SIZE) {
+        pvm_stop(3, MEMORY_SIZE);
+    }
+    return end;
+}
+
+// ATOMIC_ADD and CAS; there are no workers to race with
+static inline int pvm_atomic_add(int addr, int value) {
+    if ((unsigned) addr >= MEMORY_SIZE) {
+        pvm_stop(3, addr);
+    }
+    int old = memory[addr];
+    memory[addr] = (int) ((unsigned) old + (unsigned) value);
+    return old;
+}
+
+static inline int pvm_cas(int addr, int expected, int desired) {
+    if ((unsigned) addr >= MEMORY_SIZE) {
+        pvm_stop(3, addr);
+    }
+    int old = memory[addr];
+    if (old == expected) {
+        memory[addr] = desired;
+    }
+    return old;
+}
+)";
+
+// Writes one IR function as a C function. Registers are locals, blocks are labels and the exits are
+// calls of the runtime after the blocks; an exit that ends the program never returns
+struct c_writer {
+    const ir_function& ir;
+    const vector<function_info>& functions;
+    // -1 for pvm_main()
+    int index;
+    set<int> targets, exits, used;
+    // the body of the function
+    ostringstream out;
+
+    c_writer(const ir_function& ir, const vector<function_info>& functions, int index)
+            : ir(ir), functions(functions), index(index) {}
+
+    static string name(int function) {
+        return function < 0 ? "pvm_main" : "pvm_f" + to_string(function);
+    }
+
+    bool is_void() const {
+        return index < 0 || functions[index].results == 0;
+    }
+
+    string signature() const {
+        ostringstream text;
+        text << "static " << (is_void() ? "void " : "int ") << name(index) << "(";
+        for (size_t i = 0; i < ir.inputs.size(); i++) {
+            text << (i ? ", " : "") << "int a" << i;
+        }
+        text << (ir.inputs.empty() ? "void)" : ")");
+        return text.str();
+    }
+
+    string reg(int reg) {
+        used.insert(reg);
+        return "r" + to_string(reg);
+    }
+
+    string value(ir_value value) {
+        if (!value.is_constant()) {
+            return reg(value.reg);
+        }
+        // -2147483648 would be the negation of a constant that doesn't fit into an int
+        if (value.constant == numeric_limits<int>::min()) {
+            return "(-2147483647 - 1)";
+        }
+        return value.constant < 0 ? "(" + to_string(value.constant) + ")" : to_string(value.constant);
+    }
+
+    string call(const ir_insn& insn) {
+        ostringstream text;
+        text << name(insn.arg) << "(";
+        for (size_t i = 0; i < insn.in.size(); i++) {
+            text << (i ? ", " : "") << value(insn.in[i]);
+        }
+        text << ")";
+        return text.str();
+    }
+
+    void write(ostream& to) {
+        auto order = ir_block_order(ir);
+        // the blocks that gotos go to: jumps to the next block fall through
+        for (size_t i = 0; i < order.size(); i++) {
+            auto next = i + 1 < order.size() ? order[i + 1] : -1;
+            auto& terminator = ir.blocks[order[i]].terminator();
+            if (terminator.opcode == IR_JUMP && terminator.arg != next) {
+                targets.insert(terminator.arg);
+            } else if (terminator.opcode == IR_BRANCH) {
+                targets.insert(terminator.arg == next ? terminator.other : terminator.arg);
+                if (terminator.arg != next && terminator.other != next) {
+                    targets.insert(terminator.other);
+                }
+            }
+        }
+        // an argument that nothing reads would be a variable set but not used
+        auto reads = ir_read_counts(ir);
+        for (size_t i = 0; i < ir.inputs.size(); i++) {
+            if (reads[ir.inputs[i]]) {
+                out << "    " << reg(ir.inputs[i]) << " = a" << i << ";\n";
+            } else {
+                out << "    (void) a" << i << ";\n";
+            }
+        }
+        if (index >= 0) {
+            out << "    if (call_depth >= MAX_CALL_DEPTH) {\n"
+                   "        pvm_stop(" << STOP_CALL_DEPTH << ", 0);\n"
+                   "    }\n"
+                   "    call_depth++;\n";
+        }
+        for (size_t i = 0; i < order.size(); i++) {
+            if (targets.count(order[i])) {
+                out << "b" << order[i] << ":\n";
+            }
+            auto next = i + 1 < order.size() ? order[i + 1] : -1;
+            for (auto& insn : ir.blocks[order[i]].insns) {
+                write(insn, next);
+            }
+        }
+        for (auto exit : exits) {
+            out << "e" << exit << ":\n";
+            write(ir.exits[exit]);
+        }
+        // only the registers that the body uses are declared
+        to << signature() << " {\n";
+        if (!used.empty()) {
+            to << "    int";
+            for (auto r : used) {
+                to << (r == *used.begin() ? " r" : ", r") << r << " = 0";
+            }
+            to << ";\n";
+        }
+        to << out.str() << "}\n\n";
+    }
+
+    void jump(int block, int next) {
+        if (block != next) {
+            out << "    goto b" << block << ";\n";
+        }
+    }
+
+    void leave_if(const string& condition, int exit) {
+        exits.insert(exit);
+        out << "    if (" << condition << ") goto e" << exit << ";\n";
+    }
+
+    void spill(const vector<ir_cell>& cells) {
+        for (auto cell : cells) {
+            out << "        memory[" << cell.cell << "] = " << reg(cell.reg) << ";\n";
+        }
+    }
+
+    // whether addr is between the lowest and the highest of cells
+    static string hits(const string& addr, const vector<ir_cell>& cells) {
+        auto [lowest, highest] = minmax_element(cells.begin(), cells.end(), [](ir_cell a, ir_cell b) {
+            return a.cell < b.cell;
+        });
+        return "(unsigned) " + addr + " - " + to_string(lowest->cell) + "u <= " +
+               to_string(highest->cell - lowest->cell) + "u";
+    }
+
+    void write(const ir_insn& insn, int next) {
+        auto dst = insn.dst >= 0 ? "    " + reg(insn.dst) + " = " : "    ";
+        auto in = [&](int i) {
+            return value(insn.in[i]);
+        };
+        switch (insn.opcode) {
+            case IR_COPY:
+                out << dst << in(0) << ";\n";
+                break;
+            // wrapping around, as the VM does
+            case IR_ADD:
+                out << dst << "(int) ((unsigned) " << in(0) << " + (unsigned) " << in(1) << ");\n";
+                break;
+            case IR_SUB:
+                out << dst << "(int) ((unsigned) " << in(0) << " - (unsigned) " << in(1) << ");\n";
+                break;
+            case IR_MUL:
+                out << dst << "(int) ((unsigned) " << in(0) << " * (unsigned) " << in(1) << ");\n";
+                break;
+            // CHECK_QUOTIENT stops INT_MIN / -1 before it gets here; dividing by -1 as a negation keeps
+            // the C free of undefined behaviour on that path all the same
+            case IR_DIV:
+                out << dst << "(" << in(1) << " == -1 ? (int) (0u - (unsigned) " << in(0) << ") : " << in(0) << " / "
+                    << in(1) << ");\n";
+                break;
+            case IR_EQUAL:
+                out << dst << in(0) << " == " << in(1) << ";\n";
+                break;
+            case IR_LESS:
+                out << dst << in(0) << " < " << in(1) << ";\n";
+                break;
+            case IR_LESS_OR_EQUAL:
+                out << dst << in(0) << " <= " << in(1) << ";\n";
+                break;
+            case IR_GREATER:
+                out << dst << in(0) << " > " << in(1) << ";\n";
+                break;
+            case IR_GREATER_OR_EQUAL:
+                out << dst << in(0) << " >= " << in(1) << ";\n";
+                break;
+            case IR_LOAD:
+                if (!insn.aliases.empty()) {
+                    out << "    if (" << hits(in(0), insn.aliases) << ") {\n";
+                    spill(insn.aliases);
+                    out << "    }\n";
+                }
+                out << dst << "memory[" << in(0) << "];\n";
+                break;
+            case IR_STORE:
+                if (!insn.aliases.empty()) {
+                    out << "    if (" << hits(in(0), insn.aliases) << ") {\n";
+                    spill(insn.aliases);
+                    out << "        memory[" << in(0) << "] = " << in(1) << ";\n";
+                    for (auto cell : insn.aliases) {
+                        out << "        " << reg(cell.reg) << " = memory[" << cell.cell << "];\n";
+                    }
+                    out << "    } else {\n    ";
+                }
+                out << "    memory[" << in(0) << "] = " << in(1) << ";\n";
+                if (!insn.aliases.empty()) {
+                    out << "    }\n";
+                }
+                break;
+            case IR_CHECK_ADDRESS:
+                leave_if("(unsigned) " + in(0) + " >= MEMORY_SIZE", insn.exit);
+                break;
+            case IR_CHECK_NONZERO:
+                leave_if(in(0) + " == 0", insn.exit);
+                break;
+            case IR_CHECK_QUOTIENT:
+                leave_if(in(0) + " == INT_MIN && " + in(1) + " == -1", insn.exit);
+                break;
+            case IR_PRINT:
+                out << "    pvm_print(" << in(0) << ");\n";
+                break;
+            case IR_BULK:
+                // the runtime reports a bad address itself
+                if (insn.arg == OP_FILL) {
+                    out << "    pvm_fill(" << in(0) << ", " << in(1) << ", " << in(2) << ", " << in(3) << ");\n";
+                } else if (insn.arg == OP_COPY) {
+                    out << "    pvm_copy(" << in(0) << ", " << in(1) << ", " << in(2) << ");\n";
+                } else if (insn.arg == OP_ATOMIC_ADD) {
+                    out << dst << "pvm_atomic_add(" << in(0) << ", " << in(1) << ");\n";
+                } else if (insn.arg == OP_CAS) {
+                    out << dst << "pvm_cas(" << in(0) << ", " << in(1) << ", " << in(2) << ");\n";
+                } else if (insn.arg == OP_POP_RES) {
+                    // there is no host to read the results
+                    out << "    (void) " << in(0) << ";\n";
+                } else {
+                    out << dst << "pvm_scan(" << in(0) << ", " << in(1) << ", " << (insn.arg == OP_SCAN_ZERO)
+                        << ");\n";
+                }
+                break;
+            case IR_CALL:
+                // a callee that ends the program doesn't come back
+                out << dst << call(insn) << ";\n";
+                break;
+            case IR_FUEL:
+                // compiled programs aren't metered, translate() asks for none
+                break;
+            case IR_JUMP:
+                jump(insn.arg, next);
+                break;
+            case IR_BRANCH:
+                if (insn.arg == next) {
+                    out << "    if (!" << in(0) << ") goto b" << insn.other << ";\n";
+                } else {
+                    out << "    if (" << in(0) << ") goto b" << insn.arg << ";\n";
+                    jump(insn.other, next);
+                }
+                break;
+            case IR_EXIT:
+                exits.insert(insn.exit);
+                out << "    goto e" << insn.exit << ";\n";
+                break;
+            case IR_RETURN:
+                out << "    call_depth--;\n";
+                out << (is_void() ? "    return;\n" : "    return " + in(0) + ";\n");
+                break;
+            case IR_TAIL_CALL:
+                out << "    call_depth--;\n";
+                if (is_void()) {
+                    out << "    " << call(insn) << ";\n    return;\n";
+                } else {
+                    out << "    return " << call(insn) << ";\n";
+                }
+                break;
+        }
+    }
+
+    void write(const ir_exit& exit) {
+        switch (exit.kind) {
+            case EXIT_STOP:
+                out << "    pvm_stop(" << exit.reason << ", " << value(exit.value) << ");\n";
+                break;
+            case EXIT_TO_INTERPRETER:
+                out << "    pvm_outside(" << exit.ip << ");\n";
+                break;
+            case EXIT_STOPPED:
+                // the program ended in the callee already
+                break;
+        }
+        if (!is_void()) {
+            out << "    return 0;\n";
+        } else {
+            out << "    return;\n";
+        }
+    }
+};
+
+// The IR of [ip_start, ip_end), which is a function unless it is the main code. Everything is compiled
+// like a function so that the program ends in the code instead of leaving to an interpreter
+static ir_function translate(const bytecode& program, const vector<function_info>& functions, int ip_start,
+                             int ip_end, const function_info* function, const ir_options& options) {
+    ir_source source = {&program, &functions, ip_start, ip_end, function ? function->args : 0, 0, true,
+                        !function || function->results == 0, true, false, program.memory_size};
+    vector<int> depths;
+    if (!ir_stack_depths(source, depths)) {
+        cerr << "INCONSISTENT STACK DEPTH" << endl;
+        exit(12);
+    }
+    auto ir = build_ir(source, depths);
+    optimize_ir(ir, options);
+    return ir;
+}
+
+static void write_program(ostream& out, const program_file& file, const ir_options& options) {
+    auto& program = file.program;
+    auto functions = find_functions(program);
+    out << "// compiled by PigletAOT from " << file.path << "\n"
+           "#include <limits.h>\n"
+           "#include <stdint.h>\n"
+           "#include <stdio.h>\n"
+           "#include <stdlib.h>\n"
+           "#include <string.h>\n"
+           "#include <unistd.h>\n\n"
+           "#define MEMORY_SIZE " << program.memory_size << "\n"
+           "#define MAX_CALL_DEPTH " << MAX_CALL_DEPTH << "\n"
+        << runtime_source << "\n";
+    vector<ir_function> code;
+    if (!functions.empty()) {
+        out << "static int call_depth;\n\n";
+    }
+    for (auto& function : functions) {
+        code.push_back(translate(program, functions, function.entry, function.end, &function, options));
+    }
+    auto main_end = functions.empty() ? program.size : functions[0].entry;
+    code.push_back(translate(program, functions, program.entry, main_end, nullptr, options));
+    for (size_t i = 0; i < functions.size(); i++) {
+        out << c_writer(code[i], functions, (int) i).signature() << ";\n";
+    }
+    out << "\n";
+    for (size_t i = 0; i < code.size(); i++) {
+        c_writer(code[i], functions, i < functions.size() ? (int) i : -1).write(out);
+    }
+    out << "int main(void) {\n"
+           "    pvm_main();\n"
+           "    pvm_flush();\n"
+           "    return 0;\n"
+           "}\n";
+}
+
+static bool ends_with(const string& text, const string& end) {
+    return text.size() >= end.size() && text.compare(text.size() - end.size(), end.size(), end) == 0;
+}
+
+// Runs $CC, or cc, on the generated C. The words of $CC and the paths go to the compiler as they
+// are, without a shell in between
+static bool compile_c(const string& source_path, const string& output_path) {
+    auto cc = getenv("CC");
+    istringstream words(cc ? cc : "");
+    vector<string> command{istream_iterator<string>(words), istream_iterator<string>()};
+    if (command.empty()) {
+        command.push_back("cc");
+    }
+    command.insert(command.end(), {"-O2", "-o", output_path, source_path});
+    vector<char*> argv;
+    string text;
+    for (auto& word : command) {
+        argv.push_back(&word[0]);
+        text += (text.empty() ? "" : " ") + word;
+    }
+    argv.push_back(nullptr);
+    pid_t pid;
+    int error = posix_spawnp(&pid, argv[0], nullptr, nullptr, argv.data(), environ);
+    if (error != 0) {
+        cerr << argv[0] << ": " << strerror(error) << "\n";
+        return false;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            cerr << "FAILED: " << text << ": " << strerror(errno) << "\n";
+            return false;
+        }
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        cerr << "FAILED: " << text << "\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    program_options options;
+    // the superinstructions are only for the interpreter
+    options.fuse = false;
+    options.use_cache = false;
+    ir_options jit_options;
+    // the C compiler unrolls on its own
+    jit_options.unroll = 1;
+    int arg = 1;
+    for (; arg < argc - 2; arg++) {
+        if (strcmp(argv[arg], "--no-loop-opt") == 0) {
+            jit_options.loops = false;
+        } else if (strcmp(argv[arg], "--memory-size") == 0 && arg + 1 < argc - 2) {
+            if (!parse_size(argv[++arg], MAX_MEMORY_SIZE, options.memory_size)) {
+                break;
+            }
+        } else {
+            break;
+        }
+    }
+    if (arg != argc - 2) {
+        cerr << "usage: ./aot [--no-loop-opt] [--memory-size CELLS] program.pvm program[.c]\n";
+        return 1;
+    }
+    program_file file;
+    if (!open_program(argv[arg], options, file)) {
+        return 1;
+    }
+    auto& program = file.program;
+    for (int ip = 0; ip < program.size; ip += program.length(program.opcode(ip))) {
+        auto opcode = program.opcode(ip);
+        if (opcode == OP_SPAWN || opcode == OP_JOIN) {
+            cerr << argv[arg] << ": " << opcode_mnemonics[opcode].name << " at ip " << ip
+                 << ": workers need the VM, compiled programs run on one thread\n";
+            return 1;
+        }
+        if (opcode == OP_NATIVE) {
+            cerr << argv[arg] << ": NATIVE at ip " << ip << ": host functions need the VM\n";
+            return 1;
+        }
+    }
+    string output_path = argv[arg + 1];
+    auto source_path = ends_with(output_path, ".c") ? output_path : output_path + ".c";
+    {
+        ofstream out(source_path);
+        write_program(out, file, jit_options);
+        if (!out.flush()) {
+            cerr << source_path << ": " << strerror(errno) << "\n";
+            return 1;
+        }
+    }
+    if (!close_program(file)) {
+        return 1;
+    }
+    if (source_path == output_path) {
+        return 0;
+    }
+    return compile_c(source_path, output_path) ? 0 : 1;
+}
@@ -1,6 +1,8 @@
 #include <iostream>
-#include <fstream>
 #include <vector>
+#include <algorithm>
+#include <string>
+#include <string_view>
 #include <unordered_map>
 #include <unordered_set>
 #include <sys/types.h>
@@ -9,100 +11,537 @@
 #include <unistd.h>
 #include <sys/mman.h>
 #include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include "asm_opt.h"
 
 using namespace std;
 
-int main(int argc, char** argv) {
-    if (argc != 3) {
-        cerr << "usage: ./asm program.c.pvm program.pvm";
-        return 1;
+// The assembler makes one pass over the mapped source and writes the code out as it goes, so that
+// machine generated programs of millions of instructions need neither the source nor the code in
+// memory. Jumps to labels defined further down are chained per label and patched once the label
+// turns up: in the output buffer if they are still there, in the file otherwise. Only -O keeps the
+// program in memory, see asm_opt.h.
+//
+// Functions are declared with
+//     .func name ARGS RESULTS
+// which defines the label name and puts ENTER ARGS there. The function runs up to the next .func;
+// RET in it returns RESULTS values, and CALL name calls it. Functions come after the main program.
+
+const size_t MAX_MNEMONIC_LENGTH = 17;
+
+// Opcodes bucketed by the length of their mnemonic. No bucket has more than ten entries and most
+// of them differ in the first letter, so a lookup is a couple of memcmp() calls without hashing
+struct mnemonic_table {
+    vector<uint8_t> by_length[MAX_MNEMONIC_LENGTH + 1];
+
+    mnemonic_table() {
+        for (int opcode = 0; opcode < PVM_OPCODES_COUNT; opcode++) {
+            by_length[strlen(opcode_mnemonics[opcode].name)].push_back(opcode);
+        }
     }
-    unordered_map<string, int> opcodes = {
-            {"PUSHI", 0},
-            {"LOADI", 1},
-            {"LOADADDI", 2},
-            {"STOREI", 3},
-            {"LOAD", 4},
-            {"STORE", 5},
-            {"DUP", 6},
-            {"DISCARD", 7},
-            {"ADD", 8},
-            {"ADDI", 9},
-            {"SUB", 10},
-            {"DIV", 11},
-            {"MUL", 12},
-            {"JUMP", 13},
-            {"JUMP_IF_TRUE", 14},
-            {"JUMP_IF_FALSE", 15},
-            {"EQUAL", 16},
-            {"LESS", 17},
-            {"LESS_OR_EQUAL", 18},
-            {"GREATER", 19},
-            {"GREATER_OR_EQUAL", 20},
-            {"GREATER_OR_EQUALI", 21},
-            {"PRES", 22},
-            {"DONE", 23},
-            {"PRINT", 24},
-            {"ABORT", 25}
-    };
-    unordered_set<string> simple_arg_opcodes = {
-            "PUSHI", "LOADI", "LOADADDI", "STOREI", "ADDI", "GREATER_OR_EQUALI",
 
-    };
-    unordered_set<string> jump_opcodes = {
-            "JUMP", "JUMP_IF_TRUE", "JUMP_IF_FALSE"
-    };
-    ifstream in(argv[1]);
-    vector<int> result;
-    unordered_map<string, size_t> labels;
-    // vector with locations of label addresses to fill
-    vector<pair<string, size_t>> labels_to_fill;
-    string buf;
-    while (in >> buf) {
-        if (*buf.rbegin() == ':') {
-            // this is a label
-            // it should point to the next insruction that we will push
+    // -1 if word isn't a mnemonic
+    int find(string_view word) const {
+        if (word.size() > MAX_MNEMONIC_LENGTH) {
+            return -1;
+        }
+        for (auto opcode : by_length[word.size()]) {
+            if (memcmp(opcode_mnemonics[opcode].name, word.data(), word.size()) == 0) {
+                return opcode;
+            }
+        }
+        return -1;
+    }
+};
+
+// whitespace separated words of the mapped source, pointing into it
+struct tokenizer {
+    const char* pos;
+    const char* end;
+    // source line of the last word
+    int line = 1;
+
+    // empty at the end of the source
+    string_view next() {
+        while (pos < end && isspace((unsigned char) *pos)) {
+            if (*pos == '\n') {
+                line++;
+            }
+            pos++;
+        }
+        auto start = pos;
+        while (pos < end && !isspace((unsigned char) *pos)) {
+            pos++;
+        }
+        return {start, (size_t) (pos - start)};
+    }
+};
+
+bool parse_int(string_view word, int& value) {
+    size_t i = 0;
+    bool negative = false;
+    if (i < word.size() && (word[i] == '-' || word[i] == '+')) {
+        negative = word[i++] == '-';
+    }
+    if (i == word.size()) {
+        return false;
+    }
+    int64_t result = 0;
+    for (; i < word.size(); i++) {
+        if (word[i] < '0' || word[i] > '9') {
+            return false;
+        }
+        result = result * 10 + (word[i] - '0');
+        if (result > (int64_t) INT32_MAX + 1) {
+            return false;
+        }
+    }
+    result = negative ? -result : result;
+    if (result > INT32_MAX) {
+        return false;
+    }
+    value = (int) result;
+    return true;
+}
+
+// Buffers writes to fd and patches ints that were written already
+struct output_file {
+    int fd = -1;
+    vector<unsigned char> buffer;
+    // bytes before the buffer, already in the file
+    uint64_t flushed = 0;
+
+    uint64_t size() const {
+        return flushed + buffer.size();
+    }
+
+    bool flush() {
+        for (size_t done = 0; done < buffer.size();) {
+            auto written = write(fd, buffer.data() + done, buffer.size() - done);
+            if (written < 0) {
+                return false;
+            }
+            done += written;
+        }
+        flushed += buffer.size();
+        buffer.clear();
+        return true;
+    }
 
-            // pop :
-            buf.pop_back();
-            labels[buf] = result.size();
+    bool append(const void* data, size_t size) {
+        if (buffer.size() + size > buffer.capacity() && !flush()) {
+            return false;
+        }
+        buffer.insert(buffer.end(), (const unsigned char*) data, (const unsigned char*) data + size);
+        return true;
+    }
+
+    bool patch(uint64_t offset, const void* data, size_t size) {
+        if (offset >= flushed) {
+            memcpy(&buffer[offset - flushed], data, size);
+            return true;
+        }
+        return pwrite(fd, data, size, offset) == (ssize_t) size;
+    }
+};
+
+struct label {
+    // -1 until the label is defined
+    int64_t ip = -1;
+    // head of the chain of jumps waiting for the label, an index into fixups
+    int64_t first_fixup = -1;
+    // of the first jump to the label, for the error message if it never gets defined
+    int first_use_line = 0;
+};
+
+struct fixup {
+    // file offset of the jump argument
+    uint64_t offset;
+    int64_t next;
+};
+
+// undefined holds (line of the first use, name); false if there are any
+bool report_undefined_labels(const char* source_path, vector<pair<int, string_view>>& undefined) {
+    sort(undefined.begin(), undefined.end());
+    for (auto& it : undefined) {
+        cerr << source_path << ":" << it.first << ": undefined label " << it.second << "\n";
+    }
+    return undefined.empty();
+}
+
+// Writes the labels and instructions it gets to the output and the map as they come
+struct assembler {
+    const char* source_path = nullptr;
+    bool legacy = false;
+    output_file out;
+    FILE* map = nullptr;
+    // the code comes after the header in version 2
+    uint64_t code_offset = 0;
+    pvm_header header = {};
+    // the names point into the mapped source
+    unordered_map<string_view, label> labels;
+    vector<fixup> fixups;
+    // basic blocks start at the first instruction, at labels and after jumps
+    bool block_starts = true;
+    int64_t last_block = -1;
+    bool write_ok = true;
+
+    void start() {
+        code_offset = legacy ? 0 : sizeof(pvm_header);
+        if (!legacy) {
+            out.append(&header, sizeof(header));
+        }
+    }
+
+    // ips count ints in the legacy format and bytes in version 2
+    uint64_t current_ip() const {
+        auto code_size = out.size() - code_offset;
+        return legacy ? code_size / sizeof(int) : code_size;
+    }
+
+    void push_int(int value) {
+        write_ok = out.append(&value, sizeof(value)) && write_ok;
+    }
+
+    void start_block() {
+        if ((int64_t) current_ip() != last_block) {
+            last_block = current_ip();
+            if (map) {
+                fprintf(map, "block %lld\n", (long long) last_block);
+            }
+        }
+        block_starts = false;
+    }
+
+    // the label points to the next instruction that we will push; false if it is defined already.
+    // Functions don't get a label mark, CALL has to land on their ENTER
+    bool define_label(string_view name, int line, bool function) {
+        auto& target = labels[name];
+        if (target.ip >= 0) {
+            cerr << source_path << ":" << line << ": label " << name << " is already defined\n";
+            return false;
+        }
+        target.ip = current_ip();
+        for (auto i = target.first_fixup; i >= 0; i = fixups[i].next) {
+            int address = (int) target.ip;
+            write_ok = out.patch(fixups[i].offset, &address, sizeof(address)) && write_ok;
+        }
+        if (map) {
+            fprintf(map, "label %lld %.*s\n", (long long) target.ip, (int) name.size(), name.data());
+        }
+        start_block();
+        if (legacy && !function) {
             // put information about the presence of a label
-            result.push_back(0xcafe);
-            result.push_back(0xbabe);
+            push_int(0xcafe);
+            push_int(0xbabe);
+        }
+        return true;
+    }
+
+    // arg is the argument of instructions with a number, jump_target the one of jumps
+    void instruction(int opcode, int arg, string_view jump_target, int line) {
+        if (block_starts) {
+            start_block();
+        }
+        if (map) {
+            fprintf(map, "line %lld %d\n", (long long) current_ip(), line);
+        }
+        if (legacy) {
+            push_int(opcode);
         } else {
-            // otherwise this is an instruction
-            // if it has an argument, we need to read it
-            result.push_back(opcodes.at(buf));
-            if (simple_arg_opcodes.count(buf)) {
-                int arg;
-                in >> arg;
-                result.push_back(arg);
-            } else if (jump_opcodes.count(buf)) {
-                string label;
-                in >> label;
-                result.push_back(0);
-                labels_to_fill.emplace_back(label, result.size() - 1);
-            }
-        }
-    }
-    // now let`s fill label addresses
-    for (auto& p : labels_to_fill) {
-        result[p.second] = labels[p.first];
-    }
-
-    // now let`s write
-    int fd = open(argv[2], O_RDWR | O_CREAT | O_TRUNC, 0666);
-    auto size = result.size() * sizeof(result[0]);
-    if (fd < 0 || ftruncate(fd, size)) {
-        cerr << strerror(errno);
+            unsigned char byte = opcode;
+            write_ok = out.append(&byte, 1) && write_ok;
+        }
+        if (opcode_mnemonics[opcode].argument == INT_ARGUMENT || opcode_mnemonics[opcode].argument == FUNCTION_ARGUMENT) {
+            push_int(arg);
+        } else if (opcode_mnemonics[opcode].argument == LABEL_ARGUMENT) {
+            auto& target = labels[jump_target];
+            if (target.ip < 0) {
+                // chained until the label is defined
+                fixups.push_back({out.size(), target.first_fixup});
+                target.first_fixup = fixups.size() - 1;
+                if (!target.first_use_line) {
+                    target.first_use_line = line;
+                }
+            }
+            push_int((int) target.ip);
+            block_starts = true;
+        }
+    }
+
+    // false if a label is missing
+    bool finish() {
+        vector<pair<int, string_view>> undefined;
+        for (auto& it : labels) {
+            if (it.second.ip < 0) {
+                undefined.emplace_back(it.second.first_use_line, it.first);
+            }
+        }
+        if (!report_undefined_labels(source_path, undefined)) {
+            return false;
+        }
+        if (!legacy) {
+            header.code_size = (uint32_t) (out.size() - code_offset);
+            write_ok = out.patch(0, &header, sizeof(header)) && write_ok;
+        }
+        write_ok = out.flush() && write_ok;
+        return true;
+    }
+};
+
+// Keeps the labels and instructions it gets in an asm_program for -O
+struct program_collector {
+    const char* source_path = nullptr;
+    asm_program program;
+    unordered_map<string_view, int> label_indexes;
+    // by label index: where it is defined, 0 if it isn't, and where it is first used
+    vector<int> defined_lines, first_use_lines;
+
+    int label_index(string_view name) {
+        auto it = label_indexes.emplace(name, program.labels.size()).first;
+        if (it->second == (int) program.labels.size()) {
+            program.labels.push_back(name);
+            defined_lines.push_back(0);
+            first_use_lines.push_back(0);
+        }
+        return it->second;
+    }
+
+    bool define_label(string_view name, int line, bool) {
+        auto index = label_index(name);
+        if (defined_lines[index]) {
+            cerr << source_path << ":" << line << ": label " << name << " is already defined\n";
+            return false;
+        }
+        defined_lines[index] = line;
+        program.code.push_back({LABEL_DEFINITION, index, line});
+        return true;
+    }
+
+    void instruction(int opcode, int arg, string_view jump_target, int line) {
+        if (opcode_mnemonics[opcode].argument == LABEL_ARGUMENT) {
+            arg = label_index(jump_target);
+            if (!first_use_lines[arg]) {
+                first_use_lines[arg] = line;
+            }
+        }
+        program.code.push_back({opcode, arg, line});
+    }
+
+    bool finish() {
+        vector<pair<int, string_view>> undefined;
+        for (size_t i = 0; i < program.labels.size(); i++) {
+            if (!defined_lines[i]) {
+                undefined.emplace_back(first_use_lines[i], program.labels[i]);
+            }
+        }
+        return report_undefined_labels(source_path, undefined);
+    }
+};
+
+// feeds the labels and instructions of the source to sink; false on errors, which it reports
+template<typename Sink>
+bool parse(const char* source_path, tokenizer words, Sink& sink) {
+    mnemonic_table table;
+    unordered_set<string_view> functions;
+    // (line, name) of every CALL
+    vector<pair<int, string_view>> calls;
+    // what RET returns in the current function, -1 before the first one
+    int results = -1;
+    for (auto word = words.next(); !word.empty(); word = words.next()) {
+        if (word.back() == ':') {
+            // this is a label
+            word.remove_suffix(1);
+            if (!sink.define_label(word, words.line, false)) {
+                return false;
+            }
+            continue;
+        }
+        if (word == ".func") {
+            auto name = words.next();
+            int args;
+            if (name.empty() || !parse_int(words.next(), args) || !parse_int(words.next(), results) ||
+                args < 0 || args > MAX_FUNCTION_ARGS || results < 0 || results > MAX_FUNCTION_RESULTS) {
+                cerr << source_path << ":" << words.line << ": .func needs a name, up to " << MAX_FUNCTION_ARGS
+                     << " arguments and up to " << MAX_FUNCTION_RESULTS << " results\n";
+                return false;
+            }
+            if (!sink.define_label(name, words.line, true)) {
+                return false;
+            }
+            functions.insert(name);
+            sink.instruction(OP_ENTER, args, {}, words.line);
+            continue;
+        }
+        // otherwise this is an instruction
+        int opcode = table.find(word);
+        if (opcode < 0) {
+            cerr << source_path << ":" << words.line << ": unknown instruction " << word << "\n";
+            return false;
+        }
+        int line = words.line, arg = 0;
+        string_view jump_target;
+        // if it has an argument, we need to read it
+        if (opcode_mnemonics[opcode].argument == INT_ARGUMENT && !parse_int(words.next(), arg)) {
+            cerr << source_path << ":" << words.line << ": " << word << " needs a number\n";
+            return false;
+        }
+        if (opcode == OP_ENTER) {
+            cerr << source_path << ":" << line << ": ENTER is written by .func\n";
+            return false;
+        }
+        if (opcode == OP_RET) {
+            if (results < 0) {
+                cerr << source_path << ":" << line << ": RET outside of a function\n";
+                return false;
+            }
+            arg = results;
+        }
+        if (opcode_mnemonics[opcode].argument == LABEL_ARGUMENT) {
+            jump_target = words.next();
+            if (jump_target.empty()) {
+                cerr << source_path << ":" << words.line << ": " << word << " needs a label\n";
+                return false;
+            }
+        }
+        if (opcode == OP_CALL) {
+            calls.emplace_back(line, jump_target);
+        }
+        sink.instruction(opcode, arg, jump_target, line);
+    }
+    for (auto& [line, name] : calls) {
+        if (!functions.count(name)) {
+            cerr << source_path << ":" << line << ": CALL " << name << " needs a .func\n";
+            return false;
+        }
+    }
+    return sink.finish();
+}
+
+int main(int argc, char** argv) {
+    // --legacy writes the old format: ints only, with label marks.
+    // --memory-size and --stack-size go to the header, 0 leaves them to the VM.
+    // --map also writes program.pvm.map with the source line of every instruction, the labels and
+    // where basic blocks start.
+    // -O optimizes the program before writing it, see optimize_program(). That needs the whole
+    // program in memory
+    bool legacy = false, write_map = false, optimize = false;
+    uint32_t memory_size = 0, stack_size = 0;
+    int arg = 1;
+    for (; arg < argc - 2; arg++) {
+        if (strcmp(argv[arg], "--legacy") == 0) {
+            legacy = true;
+        } else if (strcmp(argv[arg], "--map") == 0) {
+            write_map = true;
+        } else if (strcmp(argv[arg], "-O") == 0) {
+            optimize = true;
+        } else if (strcmp(argv[arg], "--memory-size") == 0 && arg + 1 < argc - 2) {
+            if (!parse_size(argv[++arg], MAX_MEMORY_SIZE, memory_size)) {
+                break;
+            }
+        } else if (strcmp(argv[arg], "--stack-size") == 0 && arg + 1 < argc - 2) {
+            if (!parse_size(argv[++arg], MAX_STACK_SIZE, stack_size)) {
+                break;
+            }
+        } else {
+            break;
+        }
+    }
+    if (arg != argc - 2 || (legacy && (memory_size || stack_size))) {
+        cerr << "usage: ./asm [--legacy | [--memory-size CELLS] [--stack-size ENTRIES]] [--map] [-O] program.c.pvm program.pvm";
+        return 1;
+    }
+    const char* source_path = argv[argc - 2];
+    const char* output_path = argv[argc - 1];
+
+    int source_fd = open(source_path, O_RDONLY);
+    struct stat source_info = {};
+    if (source_fd < 0 || fstat(source_fd, &source_info) < 0) {
+        cerr << source_path << ": " << strerror(errno) << "\n";
         return 1;
     }
-    void* memory = mmap(nullptr, size, PROT_WRITE, MAP_SHARED, fd, 0);
-    if (memory == MAP_FAILED) {
-        cerr << strerror(errno);
+    size_t source_size = source_info.st_size;
+    // mmap() refuses empty files
+    const char* source = "";
+    if (source_size) {
+        auto data = mmap(nullptr, source_size, PROT_READ, MAP_PRIVATE, source_fd, 0);
+        if (data == MAP_FAILED) {
+            cerr << source_path << ": " << strerror(errno) << "\n";
+            return 1;
+        }
+        madvise(data, source_size, MADV_SEQUENTIAL);
+        source = (const char*) data;
+    }
+    tokenizer words = {source, source + source_size};
+    // -O reads everything before anything gets written
+    program_collector collector;
+    collector.source_path = source_path;
+    if (optimize) {
+        if (!parse(source_path, words, collector)) {
+            return 1;
+        }
+        optimize_program(collector.program);
+    }
+
+    assembler writer;
+    writer.source_path = source_path;
+    writer.legacy = legacy;
+    writer.header = {PVM_MAGIC, PVM_VERSION, 0, memory_size, stack_size, 0};
+    writer.out.fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (writer.out.fd < 0) {
+        cerr << output_path << ": " << strerror(errno) << "\n";
         return 1;
     }
-    memcpy(memory, &result[0], size);
-    munmap(memory, size);
-    close(fd);
+    writer.out.buffer.reserve(1 << 20);
+    string map_path = string(output_path) + ".map";
+    if (write_map) {
+        writer.map = fopen(map_path.c_str(), "w");
+        if (!writer.map) {
+            cerr << map_path << ": " << strerror(errno) << "\n";
+            return 1;
+        }
+        auto real_source = realpath(source_path, nullptr);
+        fprintf(writer.map, "pvm-map 1\nsource %s\n", real_source ? real_source : source_path);
+        free(real_source);
+    }
+    // deletes what was written so far and fails
+    auto fail = [&]() {
+        unlink(output_path);
+        if (write_map) {
+            unlink(map_path.c_str());
+        }
+        return 1;
+    };
+    writer.start();
+    if (optimize) {
+        auto& program = collector.program;
+        for (size_t i = 0; i < program.code.size(); i++) {
+            auto& insn = program.code[i];
+            if (insn.opcode == LABEL_DEFINITION) {
+                bool function = i + 1 < program.code.size() && program.code[i + 1].opcode == OP_ENTER;
+                writer.define_label(program.labels[insn.arg], insn.line, function);
+            } else {
+                bool jump = opcode_mnemonics[insn.opcode].argument == LABEL_ARGUMENT;
+                writer.instruction(insn.opcode, insn.arg, jump ? program.labels[insn.arg] : string_view(), insn.line);
+            }
+        }
+        if (!writer.finish()) {
+            return fail();
+        }
+    } else if (!parse(source_path, words, writer)) {
+        return fail();
+    }
+    if (!writer.write_ok || close(writer.out.fd) < 0) {
+        cerr << output_path << ": " << strerror(errno) << "\n";
+        return fail();
+    }
+    if (writer.map && fclose(writer.map) != 0) {
+        cerr << "can't write the map file";
+        return fail();
+    }
+    if (source_size) {
+        munmap((void*) source, source_size);
+    }
+    close(source_fd);
 }
@@ -0,0 +1,132 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Measures how fast PigletASM assembles a machine generated program, for example
+//   ./asm_bench --instructions 5000000 --iterations 3
+// The program is written to a temporary directory: blocks of arithmetic, each ending in a forward
+// and a backward jump, so that label fixups are part of the work. Every format is timed by running
+// PigletASM PIGLET_ASM on it, and the timings are printed as JSON.
+
+struct asm_format {
+    const char* name;
+    vector<const char*> options;
+};
+
+const asm_format formats[] = {
+        {"v2", {}},
+        {"legacy", {"--legacy"}},
+        {"v2_map", {"--map"}},
+};
+
+// about instructions instructions, 8 per block; returns how many there are
+long generate_program(const string& path, long instructions) {
+    ofstream out(path);
+    long blocks = max(1L, instructions / 8);
+    for (long block = 0; block < blocks; block++) {
+        out << "block" << block << ":\n"
+            << "    PUSHI " << block << "\n"
+            << "    LOADI " << block % 1000 << "\n"
+            << "    ADD\n"
+            << "    STOREI " << block % 1000 << "\n"
+            << "    LOADADDI 7\n"
+            << "    GREATER_OR_EQUALI -" << block % 100 << "\n"
+            << "    JUMP_IF_FALSE block" << block + 1 << "\n"
+            << "    JUMP block" << block / 2 << "\n";
+    }
+    out << "block" << blocks << ":\n"
+        << "    DONE\n";
+    return blocks * 8 + 1;
+}
+
+double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// runs PigletASM with arguments, false if it fails
+bool run_asm(const vector<const char*>& arguments) {
+    vector<char*> argv = {(char*) PIGLET_ASM};
+    for (auto argument : arguments) {
+        argv.push_back((char*) argument);
+    }
+    argv.push_back(nullptr);
+    auto pid = fork();
+    if (pid == 0) {
+        execv(PIGLET_ASM, argv.data());
+        _exit(127);
+    }
+    int status = 0;
+    return pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+long file_size(const string& path) {
+    struct stat info = {};
+    return stat(path.c_str(), &info) == 0 ? info.st_size : 0;
+}
+
+int main(int argc, char** argv) {
+    long instructions = 2000000;
+    int iterations = 5;
+    for (int arg = 1; arg < argc; arg++) {
+        if (strcmp(argv[arg], "--instructions") == 0 && arg + 1 < argc) {
+            instructions = atol(argv[++arg]);
+        } else if (strcmp(argv[arg], "--iterations") == 0 && arg + 1 < argc) {
+            iterations = atoi(argv[++arg]);
+        } else {
+            cerr << "usage ./asm_bench [--instructions N] [--iterations N]\n";
+            return 1;
+        }
+    }
+    char dir[] = "/tmp/piglet-asm-bench-XXXXXX";
+    if (!mkdtemp(dir)) {
+        cerr << "can't create a temporary directory: " << strerror(errno) << "\n";
+        return 1;
+    }
+    auto source = string(dir) + "/program.c.pvm", output = string(dir) + "/program.pvm";
+    instructions = generate_program(source, instructions);
+    auto source_size = file_size(source);
+
+    cout.precision(9);
+    cout << "{\"instructions\": " << instructions << ", \"source_bytes\": " << source_size
+         << ", \"results\": [\n";
+    bool ok = true;
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]) && ok; i++) {
+        auto arguments = formats[i].options;
+        arguments.push_back(source.c_str());
+        arguments.push_back(output.c_str());
+        double mean = 0, min_seconds = 0;
+        for (int j = 0; j < iterations && ok; j++) {
+            auto start = chrono::steady_clock::now();
+            ok = run_asm(arguments);
+            auto seconds = seconds_since(start);
+            mean += seconds / iterations;
+            min_seconds = j == 0 ? seconds : min(min_seconds, seconds);
+        }
+        if (!ok) {
+            cerr << PIGLET_ASM << " failed\n";
+            break;
+        }
+        cout << "    {\"format\": \"" << formats[i].name << "\", \"iterations\": " << iterations
+             << ", \"output_bytes\": " << file_size(output) << ", \"mean_seconds\": " << mean
+             << ", \"min_seconds\": " << min_seconds
+             << ", \"instructions_per_second\": " << (mean > 0 ? instructions / mean : 0)
+             << ", \"source_megabytes_per_second\": " << (mean > 0 ? source_size / mean / 1e6 : 0) << "}"
+             << (i + 1 < sizeof(formats) / sizeof(formats[0]) ? ",\n" : "\n");
+    }
+    cout << "]}\n";
+    unlink(source.c_str());
+    unlink(output.c_str());
+    unlink((output + ".map").c_str());
+    rmdir(dir);
+    return ok ? 0 : 1;
+}
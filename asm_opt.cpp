@@ -0,0 +1,416 @@
+#include <climits>
+#include <unordered_map>
+#include "asm_opt.h"
+
+using namespace std;
+
+// Constant addresses below this are valid in every VM: memory sizes are rounded up to multiples
+// of it. The verifier rejects LOADI and STOREI with addresses outside memory, so addresses that
+// are only known here are turned into those only when they are certainly inside
+const int ALWAYS_VALID_ADDRESSES = 16384;
+
+// opcode of jumps to the next instruction until simplify_control_flow() drops them
+const int REMOVED = -2;
+
+static bool is_jump(int opcode) {
+    return opcode == OP_JUMP || opcode == OP_JUMP_IF_TRUE || opcode == OP_JUMP_IF_FALSE;
+}
+
+// instructions after which the next one only runs if it is a jump target
+static bool ends_flow(int opcode) {
+    return opcode == OP_JUMP || opcode == OP_DONE || opcode == OP_ABORT || opcode == OP_RET;
+}
+
+static bool valid_address(int addr) {
+    return addr >= 0 && addr < ALWAYS_VALID_ADDRESSES;
+}
+
+// values opcode pops and pushes; false for the instructions that end a basic block and the ones
+// that count stack entries from the start of the frame
+static bool stack_effect(int opcode, int& pops, int& pushes) {
+    switch (opcode) {
+        case OP_PUSHI:
+        case OP_LOADI:
+            pops = 0, pushes = 1;
+            return true;
+        case OP_LOADADDI:
+        case OP_LOAD:
+        case OP_ADDI:
+        case OP_GREATER_OR_EQUALI:
+            pops = 1, pushes = 1;
+            return true;
+        case OP_STOREI:
+        case OP_DISCARD:
+        case OP_POP_RES:
+        case OP_PRINT:
+            pops = 1, pushes = 0;
+            return true;
+        case OP_SPAWN:
+        case OP_JOIN:
+        case OP_NATIVE:
+            pops = 1, pushes = 1;
+            return true;
+        case OP_ATOMIC_ADD:
+            pops = 2, pushes = 1;
+            return true;
+        case OP_CAS:
+            pops = 3, pushes = 1;
+            return true;
+        case OP_STORE:
+            pops = 2, pushes = 0;
+            return true;
+        case OP_FILL:
+            pops = 4, pushes = 0;
+            return true;
+        case OP_COPY:
+            pops = 3, pushes = 0;
+            return true;
+        case OP_DUP:
+            pops = 1, pushes = 2;
+            return true;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_DIV:
+        case OP_MUL:
+        case OP_EQUAL:
+        case OP_LESS:
+        case OP_LESS_OR_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_OR_EQUAL:
+        case OP_SCAN_ZERO:
+        case OP_SCAN_NONZERO:
+            pops = 2, pushes = 1;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// a op b the way the VM computes it, false where the VM would stop with an error
+static bool fold(int opcode, int a, int b, int& result) {
+    switch (opcode) {
+        case OP_ADD:
+            result = (int) ((unsigned) a + (unsigned) b);
+            return true;
+        case OP_SUB:
+            result = (int) ((unsigned) a - (unsigned) b);
+            return true;
+        case OP_MUL:
+            result = (int) ((unsigned) a * (unsigned) b);
+            return true;
+        case OP_DIV:
+            if (b == 0 || (a == INT_MIN && b == -1)) {
+                return false;
+            }
+            result = a / b;
+            return true;
+        case OP_EQUAL:
+            result = a == b;
+            return true;
+        case OP_LESS:
+            result = a < b;
+            return true;
+        case OP_LESS_OR_EQUAL:
+            result = a <= b;
+            return true;
+        case OP_GREATER:
+            result = a > b;
+            return true;
+        case OP_GREATER_OR_EQUAL:
+            result = a >= b;
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Appends instructions to code, simplifying each with the ones before it in its basic block
+struct peephole {
+    vector<asm_insn> code;
+    // memory cells with a known value in the current basic block
+    unordered_map<int, int> cells;
+
+    // the instruction count back from the end, null if a label comes first
+    asm_insn* last(size_t count) {
+        for (size_t i = 1; i <= count; i++) {
+            if (code.size() < i || code[code.size() - i].opcode == LABEL_DEFINITION) {
+                return nullptr;
+            }
+        }
+        return &code[code.size() - count];
+    }
+
+    bool last_is(size_t count, int opcode) {
+        auto insn = last(count);
+        return insn && insn->opcode == opcode;
+    }
+
+    void drop(size_t count) {
+        code.resize(code.size() - count);
+    }
+
+    // For STORE: the PUSHI of its address when nothing between the two touches that value, so
+    // that the push can go and the STORE become STOREI. -1 if there is none
+    long store_address() {
+        // values the instructions after i take from below them, and how many they leave
+        int taken = 0, left = 0;
+        for (long i = (long) code.size() - 1; i >= 0 && i >= (long) code.size() - 32; i--) {
+            auto& insn = code[i];
+            if (insn.opcode == OP_PUSHI && taken == 0 && left == 1) {
+                return valid_address(insn.arg) ? i : -1;
+            }
+            int pops, pushes;
+            if (insn.opcode == LABEL_DEFINITION || !stack_effect(insn.opcode, pops, pushes)) {
+                return -1;
+            }
+            taken = pops + max(0, taken - pushes);
+            left += pushes - pops;
+        }
+        return -1;
+    }
+
+    void append(asm_insn insn) {
+        auto op = insn.opcode, arg = insn.arg;
+        auto top = last(1);
+        int value;
+        switch (op) {
+            case LABEL_DEFINITION:
+                cells.clear();
+                break;
+            case OP_DISCARD:
+                if (top && (top->opcode == OP_PUSHI || top->opcode == OP_DUP)) {
+                    return drop(1);
+                }
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_EQUAL:
+            case OP_LESS:
+            case OP_LESS_OR_EQUAL:
+            case OP_GREATER:
+            case OP_GREATER_OR_EQUAL:
+                if (top && top->opcode == OP_DUP && last_is(2, OP_PUSHI) && fold(op, last(2)->arg, last(2)->arg, value)) {
+                    drop(1);
+                    last(1)->arg = value;
+                    return;
+                }
+                if (top && top->opcode == OP_PUSHI) {
+                    // rewritten instructions keep the line of the first one they replace
+                    auto k = top->arg, line = top->line;
+                    if (last_is(2, OP_PUSHI) && fold(op, last(2)->arg, k, value)) {
+                        auto line = last(2)->line;
+                        drop(2);
+                        return append({OP_PUSHI, value, line});
+                    }
+                    if (op == OP_ADD || op == OP_SUB) {
+                        drop(1);
+                        return append({OP_ADDI, op == OP_ADD ? k : (int) (0u - (unsigned) k), line});
+                    }
+                    if ((op == OP_MUL || op == OP_DIV) && k == 1) {
+                        return drop(1);
+                    }
+                    if (op == OP_GREATER_OR_EQUAL || (op == OP_GREATER && k != INT_MAX)) {
+                        drop(1);
+                        return append({OP_GREATER_OR_EQUALI, op == OP_GREATER ? k + 1 : k, line});
+                    }
+                }
+                if (op == OP_ADD && top && top->opcode == OP_LOADI) {
+                    auto addr = top->arg, line = top->line;
+                    drop(1);
+                    return append({OP_LOADADDI, addr, line});
+                }
+                break;
+            case OP_ADDI:
+                if (arg == 0) {
+                    return;
+                }
+                if (top && (top->opcode == OP_PUSHI || top->opcode == OP_ADDI)) {
+                    top->arg = (int) ((unsigned) top->arg + (unsigned) arg);
+                    if (top->opcode == OP_ADDI && top->arg == 0) {
+                        drop(1);
+                    }
+                    return;
+                }
+                break;
+            case OP_GREATER_OR_EQUALI:
+                if (top && top->opcode == OP_PUSHI) {
+                    top->arg = top->arg >= arg;
+                    return;
+                }
+                break;
+            case OP_LOAD:
+                if (top && top->opcode == OP_PUSHI && valid_address(top->arg)) {
+                    auto addr = top->arg, line = top->line;
+                    drop(1);
+                    return append({OP_LOADI, addr, line});
+                }
+                break;
+            case OP_LOADI:
+                if (cells.count(arg)) {
+                    return append({OP_PUSHI, cells[arg], insn.line});
+                }
+                break;
+            case OP_LOADADDI:
+                if (cells.count(arg)) {
+                    return append({OP_ADDI, cells[arg], insn.line});
+                }
+                break;
+            case OP_STOREI:
+                if (top && top->opcode == OP_DUP && last_is(2, OP_PUSHI)) {
+                    cells[arg] = last(2)->arg;
+                } else if (top && top->opcode == OP_PUSHI) {
+                    cells[arg] = top->arg;
+                } else {
+                    cells.erase(arg);
+                }
+                break;
+            case OP_CALL:
+            case OP_FILL:
+            case OP_COPY:
+            case OP_ATOMIC_ADD:
+            case OP_CAS:
+            case OP_SPAWN:
+            case OP_JOIN:
+            case OP_NATIVE:
+                // the function, the range written, a worker or the host may cover any cell
+                cells.clear();
+                break;
+            case OP_STORE: {
+                auto address = store_address();
+                if (address >= 0) {
+                    auto addr = code[address].arg, line = code[address].line;
+                    code.erase(code.begin() + address);
+                    return append({OP_STOREI, addr, line});
+                }
+                cells.clear();
+                break;
+            }
+            case OP_JUMP_IF_TRUE:
+            case OP_JUMP_IF_FALSE: {
+                if (top && top->opcode == OP_PUSHI) {
+                    bool taken = (top->arg != 0) == (op == OP_JUMP_IF_TRUE);
+                    drop(1);
+                    if (taken) {
+                        append({OP_JUMP, arg, insn.line});
+                    }
+                    return;
+                }
+                // x < k is !(x >= k), x <= k is !(x >= k + 1)
+                if (top && (top->opcode == OP_LESS || top->opcode == OP_LESS_OR_EQUAL) && last_is(2, OP_PUSHI) &&
+                    (top->opcode == OP_LESS || last(2)->arg != INT_MAX)) {
+                    auto k = top->opcode == OP_LESS ? last(2)->arg : last(2)->arg + 1;
+                    auto line = last(2)->line;
+                    drop(2);
+                    append({OP_GREATER_OR_EQUALI, k, line});
+                    return append({op == OP_JUMP_IF_TRUE ? OP_JUMP_IF_FALSE : OP_JUMP_IF_TRUE, arg, insn.line});
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        code.push_back(insn);
+    }
+};
+
+// Threads jumps to jumps, drops jumps to the next instruction, unreachable code and labels no
+// jump refers to. Functions nobody calls are unreachable as well. True if anything changed
+static bool simplify_control_flow(asm_program& program) {
+    auto& code = program.code;
+    bool changed = false;
+    vector<long> positions(program.labels.size(), -1);
+    for (size_t i = 0; i < code.size(); i++) {
+        if (code[i].opcode == LABEL_DEFINITION) {
+            positions[code[i].arg] = i;
+        }
+    }
+    // the first instruction at or after position
+    auto next_insn = [&](size_t position) {
+        while (position < code.size() && code[position].opcode == LABEL_DEFINITION) {
+            position++;
+        }
+        return position;
+    };
+    for (size_t i = 0; i < code.size(); i++) {
+        auto& insn = code[i];
+        if (!is_jump(insn.opcode)) {
+            continue;
+        }
+        // a bounded number of hops, jumps can go around in circles
+        for (int hops = 0; hops < 16; hops++) {
+            auto target = next_insn(positions[insn.arg]);
+            if (target >= code.size() || code[target].opcode != OP_JUMP || code[target].arg == insn.arg) {
+                break;
+            }
+            insn.arg = code[target].arg;
+            changed = true;
+        }
+        auto target = next_insn(positions[insn.arg]);
+        if (positions[insn.arg] > (long) i && target == next_insn(i + 1)) {
+            // to the next instruction: a conditional jump still has to pop its condition
+            insn = {insn.opcode == OP_JUMP ? REMOVED : OP_DISCARD, 0, insn.line};
+            changed = true;
+        } else if (insn.opcode == OP_JUMP && target < code.size() &&
+                   (code[target].opcode == OP_DONE || code[target].opcode == OP_ABORT || code[target].opcode == OP_RET)) {
+            insn = {code[target].opcode, code[target].arg, insn.line};
+            changed = true;
+        }
+    }
+
+    // the program starts at its first item
+    vector<bool> reachable(code.size());
+    vector<bool> referenced(program.labels.size());
+    vector<size_t> pending;
+    if (!code.empty()) {
+        pending.push_back(0);
+    }
+    auto reach = [&](size_t i) {
+        if (i < code.size() && !reachable[i]) {
+            reachable[i] = true;
+            pending.push_back(i);
+        }
+    };
+    while (!pending.empty()) {
+        auto i = pending.back();
+        pending.pop_back();
+        reachable[i] = true;
+        auto& insn = code[i];
+        // workers start at the target of SPAWN
+        if (is_jump(insn.opcode) || insn.opcode == OP_CALL || insn.opcode == OP_SPAWN) {
+            referenced[insn.arg] = true;
+            reach(positions[insn.arg]);
+        }
+        if (!ends_flow(insn.opcode)) {
+            reach(i + 1);
+        }
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < code.size(); i++) {
+        auto& insn = code[i];
+        if (reachable[i] && insn.opcode != REMOVED && (insn.opcode != LABEL_DEFINITION || referenced[insn.arg])) {
+            code[kept++] = insn;
+        }
+    }
+    changed = changed || kept != code.size();
+    code.resize(kept);
+    return changed;
+}
+
+void optimize_program(asm_program& program) {
+    // every round only makes the program shorter, the limit is for rewrites that don't
+    for (int round = 0; round < 16; round++) {
+        bool changed = simplify_control_flow(program);
+        peephole folded;
+        folded.code.reserve(program.code.size());
+        for (auto& insn : program.code) {
+            folded.append(insn);
+        }
+        changed = changed || folded.code.size() != program.code.size();
+        program.code = std::move(folded.code);
+        if (!changed) {
+            break;
+        }
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef ASM_OPT_H
+#define ASM_OPT_H
+
+#include <string_view>
+#include <vector>
+#include "pvm_format.h"
+
+// What asm -O keeps of a program before writing it: the instructions and label definitions in
+// source order. Jumps and labels refer to labels by their index in labels.
+
+// opcode of the items that define a label
+const int LABEL_DEFINITION = -1;
+
+struct asm_insn {
+    // an opcode or LABEL_DEFINITION
+    int opcode;
+    // the number argument, or the label index for jumps, calls and label definitions
+    int arg;
+    // source line
+    int line;
+};
+
+struct asm_program {
+    std::vector<asm_insn> code;
+    // label index -> name
+    std::vector<std::string_view> labels;
+};
+
+// Rewrites the program into one that prints the same and ends the same way, in fewer instructions:
+// jumps to jumps go to the final target, unreachable code and unused labels go away, constants
+// are folded and propagated through the stack and the memory cells of a basic block, and
+// instructions with a constant operand become their immediate forms (PUSHI k; ADD -> ADDI k).
+// Runs until nothing changes any more.
+void optimize_program(asm_program& program);
+
+#endif //ASM_OPT_H
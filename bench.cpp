@@ -0,0 +1,187 @@
+#include <cmath>
+#include <dirent.h>
+#include "vm.h"
+
+using namespace std;
+
+// Runs programs under the VM's engines and prints the timings as JSON, for example
+//   ./bench --iterations 50 --engines interpreter,jit
+// Without program arguments it runs the programs CMake assembled into PIGLET_BENCH_PROGRAMS: the
+// samples and bigger variants of them. Every engine gets its own VM; the first run of it is reported
+// separately because it includes compiling, the other runs are the execution time.
+
+// swallows what the programs print, which would otherwise dominate the timings
+struct null_buffer : streambuf {
+    int overflow(int c) override {
+        return c;
+    }
+
+    streamsize xsputn(const char*, streamsize count) override {
+        return count;
+    }
+};
+
+struct vm_engine {
+    const char* name;
+    run_mode mode;
+    // for run(): 0 interprets everything
+    unsigned hot_loop_threshold;
+};
+
+const vm_engine engines[] = {
+        {"interpreter", RUN_INTERPRETER, 0},
+        {"tiered", RUN_INTERPRETER, DEFAULT_HOT_LOOP_THRESHOLD},
+        {"threaded", RUN_THREADED, 0},
+        {"jit", RUN_JIT, 0},
+        {"registers", RUN_REGISTERS, 0},
+};
+
+struct engine_result {
+    const vm_engine* engine;
+    double first_run_seconds, compile_seconds;
+    vector<double> run_seconds;
+};
+
+string program_name(const string& path) {
+    auto name = path.substr(path.rfind('/') + 1);
+    return name.size() > 4 && name.compare(name.size() - 4, 4, ".pvm") == 0 ? name.substr(0, name.size() - 4) : name;
+}
+
+vector<string> default_programs() {
+    vector<string> paths;
+    auto dir = opendir(PIGLET_BENCH_PROGRAMS);
+    if (!dir) {
+        return paths;
+    }
+    while (auto entry = readdir(dir)) {
+        string name = entry->d_name;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".pvm") == 0 && name.find(".c.pvm") == string::npos) {
+            paths.push_back(string(PIGLET_BENCH_PROGRAMS) + "/" + name);
+        }
+    }
+    closedir(dir);
+    sort(paths.begin(), paths.end());
+    return paths;
+}
+
+double seconds_since(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// false if there is no memory for the program's VM
+bool bench_engine(const vm_engine& engine, const bytecode& program, int iterations, ostream& sink,
+                  engine_result& result) {
+    result = {&engine, 0, 0, {}};
+    auto vm = make_unique<VM>();
+    string error;
+    if (!vm->load(program, error)) {
+        cerr << error << "\n";
+        return false;
+    }
+    vm->set_output(sink, cerr);
+    vm->set_hot_loop_threshold(engine.hot_loop_threshold);
+    auto start = chrono::steady_clock::now();
+    run_vm(*vm, engine.mode);
+    result.first_run_seconds = seconds_since(start);
+    result.compile_seconds = vm->get_compile_seconds();
+    for (int i = 0; i < iterations; i++) {
+        vm->reset();
+        start = chrono::steady_clock::now();
+        run_vm(*vm, engine.mode);
+        result.run_seconds.push_back(seconds_since(start));
+    }
+    return true;
+}
+
+void print_result(const engine_result& result, uint64_t instructions) {
+    auto& runs = result.run_seconds;
+    double mean = 0, variance = 0, min_seconds = runs.empty() ? 0 : runs[0];
+    for (auto seconds : runs) {
+        mean += seconds / runs.size();
+        min_seconds = min(min_seconds, seconds);
+    }
+    for (auto seconds : runs) {
+        variance += (seconds - mean) * (seconds - mean) / runs.size();
+    }
+    cout << "        {\"engine\": \"" << result.engine->name << "\", \"iterations\": " << runs.size()
+         << ", \"first_run_seconds\": " << result.first_run_seconds
+         << ", \"compile_seconds\": " << result.compile_seconds
+         << ", \"mean_seconds\": " << mean << ", \"stddev_seconds\": " << sqrt(variance)
+         << ", \"min_seconds\": " << min_seconds
+         << ", \"instructions_per_second\": " << (mean > 0 ? instructions / mean : 0) << "}";
+}
+
+int main(int argc, char** argv) {
+    int iterations = 20;
+    string engine_names = "interpreter,tiered,threaded,jit,registers";
+    program_options options;
+    // the cache would hide the compile time
+    options.use_cache = false;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--iterations") == 0 && arg + 1 < argc) {
+            iterations = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "--engines") == 0 && arg + 1 < argc) {
+            engine_names = argv[++arg];
+        } else if (strcmp(argv[arg], "--no-fuse") == 0) {
+            options.fuse = false;
+        } else {
+            cerr << "usage ./bench [--iterations N] [--engines interpreter,tiered,threaded,jit,registers] [--no-fuse] [program.pvm...]\n";
+            return 1;
+        }
+    }
+    vector<string> paths(argv + arg, argv + argc);
+    if (paths.empty()) {
+        paths = default_programs();
+    }
+    if (paths.empty()) {
+        cerr << "no programs in " << PIGLET_BENCH_PROGRAMS << "\n";
+        return 1;
+    }
+    vector<const vm_engine*> selected;
+    for (auto& engine : engines) {
+        if (("," + engine_names + ",").find(string(",") + engine.name + ",") != string::npos) {
+            selected.push_back(&engine);
+        }
+    }
+
+    null_buffer null;
+    ostream sink(&null);
+    cout.precision(9);
+    cout << "{\"bulk_kernels\": \"" << bulk_kernels_name() << "\", \"benchmarks\": [\n";
+    for (size_t i = 0; i < paths.size(); i++) {
+        program_file file;
+        if (!open_program(paths[i].c_str(), options, file)) {
+            return 1;
+        }
+        // what the stack interpreter and the register interpreter dispatch
+        uint64_t instructions, register_instructions;
+        {
+            VM vm;
+            string error;
+            if (!vm.load(file.program, error)) {
+                cerr << error << "\n";
+                return 1;
+            }
+            vm.set_output(sink, cerr);
+            instructions = vm.count_instructions();
+            vm.reset();
+            register_instructions = vm.count_register_instructions();
+        }
+        cout << "    {\"program\": \"" << program_name(paths[i]) << "\", \"instructions\": " << instructions
+             << ", \"register_instructions\": " << register_instructions
+             << ", \"code_size\": " << file.program.size << ", \"results\": [\n";
+        for (size_t j = 0; j < selected.size(); j++) {
+            engine_result result;
+            if (!bench_engine(*selected[j], file.program, iterations, sink, result)) {
+                return 1;
+            }
+            print_result(result, instructions);
+            cout << (j + 1 < selected.size() ? ",\n" : "\n");
+        }
+        cout << "    ]}" << (i + 1 < paths.size() ? ",\n" : "\n");
+        cout.flush();
+        close_program(file);
+    }
+    cout << "]}\n";
+}
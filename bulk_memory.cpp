@@ -0,0 +1,261 @@
+#include "bulk_memory.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BULK_X86 1
+#endif
+
+// A cell number for the error messages, which fit in an int
+static int clamp_cell(int64_t cell) {
+    return (int) std::clamp(cell, (int64_t) INT_MIN, (int64_t) INT_MAX);
+}
+
+// The kernels only ever see cells that are known to be inside of memory
+
+static void fill_scalar(int* to, int64_t count, int value) {
+    std::fill(to, to + count, value);
+}
+
+static void fill_strided_scalar(int* to, int64_t count, int64_t stride, int value) {
+    int64_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        to[0] = value;
+        to[stride] = value;
+        to[2 * stride] = value;
+        to[3 * stride] = value;
+        to += 4 * stride;
+    }
+    for (; i < count; i++) {
+        *to = value;
+        to += stride;
+    }
+}
+
+// index of the first matching cell of count, or count
+static int64_t scan_scalar(const int* from, int64_t count, bool zero) {
+    for (int64_t i = 0; i < count; i++) {
+        if ((from[i] == 0) == zero) {
+            return i;
+        }
+    }
+    return count;
+}
+
+#ifdef BULK_X86
+
+__attribute__((target("sse2")))
+static void fill_sse2(int* to, int64_t count, int value) {
+    auto values = _mm_set1_epi32(value);
+    int64_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        _mm_storeu_si128((__m128i*) (to + i), values);
+        _mm_storeu_si128((__m128i*) (to + i + 4), values);
+    }
+    for (; i < count; i++) {
+        to[i] = value;
+    }
+}
+
+__attribute__((target("sse2")))
+static int64_t scan_sse2(const int* from, int64_t count, bool zero) {
+    auto zeros = _mm_setzero_si128();
+    // bits of the lanes that match
+    int flip = zero ? 0 : 0xf;
+    int64_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        auto cells = _mm_loadu_si128((const __m128i*) (from + i));
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(cells, zeros))) ^ flip;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scan_scalar(from + i, count - i, zero);
+}
+
+__attribute__((target("avx2")))
+static void fill_avx2(int* to, int64_t count, int value) {
+    auto values = _mm256_set1_epi32(value);
+    int64_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        _mm256_storeu_si256((__m256i*) (to + i), values);
+        _mm256_storeu_si256((__m256i*) (to + i + 8), values);
+    }
+    if (i + 8 <= count) {
+        _mm256_storeu_si256((__m256i*) (to + i), values);
+        i += 8;
+    }
+    for (; i < count; i++) {
+        to[i] = value;
+    }
+}
+
+// Strides below 8 hit every block of 8 cells at least once, so each block gets a single masked store.
+// The lanes a block writes only depend on where it starts modulo the stride
+const int MAX_MASKED_STRIDE = 7;
+
+__attribute__((target("avx2")))
+static void fill_strided_avx2(int* to, int64_t count, int64_t stride, int value) {
+    if (stride > MAX_MASKED_STRIDE) {
+        fill_strided_scalar(to, count, stride, value);
+        return;
+    }
+    // mask of the block that starts phase cells after a written one
+    alignas(32) int masks[MAX_MASKED_STRIDE][8];
+    for (int phase = 0; phase < stride; phase++) {
+        for (int lane = 0; lane < 8; lane++) {
+            masks[phase][lane] = (phase + lane) % stride == 0 ? -1 : 0;
+        }
+    }
+    auto values = _mm256_set1_epi32(value);
+    // cells from to, the last written one included
+    int64_t size = (count - 1) * stride + 1;
+    int64_t block = 0;
+    int phase = 0;
+    for (; block + 8 <= size; block += 8) {
+        _mm256_maskstore_epi32(to + block, _mm256_load_si256((const __m256i*) masks[phase]), values);
+        phase = (int) ((phase + 8) % stride);
+    }
+    // the first cell at or after block that is written
+    for (int64_t cell = block + (phase ? stride - phase : 0); cell < size; cell += stride) {
+        to[cell] = value;
+    }
+}
+
+__attribute__((target("avx2")))
+static int64_t scan_avx2(const int* from, int64_t count, bool zero) {
+    auto zeros = _mm256_setzero_si256();
+    int flip = zero ? 0 : 0xff;
+    int64_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        auto cells = _mm256_loadu_si256((const __m256i*) (from + i));
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(cells, zeros))) ^ flip;
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scan_sse2(from + i, count - i, zero);
+}
+
+#endif
+
+struct bulk_kernels {
+    const char* name;
+    void (*fill)(int*, int64_t, int);
+    void (*fill_strided)(int*, int64_t, int64_t, int);
+    int64_t (*scan)(const int*, int64_t, bool);
+};
+
+static bulk_kernels pick_kernels() {
+#ifdef BULK_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return {"avx2", fill_avx2, fill_strided_avx2, scan_avx2};
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return {"sse2", fill_sse2, fill_strided_scalar, scan_sse2};
+    }
+#endif
+    return {"scalar", fill_scalar, fill_strided_scalar, scan_scalar};
+}
+
+static const bulk_kernels kernels = pick_kernels();
+
+const char* bulk_kernels_name() {
+    return kernels.name;
+}
+
+bool bulk_fill(int* memory, int memory_size, int addr, int count, int stride, int value, int& result) {
+    if (count <= 0) {
+        return true;
+    }
+    if (addr < 0 || addr >= memory_size) {
+        result = addr;
+        return false;
+    }
+    int64_t last = addr + (int64_t) (count - 1) * stride;
+    if (last < 0 || last >= memory_size) {
+        // the first cell past the edge that the stride lands on
+        int64_t steps = stride > 0 ? (memory_size - addr + stride - 1) / stride : addr / -(int64_t) stride + 1;
+        result = clamp_cell(addr + steps * stride);
+        return false;
+    }
+    if (stride == 0) {
+        memory[addr] = value;
+    } else if (stride == 1 || stride == -1) {
+        kernels.fill(memory + std::min((int64_t) addr, last), count, value);
+    } else {
+        // order doesn't matter, the same value goes everywhere
+        kernels.fill_strided(memory + std::min((int64_t) addr, last), count, stride < 0 ? -(int64_t) stride : stride,
+                             value);
+    }
+    return true;
+}
+
+// whether [from, from + count) is in memory, with the first cell that isn't in bad otherwise
+static bool in_memory(int memory_size, int from, int count, int& bad) {
+    if (from < 0 || from >= memory_size) {
+        bad = from;
+        return false;
+    }
+    if ((int64_t) from + count > memory_size) {
+        bad = memory_size;
+        return false;
+    }
+    return true;
+}
+
+bool bulk_copy(int* memory, int memory_size, int dst, int src, int count, int& result) {
+    if (count <= 0) {
+        return true;
+    }
+    if (!in_memory(memory_size, src, count, result) || !in_memory(memory_size, dst, count, result)) {
+        return false;
+    }
+    // libc already picks a vector memmove for the CPU
+    memmove(memory + dst, memory + src, (size_t) count * sizeof(int));
+    return true;
+}
+
+bool bulk_scan(const int* memory, int memory_size, int addr, int end, bool zero, int& result) {
+    if (addr >= end) {
+        result = addr;
+        return true;
+    }
+    if (addr < 0 || addr >= memory_size) {
+        result = addr;
+        return false;
+    }
+    int64_t size = std::min(end, memory_size) - addr;
+    auto found = kernels.scan(memory + addr, size, zero);
+    if (found < size) {
+        result = (int) (addr + found);
+        return true;
+    }
+    result = end > memory_size ? memory_size : end;
+    return end <= memory_size;
+}
+
+bool atomic_add(int* memory, int memory_size, int addr, int value, int& result) {
+    if ((unsigned) addr >= (unsigned) memory_size) {
+        result = addr;
+        return false;
+    }
+    // wraps around like ADD
+    result = __atomic_fetch_add(memory + addr, value, __ATOMIC_SEQ_CST);
+    return true;
+}
+
+bool atomic_cas(int* memory, int memory_size, int addr, int expected, int desired, int& result) {
+    if ((unsigned) addr >= (unsigned) memory_size) {
+        result = addr;
+        return false;
+    }
+    result = expected;
+    __atomic_compare_exchange_n(memory + addr, &result, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+    return true;
+}
@@ -0,0 +1,32 @@
+#ifndef BULK_MEMORY_H
+#define BULK_MEMORY_H
+
+// The bulk memory opcodes, each of which stands for a whole loop of VM instructions:
+//   addr count stride value FILL    memory[addr + i * stride] = value for i in [0, count)
+//   dst src count COPY              memory[dst + i] = memory[src + i] for i in [0, count), as memmove
+//   addr end SCAN_ZERO              the first a in [addr, end) with memory[a] == 0, end if there is none
+//   addr end SCAN_NONZERO           the same for memory[a] != 0
+// The SCANs push addr when addr >= end. The kernels behind them use AVX2 or SSE2 where the CPU has it,
+// picked once at runtime, and plain loops elsewhere.
+// The atomic opcodes for programs with workers live here as well, with the same address checks:
+//   addr value ATOMIC_ADD           memory[addr] += value, pushes the old value
+//   addr expected desired CAS       memory[addr] = desired if it is expected, pushes the old value
+
+// Every function returns false with the first cell it would touch outside of memory_size cells in
+// result; FILL and COPY then leave memory alone. The SCANs put the cell they found in result and only
+// fail if they reach a bad cell before finding one
+bool bulk_fill(int* memory, int memory_size, int addr, int count, int stride, int value, int& result);
+
+bool bulk_copy(int* memory, int memory_size, int dst, int src, int count, int& result);
+
+bool bulk_scan(const int* memory, int memory_size, int addr, int end, bool zero, int& result);
+
+// sequentially consistent, the old value in result
+bool atomic_add(int* memory, int memory_size, int addr, int value, int& result);
+
+bool atomic_cas(int* memory, int memory_size, int addr, int expected, int desired, int& result);
+
+// avx2, sse2 or scalar, for the benchmarks
+const char* bulk_kernels_name();
+
+#endif //BULK_MEMORY_H
@@ -0,0 +1,129 @@
+#ifndef JIT_CACHE_H
+#define JIT_CACHE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// On-disk cache of what the VM learned about a program while running it, so that the next launch
+// doesn't have to learn it again. libjit can neither emit relocatable code nor load code back, and
+// the compiled code has the addresses of VM::memory and VM::stack baked in, so the cache keeps a plan
+// instead of machine code: which loops got hot and were compiled. With a plan the VM compiles those
+// loops on their first backward jump instead of interpreting them for hot_loop_threshold iterations
+// first. A plan is only a hint: anyone can write one for any key, so programs are verified all the
+// same, and a header that is no loop header just gets compiled early or not at all.
+//
+// Plans live in $PIGLET_JIT_CACHE, $XDG_CACHE_HOME/pigletvm or ~/.cache/pigletvm, one file per
+// program named after its key. The key hashes the .pvm file together with JIT_PLAN_VERSION, which has
+// to change whenever the VM changes in a way that makes old plans wrong, such as how loops are found or
+// compiled; a file that doesn't match its key, has the wrong size or a bad checksum is ignored and
+// overwritten.
+
+const char* const JIT_PLAN_VERSION = "pigletvm jit plan 1";
+const uint32_t JIT_PLAN_MAGIC = 0x4e4c5050; // "PPLN"
+
+struct hot_loop {
+    // [header, end) is the compiled range, entered with entry_depth values on the stack
+    int32_t header, end, entry_depth;
+};
+
+struct jit_plan {
+    std::vector<hot_loop> hot_loops;
+};
+
+const uint64_t FNV_OFFSET = 0xcbf29ce484222325ull;
+
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t hash = FNV_OFFSET) {
+    auto bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// key of the program stored in data, as it is in the file
+inline uint64_t jit_plan_key(const void* data, size_t size) {
+    return fnv1a(data, size, fnv1a(JIT_PLAN_VERSION, strlen(JIT_PLAN_VERSION)));
+}
+
+// empty if there is no place for the cache
+inline std::string jit_plan_path(uint64_t key) {
+    std::string dir;
+    if (getenv("PIGLET_JIT_CACHE")) {
+        dir = getenv("PIGLET_JIT_CACHE");
+    } else if (getenv("XDG_CACHE_HOME")) {
+        dir = std::string(getenv("XDG_CACHE_HOME")) + "/pigletvm";
+    } else if (getenv("HOME")) {
+        dir = std::string(getenv("HOME")) + "/.cache/pigletvm";
+    } else {
+        return "";
+    }
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.plan", (unsigned long long) key);
+    return dir + name;
+}
+
+struct jit_plan_header {
+    uint32_t magic;
+    uint32_t loops_count;
+    uint64_t key;
+    // fnv1a of the loops
+    uint64_t checksum;
+};
+
+inline bool load_jit_plan(const std::string& path, uint64_t key, jit_plan& plan) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    jit_plan_header header = {};
+    bool ok = read(fd, &header, sizeof(header)) == sizeof(header) && header.magic == JIT_PLAN_MAGIC &&
+              header.key == key && header.loops_count < (1u << 20);
+    if (ok) {
+        plan.hot_loops.resize(header.loops_count);
+        auto size = plan.hot_loops.size() * sizeof(hot_loop);
+        ok = read(fd, plan.hot_loops.data(), size) == (ssize_t) size &&
+             fnv1a(plan.hot_loops.data(), size) == header.checksum;
+    }
+    close(fd);
+    if (!ok) {
+        plan.hot_loops.clear();
+    }
+    return ok;
+}
+
+// Writes to a temporary file first and renames it, so that a VM starting at the same time sees
+// either the old plan or the new one
+inline bool store_jit_plan(const std::string& path, uint64_t key, const jit_plan& plan) {
+    auto slash = path.rfind('/');
+    if (slash != std::string::npos) {
+        // the cache directory and its parents; errors show up when opening the file
+        for (auto end = path.find('/', 1); end != std::string::npos && end <= slash; end = path.find('/', end + 1)) {
+            mkdir(path.substr(0, end).c_str(), 0755);
+        }
+    }
+    auto tmp_path = path + ".tmp." + std::to_string(getpid());
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    auto size = plan.hot_loops.size() * sizeof(hot_loop);
+    jit_plan_header header = {JIT_PLAN_MAGIC, (uint32_t) plan.hot_loops.size(), key,
+                              fnv1a(plan.hot_loops.data(), size)};
+    bool ok = write(fd, &header, sizeof(header)) == sizeof(header) &&
+              write(fd, plan.hot_loops.data(), size) == (ssize_t) size;
+    ok = close(fd) == 0 && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        unlink(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+#endif //JIT_CACHE_H
@@ -0,0 +1,1795 @@
+#include <climits>
+#include <sstream>
+#include "jit_ir.h"
+#include "vm.h"
+
+using namespace std;
+
+static int opcode_at(const bytecode& program, int ip) {
+    // superinstructions are translated as the sequence they replaced, which is still in place
+    return base_opcode(program.opcode(ip));
+}
+
+static bool in_range(const ir_source& source, int ip) {
+    return ip >= source.ip_start && ip < source.ip_end;
+}
+
+// instructions that need the runtime, which leave to the interpreter where there is none
+static bool needs_runtime(int opcode) {
+    return opcode == OP_CALL || opcode == OP_SPAWN || opcode == OP_JOIN || opcode == OP_POP_RES;
+}
+
+// whether the code after the instruction is only reached by jumps
+static bool ends_flow(const ir_source& source, int opcode) {
+    return opcode == OP_JUMP || opcode == OP_DONE || opcode == OP_ABORT || opcode == OP_RET ||
+           (needs_runtime(opcode) && !source.functions);
+}
+
+// The depth must not depend on the path taken, otherwise stack entries can't be mapped to registers
+bool ir_stack_depths(const ir_source& source, vector<int>& depths) {
+    auto& program = *source.program;
+    depths.assign(source.ip_end - source.ip_start, -1);
+    vector<pair<int, int>> work = {{source.ip_start, source.entry_depth}};
+    while (!work.empty()) {
+        auto [ip, depth] = work.back();
+        work.pop_back();
+        while (ip < source.ip_end) {
+            if (depths[ip - source.ip_start] >= 0) {
+                if (depths[ip - source.ip_start] != depth) {
+                    return false;
+                }
+                break;
+            }
+            depths[ip - source.ip_start] = depth;
+            auto opcode = opcode_at(program, ip);
+            if (opcode == OP_CALL && source.functions) {
+                auto& callee = (*source.functions)[function_at(*source.functions, program.arg(ip + 1))];
+                depth += callee.results - callee.args;
+            } else {
+                depth += stack_effect(opcode);
+            }
+            if (depth < 0) {
+                return false;
+            }
+            if (is_jump(opcode) && in_range(source, program.arg(ip + 1))) {
+                work.emplace_back(program.arg(ip + 1), depth);
+            }
+            if (ends_flow(source, opcode)) {
+                break;
+            }
+            ip += program.length(opcode);
+        }
+    }
+    return true;
+}
+
+// Translates the range with the operand stack of the bytecode kept in vstack, the way the JIT
+// compiled it before there was an IR: entries are constants, registers of earlier results or the
+// registers of stack slots, which hold the stack between blocks
+struct ir_builder {
+    const ir_source& source;
+    const bytecode& program;
+    const vector<int>& depths;
+    ir_function function;
+    // ip of a jump target -> its block
+    map<int, int> labels;
+    // where instructions go, -1 after a terminator
+    int block = -1;
+    vector<ir_value> vstack;
+    vector<int> slots;
+
+    ir_builder(const ir_source& source, const vector<int>& depths)
+            : source(source), program(*source.program), depths(depths) {}
+
+    int slot(size_t i) {
+        while (slots.size() <= i) {
+            slots.push_back(function.new_reg());
+        }
+        return slots[i];
+    }
+
+    ir_insn& emit(ir_opcode opcode, int ip, vector<ir_value> in = {}, int dst = -1) {
+        if (block < 0) {
+            // code after a terminator that isn't a jump target, like the RET after a tail call
+            block = function.new_block();
+        }
+        ir_insn insn;
+        insn.opcode = opcode;
+        insn.in = std::move(in);
+        insn.dst = dst;
+        insn.ip = ip;
+        auto& insns = function.blocks[block].insns;
+        insns.push_back(std::move(insn));
+        return insns.back();
+    }
+
+    ir_value def(ir_opcode opcode, int ip, vector<ir_value> in) {
+        auto dst = function.new_reg();
+        emit(opcode, ip, std::move(in), dst);
+        return ir_value::of_reg(dst);
+    }
+
+    void terminate(ir_opcode opcode, int ip, vector<ir_value> in = {}, int arg = 0, int other = -1, int exit = -1) {
+        auto& insn = emit(opcode, ip, std::move(in));
+        insn.arg = arg;
+        insn.other = other;
+        insn.exit = exit;
+        block = -1;
+    }
+
+    void push(ir_value value) {
+        vstack.push_back(value);
+    }
+
+    ir_value pop() {
+        auto value = vstack.back();
+        vstack.pop_back();
+        return value;
+    }
+
+    // Moves the stack into the slot registers, so that every edge into a block sees the same layout.
+    // An entry only aliases a slot below it if that slot still holds its own register, so going
+    // upwards never overwrites a slot before it is read
+    void flush(int ip) {
+        for (size_t i = 0; i < vstack.size(); i++) {
+            auto reg = slot(i);
+            if (vstack[i] != ir_value::of_reg(reg)) {
+                emit(IR_COPY, ip, {vstack[i]}, reg);
+                vstack[i] = ir_value::of_reg(reg);
+            }
+        }
+    }
+
+    int add_exit(ir_exit exit) {
+        function.exits.push_back(std::move(exit));
+        return (int) function.exits.size() - 1;
+    }
+
+    // back to the interpreter at ip with the current stack
+    int exit_to(int ip) {
+        return add_exit({EXIT_TO_INTERPRETER, ip, 0, {}, vstack, {}});
+    }
+
+    // how an instruction at ip reports an error: functions stop the program, the other code lets
+    // the interpreter run the instruction again
+    int error_exit(int ip, jit_stop_reason reason, ir_value value) {
+        return source.is_function ? add_exit({EXIT_STOP, ip, reason, value, {}, {}}) : exit_to(ip);
+    }
+
+    int block_at(int ip) {
+        auto label = labels.find(ip);
+        return label != labels.end() ? label->second : function.new_block();
+    }
+
+    void jump_to(int target, int ip) {
+        terminate(IR_JUMP, ip, {}, target);
+    }
+
+    // A backward jump at ip to target takes a unit of fuel first in metered code. Without any, the exit
+    // goes on at the target, as if the jump was taken
+    void take_fuel(int target, int ip) {
+        emit(IR_FUEL, ip).exit = exit_to(target);
+    }
+
+    void check_address(ir_value addr, int ip) {
+        if (source.check_addresses) {
+            emit(IR_CHECK_ADDRESS, ip, {addr}).exit = error_exit(ip, STOP_BAD_ADDRESS, addr);
+        }
+    }
+
+    ir_function build() {
+        function.memory_size = source.memory_size;
+        function.new_block();
+        for (auto ip = source.ip_start; ip < source.ip_end; ip += program.length(opcode_at(program, ip))) {
+            auto opcode = opcode_at(program, ip);
+            if (is_jump(opcode) && in_range(source, program.arg(ip + 1)) && !labels.count(program.arg(ip + 1))) {
+                labels[program.arg(ip + 1)] = function.new_block();
+            }
+        }
+        for (int i = 0; i < source.entry_depth; i++) {
+            function.inputs.push_back(slot(i));
+            push(ir_value::of_reg(slot(i)));
+        }
+        block = 0;
+        auto first = block_at(source.ip_start);
+        jump_to(first, source.ip_start);
+        block = first;
+        auto ip = source.ip_start;
+        bool falls_through = true;
+        while (ip < source.ip_end) {
+            if (depths[ip - source.ip_start] < 0) {
+                // nothing jumps or falls through to this instruction
+                ip += program.length(opcode_at(program, ip));
+                falls_through = false;
+                continue;
+            }
+            auto label = labels.find(ip);
+            if (label != labels.end() && label->second != block) {
+                if (falls_through) {
+                    flush(ip);
+                    jump_to(label->second, ip);
+                }
+                block = label->second;
+                vstack.clear();
+                for (int i = 0; i < depths[ip - source.ip_start]; i++) {
+                    push(ir_value::of_reg(slot(i)));
+                }
+            }
+            auto opcode = opcode_at(program, ip);
+            falls_through = !ends_flow(source, opcode);
+            auto instruction_ip = ip;
+            ip += program.length(opcode);
+            translate(opcode, instruction_ip, ip);
+        }
+        if (falls_through) {
+            terminate(IR_EXIT, ip, {}, 0, -1, exit_to(source.ip_end));
+        }
+        return std::move(function);
+    }
+
+    void translate(int opcode, int ip, int next_ip) {
+        auto arg = argument_count(opcode) ? program.arg(ip + 1) : 0;
+        switch (opcode) {
+            case OP_PUSHI: {
+                push(ir_value::of_constant(arg));
+                break;
+            }
+            case OP_LOADI: {
+                push(def(IR_LOAD, ip, {ir_value::of_constant(arg)}));
+                break;
+            }
+            case OP_STOREI: {
+                emit(IR_STORE, ip, {ir_value::of_constant(arg), pop()});
+                break;
+            }
+            case OP_LOADADDI: {
+                auto val = pop();
+                push(def(IR_ADD, ip, {val, def(IR_LOAD, ip, {ir_value::of_constant(arg)})}));
+                break;
+            }
+            case OP_LOAD: {
+                check_address(vstack.back(), ip);
+                auto addr = pop();
+                push(def(IR_LOAD, ip, {addr}));
+                break;
+            }
+            case OP_STORE: {
+                check_address(vstack[vstack.size() - 2], ip);
+                // taken when the address turns out to be a cell that a loop keeps in a register
+                auto exit = source.is_function ? -1 : exit_to(ip);
+                auto val = pop();
+                auto addr = pop();
+                emit(IR_STORE, ip, {addr, val}).exit = exit;
+                break;
+            }
+            case OP_PRINT: {
+                emit(IR_PRINT, ip, {pop()});
+                break;
+            }
+            case OP_ADDI: {
+                push(def(IR_ADD, ip, {pop(), ir_value::of_constant(arg)}));
+                break;
+            }
+            case OP_GREATER_OR_EQUALI: {
+                push(def(IR_GREATER_OR_EQUAL, ip, {pop(), ir_value::of_constant(arg)}));
+                break;
+            }
+            case OP_DUP: {
+                push(vstack.back());
+                break;
+            }
+            case OP_DISCARD: {
+                pop();
+                break;
+            }
+            case OP_JUMP: {
+                if (!in_range(source, arg)) {
+                    terminate(IR_EXIT, ip, {}, 0, -1, exit_to(arg));
+                    break;
+                }
+                flush(ip);
+                if (source.fuel && arg < next_ip) {
+                    take_fuel(arg, ip);
+                }
+                jump_to(labels.at(arg), ip);
+                break;
+            }
+            case OP_JUMP_IF_TRUE:
+            case OP_JUMP_IF_FALSE: {
+                auto cond = pop();
+                flush(ip);
+                int target;
+                if (in_range(source, arg) && source.fuel && arg < next_ip) {
+                    // only the way back takes fuel, in a block of its own
+                    target = function.new_block();
+                    auto current = block;
+                    block = target;
+                    take_fuel(arg, ip);
+                    jump_to(labels.at(arg), ip);
+                    block = current;
+                } else if (in_range(source, arg)) {
+                    target = labels.at(arg);
+                } else {
+                    target = function.new_block();
+                    auto current = block;
+                    block = target;
+                    terminate(IR_EXIT, ip, {}, 0, -1, exit_to(arg));
+                    block = current;
+                }
+                auto next = block_at(next_ip);
+                if (opcode == OP_JUMP_IF_TRUE) {
+                    terminate(IR_BRANCH, ip, {cond}, target, next);
+                } else {
+                    terminate(IR_BRANCH, ip, {cond}, next, target);
+                }
+                block = next;
+                break;
+            }
+            case LABEL_MARK:
+            case OP_ENTER: {
+                // the arguments of a function are its inputs
+                break;
+            }
+            case OP_DONE:
+            case OP_ABORT: {
+                if (source.is_function) {
+                    terminate(IR_EXIT, ip, {}, 0, -1,
+                              add_exit({EXIT_STOP, ip, opcode == OP_DONE ? STOP_DONE : STOP_ABORT, {}, {}, {}}));
+                } else {
+                    // the interpreter reports these
+                    terminate(IR_EXIT, ip, {}, 0, -1, exit_to(ip));
+                }
+                break;
+            }
+            case OP_LOADL: {
+                push(vstack[source.frame_base + arg]);
+                break;
+            }
+            case OP_STOREL: {
+                auto val = pop();
+                size_t slot_index = source.frame_base + arg;
+                auto local = ir_value::of_reg(slot(slot_index));
+                // entries above that alias the slot's register keep the old value
+                for (auto i = slot_index + 1; i < vstack.size(); i++) {
+                    if (vstack[i] == local) {
+                        vstack[i] = def(IR_COPY, ip, {local});
+                    }
+                }
+                vstack[slot_index] = val;
+                break;
+            }
+            case OP_CALL: {
+                if (!source.functions) {
+                    terminate(IR_EXIT, ip, {}, 0, -1, exit_to(ip));
+                    break;
+                }
+                call(function_at(*source.functions, arg), ip, next_ip);
+                break;
+            }
+            case OP_RET: {
+                if (!source.is_function) {
+                    terminate(IR_EXIT, ip, {}, 0, -1, exit_to(ip));
+                } else if (source.is_void) {
+                    terminate(IR_RETURN, ip);
+                } else {
+                    terminate(IR_RETURN, ip, {pop()});
+                }
+                break;
+            }
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_EQUAL:
+            case OP_LESS:
+            case OP_LESS_OR_EQUAL:
+            case OP_GREATER:
+            case OP_GREATER_OR_EQUAL: {
+                auto arg1 = pop();
+                auto arg2 = pop();
+                push(def(binary_opcode(opcode), ip, {arg2, arg1}));
+                break;
+            }
+            case OP_DIV: {
+                // the interpreter runs the DIV again with both operands on the stack and reports the error
+                emit(IR_CHECK_NONZERO, ip, {vstack.back()}).exit = error_exit(ip, STOP_ZERO_DIVISION, {});
+                emit(IR_CHECK_QUOTIENT, ip, {vstack[vstack.size() - 2], vstack.back()}).exit =
+                        error_exit(ip, STOP_DIVISION_OVERFLOW, {});
+                auto arg1 = pop();
+                auto arg2 = pop();
+                push(def(IR_DIV, ip, {arg2, arg1}));
+                break;
+            }
+            case OP_SPAWN:
+            case OP_JOIN:
+            case OP_POP_RES:
+            case OP_NATIVE:
+            case OP_FILL:
+            case OP_COPY:
+            case OP_SCAN_ZERO:
+            case OP_SCAN_NONZERO:
+            case OP_ATOMIC_ADD:
+            case OP_CAS: {
+                if (needs_runtime(opcode) && !source.functions) {
+                    terminate(IR_EXIT, ip, {}, 0, -1, exit_to(ip));
+                    break;
+                }
+                // a function's helper reports a bad address or native itself, the ones of SPAWN, JOIN and
+                // POP_RES always report
+                auto exit = source.is_function || needs_runtime(opcode) ? add_exit({EXIT_STOPPED, ip, 0, {}, {}, {}})
+                                                                        : exit_to(ip);
+                auto inputs = stack_inputs(opcode);
+                vector<ir_value> in(vstack.end() - inputs, vstack.end());
+                vstack.resize(vstack.size() - inputs);
+                if (opcode == OP_SPAWN || opcode == OP_NATIVE) {
+                    // where the worker starts, or the host function called
+                    in.insert(in.begin(), ir_value::of_constant(arg));
+                }
+                auto dst = inputs + stack_effect(opcode) > 0 ? function.new_reg() : -1;
+                auto& insn = emit(IR_BULK, ip, std::move(in), dst);
+                insn.arg = opcode;
+                insn.exit = exit;
+                if (dst >= 0) {
+                    push(ir_value::of_reg(dst));
+                }
+                break;
+            }
+            default: {
+                // verify_program() lets none through; the interpreter would report it, a function aborts
+                terminate(IR_EXIT, ip, {}, 0, -1, error_exit(ip, STOP_ABORT, {}));
+                break;
+            }
+        }
+    }
+
+    static ir_opcode binary_opcode(int opcode) {
+        switch (opcode) {
+            case OP_ADD:
+                return IR_ADD;
+            case OP_SUB:
+                return IR_SUB;
+            case OP_MUL:
+                return IR_MUL;
+            case OP_EQUAL:
+                return IR_EQUAL;
+            case OP_LESS:
+                return IR_LESS;
+            case OP_LESS_OR_EQUAL:
+                return IR_LESS_OR_EQUAL;
+            case OP_GREATER:
+                return IR_GREATER;
+            default:
+                return IR_GREATER_OR_EQUAL;
+        }
+    }
+
+    // A CALL right before a RET of the same signature becomes a tail call. Callers of a function that
+    // ended the program return as well
+    void call(int index, int ip, int next_ip) {
+        auto& callee = (*source.functions)[index];
+        vector<ir_value> args(vstack.end() - callee.args, vstack.end());
+        vstack.resize(vstack.size() - callee.args);
+        if (source.is_function && next_ip < source.ip_end && opcode_at(program, next_ip) == OP_RET &&
+            callee.args == source.entry_depth && (callee.results == 0) == source.is_void) {
+            terminate(IR_TAIL_CALL, ip, std::move(args), index);
+            if (callee.results) {
+                // for the RET after it, which is still translated as dead code
+                push(ir_value::of_constant(0));
+            }
+            return;
+        }
+        auto dst = callee.results ? function.new_reg() : -1;
+        auto& insn = emit(IR_CALL, ip, std::move(args), dst);
+        insn.arg = index;
+        insn.exit = add_exit({EXIT_STOPPED, ip, 0, {}, {}, {}});
+        if (dst >= 0) {
+            push(ir_value::of_reg(dst));
+        }
+    }
+};
+
+ir_function build_ir(const ir_source& source, const vector<int>& depths) {
+    return ir_builder(source, depths).build();
+}
+
+static bool is_terminator(ir_opcode opcode) {
+    return opcode >= IR_JUMP;
+}
+
+// the blocks a terminator goes to
+static vector<int> targets(const ir_insn& insn) {
+    if (insn.opcode == IR_JUMP) {
+        return {insn.arg};
+    }
+    if (insn.opcode == IR_BRANCH) {
+        return {insn.arg, insn.other};
+    }
+    return {};
+}
+
+static vector<int> successors(const ir_block& block) {
+    return block.insns.empty() ? vector<int>() : targets(block.terminator());
+}
+
+// the targets of the block's terminator that are from, retargeted to to
+static void retarget(ir_block& block, int from, int to) {
+    auto& terminator = block.insns.back();
+    if (terminator.opcode == IR_JUMP || terminator.opcode == IR_BRANCH) {
+        if (terminator.arg == from) {
+            terminator.arg = to;
+        }
+        if (terminator.opcode == IR_BRANCH && terminator.other == from) {
+            terminator.other = to;
+        }
+    }
+}
+
+static vector<vector<int>> predecessors(const ir_function& function) {
+    vector<vector<int>> preds(function.blocks.size());
+    for (size_t b = 0; b < function.blocks.size(); b++) {
+        for (auto successor : successors(function.blocks[b])) {
+            preds[successor].push_back((int) b);
+        }
+    }
+    return preds;
+}
+
+// A STORE only leaves through its exit when it has aliases, see promote_cells()
+static bool has_exit(const ir_insn& insn) {
+    return insn.exit >= 0 && (insn.opcode != IR_STORE || !insn.aliases.empty());
+}
+
+// calls read for every register the instruction reads: its inputs, what its exit needs and the
+// promoted cells it writes back
+template<typename F>
+static void for_each_read(const ir_function& function, const ir_insn& insn, F read) {
+    for (auto& value : insn.in) {
+        if (!value.is_constant()) {
+            read(value.reg);
+        }
+    }
+    for (auto& alias : insn.aliases) {
+        read(alias.reg);
+    }
+    if (has_exit(insn)) {
+        auto& exit = function.exits[insn.exit];
+        for (auto& value : exit.stack) {
+            if (!value.is_constant()) {
+                read(value.reg);
+            }
+        }
+        if (!exit.value.is_constant()) {
+            read(exit.value.reg);
+        }
+        for (auto& spill : exit.spills) {
+            read(spill.reg);
+        }
+    }
+}
+
+// dst, and the promoted cells a STORE in a function loads again after it hit one of them
+template<typename F>
+static void for_each_write(const ir_insn& insn, F write) {
+    if (insn.dst >= 0) {
+        write(insn.dst);
+    }
+    if (insn.opcode == IR_STORE && insn.exit < 0) {
+        for (auto& alias : insn.aliases) {
+            write(alias.reg);
+        }
+    }
+}
+
+// calls change for every operand that holds a value, where a constant can take the place of a register
+template<typename F>
+static void for_each_operand(ir_function& function, ir_insn& insn, F change) {
+    for (auto& value : insn.in) {
+        change(value);
+    }
+    if (insn.exit >= 0) {
+        auto& exit = function.exits[insn.exit];
+        for (auto& value : exit.stack) {
+            change(value);
+        }
+        change(exit.value);
+    }
+}
+
+struct reg_counts {
+    vector<int> defs, reads;
+};
+
+// the inputs count as written at the entry
+static reg_counts count_regs(const ir_function& function) {
+    reg_counts counts{vector<int>(function.regs), vector<int>(function.regs)};
+    for (auto input : function.inputs) {
+        counts.defs[input]++;
+    }
+    for (auto& block : function.blocks) {
+        for (auto& insn : block.insns) {
+            for_each_write(insn, [&](int reg) { counts.defs[reg]++; });
+            for_each_read(function, insn, [&](int reg) { counts.reads[reg]++; });
+        }
+    }
+    return counts;
+}
+
+// empties the blocks the entry doesn't lead to
+static void remove_unreachable(ir_function& function) {
+    vector<bool> reached(function.blocks.size());
+    vector<int> work = {0};
+    reached[0] = true;
+    while (!work.empty()) {
+        auto b = work.back();
+        work.pop_back();
+        for (auto successor : successors(function.blocks[b])) {
+            if (!reached[successor]) {
+                reached[successor] = true;
+                work.push_back(successor);
+            }
+        }
+    }
+    for (size_t b = 0; b < function.blocks.size(); b++) {
+        if (!reached[b]) {
+            function.blocks[b].insns.clear();
+        }
+    }
+}
+
+// a op b the way the VM computes it; false for a division that the VM would stop at
+static bool fold(ir_opcode opcode, int a, int b, int& result) {
+    switch (opcode) {
+        case IR_ADD:
+            result = (int) ((unsigned) a + (unsigned) b);
+            return true;
+        case IR_SUB:
+            result = (int) ((unsigned) a - (unsigned) b);
+            return true;
+        case IR_MUL:
+            result = (int) ((unsigned) a * (unsigned) b);
+            return true;
+        case IR_DIV:
+            if (b == 0 || (a == INT_MIN && b == -1)) {
+                return false;
+            }
+            result = a / b;
+            return true;
+        case IR_EQUAL:
+            result = a == b;
+            return true;
+        case IR_LESS:
+            result = a < b;
+            return true;
+        case IR_LESS_OR_EQUAL:
+            result = a <= b;
+            return true;
+        case IR_GREATER:
+            result = a > b;
+            return true;
+        case IR_GREATER_OR_EQUAL:
+            result = a >= b;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool is_binary(ir_opcode opcode) {
+    return opcode >= IR_ADD && opcode <= IR_GREATER_OR_EQUAL;
+}
+
+// b op a means the same as a op' b
+static ir_opcode mirrored(ir_opcode opcode) {
+    switch (opcode) {
+        case IR_LESS:
+            return IR_GREATER;
+        case IR_LESS_OR_EQUAL:
+            return IR_GREATER_OR_EQUAL;
+        case IR_GREATER:
+            return IR_LESS;
+        case IR_GREATER_OR_EQUAL:
+            return IR_LESS_OR_EQUAL;
+        default:
+            return opcode;
+    }
+}
+
+// Whether check passes or fails whatever values its registers have, which one in passes
+static bool check_is_decided(const ir_insn& check, int memory_size, bool& passes) {
+    if (check.opcode == IR_CHECK_QUOTIENT) {
+        // one operand that can't be part of INT_MIN / -1 is enough
+        auto a = check.in[0], b = check.in[1];
+        passes = (a.is_constant() && a.constant != INT_MIN) || (b.is_constant() && b.constant != -1);
+        return passes || (a.is_constant() && b.is_constant());
+    }
+    if ((check.opcode != IR_CHECK_ADDRESS && check.opcode != IR_CHECK_NONZERO) || !check.in[0].is_constant()) {
+        return false;
+    }
+    auto value = check.in[0].constant;
+    passes = check.opcode == IR_CHECK_NONZERO ? value != 0 : value >= 0 && value < memory_size;
+    return true;
+}
+
+// Folds constants and brings arithmetic into one form: constants on the right of ADD and MUL,
+// SUB of a constant as ADD of its negation. Branches on a constant become jumps, checks of a constant
+// go away or leave the block for good
+static void simplify(ir_function& function) {
+    for (auto& block : function.blocks) {
+        vector<ir_insn> insns;
+        for (auto& insn : block.insns) {
+            bool passes;
+            if (is_binary(insn.opcode)) {
+                auto& a = insn.in[0];
+                auto& b = insn.in[1];
+                int result;
+                if (a.is_constant() && b.is_constant() && fold(insn.opcode, a.constant, b.constant, result)) {
+                    insn.opcode = IR_COPY;
+                    insn.in = {ir_value::of_constant(result)};
+                } else if (insn.opcode == IR_SUB && b.is_constant() && b.constant != INT_MIN) {
+                    insn.opcode = IR_ADD;
+                    b.constant = -b.constant;
+                } else if ((insn.opcode == IR_ADD || insn.opcode == IR_MUL || insn.opcode == IR_EQUAL) &&
+                           a.is_constant() && !b.is_constant()) {
+                    swap(a, b);
+                } else if (insn.opcode != IR_DIV && insn.opcode != IR_SUB && a.is_constant() && !b.is_constant()) {
+                    swap(a, b);
+                    insn.opcode = mirrored(insn.opcode);
+                }
+                if ((insn.opcode == IR_ADD && insn.in[1] == ir_value::of_constant(0)) ||
+                    (insn.opcode == IR_MUL && insn.in[1] == ir_value::of_constant(1))) {
+                    insn.opcode = IR_COPY;
+                    insn.in.pop_back();
+                }
+            } else if (check_is_decided(insn, function.memory_size, passes)) {
+                if (passes) {
+                    continue;
+                }
+                // a check that always fails ends the block at its exit
+                insn.opcode = IR_EXIT;
+                insn.in.clear();
+                insns.push_back(std::move(insn));
+                break;
+            } else if (insn.opcode == IR_BRANCH && insn.in[0].is_constant()) {
+                insn.opcode = IR_JUMP;
+                if (!insn.in[0].constant) {
+                    insn.arg = insn.other;
+                }
+                insn.in.clear();
+                insn.other = -1;
+            }
+            insns.push_back(std::move(insn));
+        }
+        block.insns = std::move(insns);
+    }
+    remove_unreachable(function);
+}
+
+// Replaces the copies in registers that are written once: everywhere, if what they copy is a
+// constant or a register that is also written once, within their block otherwise, up to where the
+// original changes. The copies that are left without readers go in remove_dead_code()
+static void propagate_copies(ir_function& function) {
+    auto counts = count_regs(function);
+    // register -> what it copies
+    vector<ir_value> replacement(function.regs);
+    vector<bool> replaced(function.regs);
+    for (auto& block : function.blocks) {
+        for (auto& insn : block.insns) {
+            if (insn.opcode == IR_COPY && counts.defs[insn.dst] == 1 &&
+                (insn.in[0].is_constant() || counts.defs[insn.in[0].reg] == 1)) {
+                replacement[insn.dst] = insn.in[0];
+                replaced[insn.dst] = true;
+            }
+        }
+    }
+    auto resolve = [&](ir_value value) {
+        while (!value.is_constant() && replaced[value.reg]) {
+            value = replacement[value.reg];
+        }
+        return value;
+    };
+    for (auto& block : function.blocks) {
+        for (auto& insn : block.insns) {
+            for_each_operand(function, insn, [&](ir_value& value) { value = resolve(value); });
+        }
+    }
+    for (auto& block : function.blocks) {
+        // copy -> the register it copies, while that doesn't change
+        map<int, int> copies;
+        for (auto& insn : block.insns) {
+            for_each_operand(function, insn, [&](ir_value& value) {
+                auto copy = value.is_constant() ? copies.end() : copies.find(value.reg);
+                if (copy != copies.end()) {
+                    value = ir_value::of_reg(copy->second);
+                }
+            });
+            for_each_write(insn, [&](int reg) {
+                for (auto copy = copies.begin(); copy != copies.end();) {
+                    copy = copy->first == reg || copy->second == reg ? copies.erase(copy) : next(copy);
+                }
+            });
+            if (insn.opcode == IR_COPY && counts.defs[insn.dst] == 1 && !insn.in[0].is_constant() &&
+                insn.in[0].reg != insn.dst) {
+                copies[insn.dst] = insn.in[0].reg;
+            }
+        }
+    }
+}
+
+// instructions without any effect besides dst
+static bool is_pure(const ir_insn& insn, int memory_size) {
+    if (insn.opcode == IR_LOAD) {
+        // a bad address has to fault
+        return insn.in[0].is_constant() && insn.in[0].constant >= 0 && insn.in[0].constant < memory_size;
+    }
+    return insn.opcode == IR_COPY || is_binary(insn.opcode);
+}
+
+static void remove_dead_code(ir_function& function, int memory_size) {
+    for (bool changed = true; changed;) {
+        changed = false;
+        auto counts = count_regs(function);
+        for (auto& block : function.blocks) {
+            auto dead = [&](const ir_insn& insn) {
+                return insn.dst >= 0 && counts.reads[insn.dst] == 0 && is_pure(insn, memory_size);
+            };
+            auto size = block.insns.size();
+            block.insns.erase(remove_if(block.insns.begin(), block.insns.end(), dead), block.insns.end());
+            changed |= block.insns.size() != size;
+        }
+        // writes that the block overwrites before anything reads them
+        for (auto& block : function.blocks) {
+            set<int> overwritten;
+            for (auto i = (long) block.insns.size() - 1; i >= 0; i--) {
+                auto& insn = block.insns[i];
+                if (insn.dst >= 0 && overwritten.count(insn.dst) && is_pure(insn, memory_size)) {
+                    block.insns.erase(block.insns.begin() + i);
+                    changed = true;
+                    continue;
+                }
+                for_each_write(insn, [&](int reg) { overwritten.insert(reg); });
+                for_each_read(function, insn, [&](int reg) { overwritten.erase(reg); });
+            }
+        }
+        // copies of a register to itself
+        for (auto& block : function.blocks) {
+            auto size = block.insns.size();
+            block.insns.erase(remove_if(block.insns.begin(), block.insns.end(), [](const ir_insn& insn) {
+                return insn.opcode == IR_COPY && insn.in[0] == ir_value::of_reg(insn.dst);
+            }), block.insns.end());
+            changed |= block.insns.size() != size;
+        }
+    }
+}
+
+// Skips blocks that only jump and appends blocks to their only predecessor when it jumps to them
+static void merge_blocks(ir_function& function) {
+    for (bool changed = true; changed;) {
+        changed = false;
+        auto preds = predecessors(function);
+        for (size_t b = 1; b < function.blocks.size(); b++) {
+            auto& block = function.blocks[b];
+            if (block.insns.size() == 1 && block.terminator().opcode == IR_JUMP && block.terminator().arg != (int) b) {
+                for (auto pred : preds[b]) {
+                    retarget(function.blocks[pred], (int) b, block.terminator().arg);
+                }
+                changed |= !preds[b].empty();
+            }
+        }
+        if (changed) {
+            remove_unreachable(function);
+            continue;
+        }
+        for (size_t b = 0; b < function.blocks.size(); b++) {
+            auto& block = function.blocks[b];
+            if (block.insns.empty() || block.terminator().opcode != IR_JUMP) {
+                continue;
+            }
+            auto target = block.terminator().arg;
+            if (target != (int) b && target != 0 && preds[target].size() == 1) {
+                block.insns.pop_back();
+                auto& moved = function.blocks[target].insns;
+                block.insns.insert(block.insns.end(), make_move_iterator(moved.begin()), make_move_iterator(moved.end()));
+                moved.clear();
+                changed = true;
+                break;
+            }
+        }
+    }
+}
+
+// whether insn may write memory anywhere: calls, the bulk memory instructions but the SCANs and the
+// atomics, SPAWN and JOIN, after which workers may have written to it, and NATIVE, whose host function
+// may have
+static bool writes_memory(const ir_insn& insn) {
+    return insn.opcode == IR_CALL || (insn.opcode == IR_BULK && insn.arg != OP_SCAN_ZERO &&
+                                      insn.arg != OP_SCAN_NONZERO && insn.arg != OP_POP_RES);
+}
+
+// Within a block, a LOAD of a constant address after a STORE or LOAD of it takes the value from there.
+// Whatever may write memory somewhere else forgets all of them
+static void forward_stores(ir_function& function) {
+    for (auto& block : function.blocks) {
+        map<int, ir_value> cells;
+        for (auto& insn : block.insns) {
+            auto constant = !insn.in.empty() && insn.in[0].is_constant();
+            if (insn.opcode == IR_LOAD && constant && cells.count(insn.in[0].constant)) {
+                insn.opcode = IR_COPY;
+                insn.in = {cells[insn.in[0].constant]};
+            }
+            if ((insn.opcode == IR_STORE && !constant) || writes_memory(insn)) {
+                cells.clear();
+            }
+            for_each_write(insn, [&](int reg) {
+                for (auto cell = cells.begin(); cell != cells.end();) {
+                    cell = cell->second == ir_value::of_reg(reg) ? cells.erase(cell) : next(cell);
+                }
+            });
+            if (insn.opcode == IR_STORE && constant) {
+                cells[insn.in[0].constant] = insn.in[1];
+            } else if (insn.opcode == IR_LOAD && constant) {
+                cells[insn.in[0].constant] = ir_value::of_reg(insn.dst);
+            }
+        }
+    }
+}
+
+// The second round picks up what the first one exposed, like branches on constants that became
+// jumps and blocks merged because of them
+static void clean_up(ir_function& function) {
+    for (int round = 0; round < 2; round++) {
+        forward_stores(function);
+        propagate_copies(function);
+        simplify(function);
+        remove_dead_code(function, function.memory_size);
+        merge_blocks(function);
+    }
+}
+
+// reverse postorder, so that loops are laid out with their header first
+vector<int> ir_block_order(const ir_function& function) {
+    vector<int> order;
+    vector<bool> seen(function.blocks.size());
+    // block, index of the next successor to visit
+    vector<pair<int, size_t>> work = {{0, 0}};
+    seen[0] = true;
+    while (!work.empty()) {
+        auto b = work.back().first;
+        auto next = work.back().second++;
+        auto succ = successors(function.blocks[b]);
+        if (next < succ.size()) {
+            if (!seen[succ[next]]) {
+                seen[succ[next]] = true;
+                work.emplace_back(succ[next], 0);
+            }
+        } else {
+            order.push_back(b);
+            work.pop_back();
+        }
+    }
+    reverse(order.begin(), order.end());
+    return order;
+}
+
+// the immediate dominator of every block, -1 for unreachable ones (Cooper, Harvey and Kennedy)
+static vector<int> dominators(const ir_function& function, const vector<int>& order,
+                              const vector<vector<int>>& preds) {
+    vector<int> index(function.blocks.size(), -1);
+    for (size_t i = 0; i < order.size(); i++) {
+        index[order[i]] = (int) i;
+    }
+    vector<int> idom(function.blocks.size(), -1);
+    idom[0] = 0;
+    auto intersect = [&](int a, int b) {
+        while (a != b) {
+            while (index[a] > index[b]) {
+                a = idom[a];
+            }
+            while (index[b] > index[a]) {
+                b = idom[b];
+            }
+        }
+        return a;
+    };
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto b : order) {
+            if (b == 0) {
+                continue;
+            }
+            int dom = -1;
+            for (auto pred : preds[b]) {
+                if (idom[pred] >= 0) {
+                    dom = dom < 0 ? pred : intersect(pred, dom);
+                }
+            }
+            if (idom[b] != dom) {
+                idom[b] = dom;
+                changed = true;
+            }
+        }
+    }
+    return idom;
+}
+
+static bool dominates(const vector<int>& idom, int a, int b) {
+    while (b != a && b != 0) {
+        b = idom[b];
+    }
+    return b == a;
+}
+
+struct ir_loop {
+    int header;
+    // the header first
+    vector<int> blocks;
+    vector<bool> contains;
+    // the smallest loop around this one, -1 for outermost loops
+    int parent = -1;
+
+    // also for blocks made after the loop was found, which are never in it
+    bool has(int block) const {
+        return block < (int) contains.size() && contains[block];
+    }
+};
+
+// The natural loops, innermost first, where back edges to the same header make one loop
+static vector<ir_loop> find_loops(const ir_function& function) {
+    auto preds = predecessors(function);
+    auto order = ir_block_order(function);
+    auto idom = dominators(function, order, preds);
+    vector<ir_loop> loops;
+    for (auto header : order) {
+        vector<int> work;
+        for (auto pred : preds[header]) {
+            if (idom[pred] >= 0 && dominates(idom, header, pred)) {
+                work.push_back(pred);
+            }
+        }
+        if (work.empty()) {
+            continue;
+        }
+        ir_loop loop{header, {header}, vector<bool>(function.blocks.size())};
+        loop.contains[header] = true;
+        while (!work.empty()) {
+            auto b = work.back();
+            work.pop_back();
+            if (loop.contains[b]) {
+                continue;
+            }
+            loop.contains[b] = true;
+            loop.blocks.push_back(b);
+            for (auto pred : preds[b]) {
+                if (idom[pred] >= 0) {
+                    work.push_back(pred);
+                }
+            }
+        }
+        loops.push_back(std::move(loop));
+    }
+    stable_sort(loops.begin(), loops.end(), [](const ir_loop& a, const ir_loop& b) {
+        return a.blocks.size() < b.blocks.size();
+    });
+    for (size_t i = 0; i < loops.size(); i++) {
+        for (auto j = i + 1; j < loops.size(); j++) {
+            if (loops[j].has(loops[i].header)) {
+                loops[i].parent = (int) j;
+                break;
+            }
+        }
+    }
+    return loops;
+}
+
+static ir_insn make_insn(ir_opcode opcode, int dst, vector<ir_value> in) {
+    ir_insn insn;
+    insn.opcode = opcode;
+    insn.dst = dst;
+    insn.in = std::move(in);
+    return insn;
+}
+
+static ir_insn make_jump(int target) {
+    auto insn = make_insn(IR_JUMP, -1, {});
+    insn.arg = target;
+    return insn;
+}
+
+static ir_insn make_load(ir_cell cell) {
+    return make_insn(IR_LOAD, cell.reg, {ir_value::of_constant(cell.cell)});
+}
+
+static ir_insn make_store(ir_cell cell) {
+    return make_insn(IR_STORE, -1, {ir_value::of_constant(cell.cell), ir_value::of_reg(cell.reg)});
+}
+
+static void insert_before_terminator(ir_block& block, ir_insn insn) {
+    block.insns.insert(block.insns.end() - 1, std::move(insn));
+}
+
+// The block outside of the loop that every entry into it comes through and that only jumps to the
+// header, made if there is none
+static int preheader(ir_function& function, const ir_loop& loop) {
+    auto preds = predecessors(function);
+    vector<int> outside;
+    for (auto pred : preds[loop.header]) {
+        if (!loop.has(pred)) {
+            outside.push_back(pred);
+        }
+    }
+    if (outside.size() == 1 && function.blocks[outside[0]].terminator().opcode == IR_JUMP) {
+        return outside[0];
+    }
+    auto block = function.new_block();
+    function.blocks[block].insns.push_back(make_jump(loop.header));
+    for (auto pred : outside) {
+        retarget(function.blocks[pred], loop.header, block);
+    }
+    return block;
+}
+
+// Copies instructions for another place in the function. Registers that are written once get new
+// ones in the copy, so that they are still written once, and exits are copied as well
+struct ir_cloner {
+    ir_function& function;
+    const reg_counts& counts;
+    map<int, int> renamed;
+
+    ir_insn clone(const ir_insn& insn) {
+        auto copy = insn;
+        if (insn.exit >= 0) {
+            auto exit = function.exits[insn.exit];
+            function.exits.push_back(std::move(exit));
+            copy.exit = (int) function.exits.size() - 1;
+        }
+        for_each_operand(function, copy, [&](ir_value& value) {
+            auto name = value.is_constant() ? renamed.end() : renamed.find(value.reg);
+            if (name != renamed.end()) {
+                value.reg = name->second;
+            }
+        });
+        if (copy.dst >= 0 && counts.defs[copy.dst] == 1) {
+            copy.dst = renamed[copy.dst] = function.new_reg();
+        }
+        return copy;
+    }
+};
+
+// whether a register written once in one of blocks is read anywhere else
+static bool temporaries_escape(const ir_function& function, const vector<int>& blocks) {
+    auto counts = count_regs(function);
+    vector<bool> inside(function.blocks.size()), temporary(function.regs);
+    for (auto b : blocks) {
+        inside[b] = true;
+        for (auto& insn : function.blocks[b].insns) {
+            if (insn.dst >= 0 && counts.defs[insn.dst] == 1) {
+                temporary[insn.dst] = true;
+            }
+        }
+    }
+    bool escapes = false;
+    for (size_t b = 0; b < function.blocks.size(); b++) {
+        if (!inside[b]) {
+            for (auto& insn : function.blocks[b].insns) {
+                for_each_read(function, insn, [&](int reg) { escapes |= temporary[reg]; });
+            }
+        }
+    }
+    return escapes;
+}
+
+// at most this many instructions are copied to rotate a loop
+const int MAX_ROTATED_INSNS = 16;
+
+// A loop that tests at the top, H: ... BRANCH -> B, X with B: ... JUMP H, becomes one that tests at
+// the bottom: H goes in front of the loop and to the end of B, which then loops on its own and
+// only takes one branch per iteration
+static bool rotate_loop(ir_function& function, const ir_loop& loop) {
+    if (loop.blocks.size() != 2) {
+        return false;
+    }
+    auto h = loop.header, b = loop.blocks[1];
+    auto& header = function.blocks[h];
+    auto& test = header.terminator();
+    if (test.opcode != IR_BRANCH || header.insns.size() > MAX_ROTATED_INSNS ||
+        function.blocks[b].terminator().opcode != IR_JUMP || (test.arg == b) == (test.other == b) ||
+        test.arg == h || test.other == h || temporaries_escape(function, {h})) {
+        return false;
+    }
+    auto counts = count_regs(function);
+    auto entry = function.new_block();
+    ir_cloner in_front{function, counts, {}}, at_end{function, counts, {}};
+    auto& body = function.blocks[b].insns;
+    body.pop_back();
+    for (auto& insn : function.blocks[h].insns) {
+        function.blocks[entry].insns.push_back(in_front.clone(insn));
+        body.push_back(at_end.clone(insn));
+    }
+    auto preds = predecessors(function);
+    for (auto pred : preds[h]) {
+        retarget(function.blocks[pred], h, entry);
+    }
+    function.blocks[h].insns.clear();
+    return true;
+}
+
+// constant addresses that a loop keeps in registers at most
+const int MAX_PROMOTED_CELLS = 8;
+
+// Keeps the memory cells at constant addresses that the loop uses most in registers, loaded in the
+// preheader and written back wherever control leaves the loop or something else may read memory.
+// Accesses at computed addresses that hit one of them take a slow path, see ir_insn::aliases
+static void promote_cells(ir_function& function, const ir_loop& loop) {
+    map<int, int> uses;
+    set<int> written;
+    for (auto b : loop.blocks) {
+        for (auto& insn : function.blocks[b].insns) {
+            if ((insn.opcode == IR_LOAD || insn.opcode == IR_STORE) && insn.in[0].is_constant() &&
+                insn.in[0].constant >= 0 && insn.in[0].constant < function.memory_size) {
+                uses[insn.in[0].constant]++;
+                if (insn.opcode == IR_STORE) {
+                    written.insert(insn.in[0].constant);
+                }
+            }
+        }
+    }
+    if (uses.empty()) {
+        return;
+    }
+    vector<pair<int, int>> ranked;
+    for (auto [cell, count] : uses) {
+        ranked.emplace_back(-count, cell);
+    }
+    sort(ranked.begin(), ranked.end());
+    ranked.resize(min(ranked.size(), (size_t) MAX_PROMOTED_CELLS));
+    // all promoted cells, and the ones that the loop changes and that have to be written back
+    vector<ir_cell> promoted, changed;
+    map<int, int> reg_of;
+    for (auto [count, cell] : ranked) {
+        ir_cell promotion{cell, function.new_reg()};
+        promoted.push_back(promotion);
+        reg_of[cell] = promotion.reg;
+        if (written.count(cell)) {
+            changed.push_back(promotion);
+        }
+    }
+    auto entry = preheader(function, loop);
+    for (auto cell : promoted) {
+        insert_before_terminator(function.blocks[entry], make_load(cell));
+    }
+    auto spill = [&](vector<ir_insn>& insns) {
+        for (auto cell : changed) {
+            insns.push_back(make_store(cell));
+        }
+    };
+    set<pair<int, int>> leaving;
+    for (auto b : loop.blocks) {
+        vector<ir_insn> insns;
+        for (auto& insn : function.blocks[b].insns) {
+            auto promotion = (insn.opcode == IR_LOAD || insn.opcode == IR_STORE) && insn.in[0].is_constant()
+                             ? reg_of.find(insn.in[0].constant) : reg_of.end();
+            if (promotion != reg_of.end()) {
+                if (insn.opcode == IR_LOAD) {
+                    insn.in = {ir_value::of_reg(promotion->second)};
+                } else {
+                    insn.dst = promotion->second;
+                    insn.in = {insn.in[1]};
+                    insn.exit = -1;
+                }
+                insn.opcode = IR_COPY;
+                insns.push_back(std::move(insn));
+                continue;
+            }
+            auto computed = !insn.in.empty() && !insn.in[0].is_constant();
+            switch (insn.opcode) {
+                case IR_LOAD:
+                    if (computed) {
+                        insn.aliases = changed;
+                    }
+                    break;
+                case IR_STORE:
+                    if (computed) {
+                        insn.aliases = promoted;
+                    }
+                    break;
+                case IR_BULK:
+                case IR_CALL:
+                case IR_RETURN:
+                case IR_TAIL_CALL:
+                    spill(insns);
+                    break;
+                default:
+                    break;
+            }
+            if (has_exit(insn) && insn.opcode != IR_BULK && insn.opcode != IR_CALL) {
+                auto& spills = function.exits[insn.exit].spills;
+                spills.insert(spills.end(), changed.begin(), changed.end());
+            }
+            for (auto successor : targets(insn)) {
+                if (!loop.has(successor)) {
+                    leaving.emplace(b, successor);
+                }
+            }
+            auto reloads = writes_memory(insn);
+            insns.push_back(std::move(insn));
+            if (reloads) {
+                for (auto cell : promoted) {
+                    insns.push_back(make_load(cell));
+                }
+            }
+        }
+        function.blocks[b].insns = std::move(insns);
+    }
+    if (changed.empty()) {
+        return;
+    }
+    for (auto [from, to] : leaving) {
+        auto landing = function.new_block();
+        spill(function.blocks[landing].insns);
+        function.blocks[landing].insns.push_back(make_jump(to));
+        retarget(function.blocks[from], to, landing);
+    }
+}
+
+static bool is_invariant_candidate(const ir_insn& insn) {
+    // nothing that can trap, DIV included, moves to where it might not have run
+    return insn.opcode == IR_COPY || (is_binary(insn.opcode) && insn.opcode != IR_DIV);
+}
+
+// Moves what the loop computes the same way every time around into its preheader
+static bool hoist_invariants(ir_function& function, const ir_loop& loop) {
+    auto counts = count_regs(function);
+    vector<int> loop_defs(function.regs);
+    for (auto b : loop.blocks) {
+        for (auto& insn : function.blocks[b].insns) {
+            for_each_write(insn, [&](int reg) { loop_defs[reg]++; });
+        }
+    }
+    auto invariant = [&](const ir_insn& insn) {
+        return is_invariant_candidate(insn) && counts.defs[insn.dst] == 1 &&
+               all_of(insn.in.begin(), insn.in.end(), [&](ir_value value) {
+                   return value.is_constant() || loop_defs[value.reg] == 0;
+               });
+    };
+    vector<ir_insn> hoisted;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (auto b : loop.blocks) {
+            auto& insns = function.blocks[b].insns;
+            for (size_t i = 0; i < insns.size(); i++) {
+                if (invariant(insns[i])) {
+                    loop_defs[insns[i].dst]--;
+                    hoisted.push_back(std::move(insns[i]));
+                    insns.erase(insns.begin() + (long) i--);
+                    changed = true;
+                }
+            }
+        }
+    }
+    if (hoisted.empty()) {
+        return false;
+    }
+    auto entry = preheader(function, loop);
+    for (auto& insn : hoisted) {
+        insert_before_terminator(function.blocks[entry], std::move(insn));
+    }
+    return true;
+}
+
+// the comparison that is true where op is false
+static ir_opcode negated(ir_opcode opcode) {
+    switch (opcode) {
+        case IR_LESS:
+            return IR_GREATER_OR_EQUAL;
+        case IR_LESS_OR_EQUAL:
+            return IR_GREATER;
+        case IR_GREATER:
+            return IR_LESS_OR_EQUAL;
+        case IR_GREATER_OR_EQUAL:
+            return IR_LESS;
+        default:
+            return IR_EQUAL;
+    }
+}
+
+// loops with more instructions than this aren't unrolled
+const int MAX_UNROLLED_INSNS = 48;
+
+// How a counted loop counts: reg changes by step once per iteration and the loop goes on while
+// reg + compare_k * step, as it is when the test runs, cont bound
+struct ir_induction {
+    int reg;
+    ir_value step;
+    int compare_k;
+    ir_value bound;
+    ir_opcode cont;
+};
+
+// Tracks a candidate induction variable through the block: which registers hold it plus k steps
+struct ir_affine {
+    map<int, int> k_of;
+    ir_value step;
+    bool has_step = false;
+
+    // true for instructions that only step or copy the variable, with the k of their dst in k
+    template<typename F>
+    bool follows(const ir_insn& insn, F invariant, int& k) {
+        if (insn.in.empty() || insn.in[0].is_constant() || !k_of.count(insn.in[0].reg)) {
+            return false;
+        }
+        k = k_of[insn.in[0].reg];
+        if (insn.opcode == IR_COPY) {
+            return true;
+        }
+        if (insn.opcode == IR_ADD && invariant(insn.in[1]) && (!has_step || insn.in[1] == step)) {
+            step = insn.in[1];
+            has_step = true;
+            k++;
+            return true;
+        }
+        return false;
+    }
+};
+
+// Unrolls a loop of a single block that counts towards an invariant bound by factor: after a guard
+// that there are at least factor iterations left, the copies run without testing in between and the
+// induction variable is stepped once for all of them, with the other values of it computed from
+// its value at the start. The original block stays for the iterations that are left
+static bool unroll_loop(ir_function& function, const ir_loop& loop, int factor) {
+    auto b = loop.header;
+    if (loop.blocks.size() != 1) {
+        return false;
+    }
+    auto& block = function.blocks[b];
+    auto& test = block.terminator();
+    if (test.opcode != IR_BRANCH || (test.arg == b) == (test.other == b) || test.in[0].is_constant() ||
+        block.insns.size() > MAX_UNROLLED_INSNS || temporaries_escape(function, {b})) {
+        return false;
+    }
+    auto counts = count_regs(function);
+    vector<int> loop_defs(function.regs);
+    for (auto& insn : block.insns) {
+        for_each_write(insn, [&](int reg) { loop_defs[reg]++; });
+    }
+    // registers made below are never invariant
+    auto invariant = [&](ir_value value) {
+        return value.is_constant() || (value.reg < (int) loop_defs.size() && loop_defs[value.reg] == 0);
+    };
+    auto compare = find_if(block.insns.begin(), block.insns.end(), [&](const ir_insn& insn) {
+        return insn.dst == test.in[0].reg;
+    });
+    if (compare == block.insns.end() || compare->opcode < IR_LESS || compare->opcode > IR_GREATER_OR_EQUAL) {
+        return false;
+    }
+    // the promoted cells that exits write back are read as they are, so they can't be stepped lazily
+    set<int> pinned;
+    for (auto& insn : block.insns) {
+        for (auto& alias : insn.aliases) {
+            pinned.insert(alias.reg);
+        }
+        if (has_exit(insn)) {
+            for (auto& spill : function.exits[insn.exit].spills) {
+                pinned.insert(spill.reg);
+            }
+        }
+    }
+    bool found = false;
+    ir_induction induction{};
+    for (int reg = 0; reg < function.regs && !found; reg++) {
+        if (!loop_defs[reg] || counts.defs[reg] < 2 || pinned.count(reg)) {
+            continue;
+        }
+        ir_affine affine;
+        affine.k_of[reg] = 0;
+        bool counted = false, stepped_elsewhere = false;
+        for (auto insn = block.insns.begin(); insn != block.insns.end() - 1; insn++) {
+            if (insn == compare) {
+                auto& in = insn->in;
+                auto x = in[0].is_constant() ? affine.k_of.end() : affine.k_of.find(in[0].reg);
+                auto y = in[1].is_constant() ? affine.k_of.end() : affine.k_of.find(in[1].reg);
+                if (x != affine.k_of.end() && invariant(in[1])) {
+                    induction = {reg, {}, x->second, in[1], insn->opcode};
+                    counted = true;
+                } else if (y != affine.k_of.end() && invariant(in[0])) {
+                    induction = {reg, {}, y->second, in[0], mirrored(insn->opcode)};
+                    counted = true;
+                }
+            }
+            int k;
+            auto follows = affine.follows(*insn, invariant, k);
+            for_each_write(*insn, [&](int written) {
+                affine.k_of.erase(written);
+                stepped_elsewhere |= written == reg && !follows;
+            });
+            if (follows) {
+                affine.k_of[insn->dst] = k;
+            }
+        }
+        auto end = affine.k_of.find(reg);
+        if (counted && !stepped_elsewhere && affine.has_step && end != affine.k_of.end() && end->second == 1) {
+            induction.step = affine.step;
+            found = true;
+        }
+    }
+    if (!found) {
+        return false;
+    }
+    auto cont = test.arg == b ? induction.cont : negated(induction.cont);
+    if (cont == IR_EQUAL) {
+        return false;
+    }
+    bool up = cont == IR_LESS || cont == IR_LESS_OR_EQUAL;
+    auto& step = induction.step;
+    auto& bound = induction.bound;
+    if (step.is_constant() && (step.constant == 0 || (step.constant > 0) != up)) {
+        return false;
+    }
+    // The guard before the unrolled copies checks i cont bound - m * step, which is what the tests of
+    // the first factor - 1 copies come to, and all of these values have to fit in an int
+    auto m = factor - 2 + induction.compare_k;
+    const int half = INT_MAX / 2;
+    auto bound_fits = [&](int n) { return up ? n >= -half : n <= half; };
+    vector<ir_insn> setup;
+    vector<ir_value> conditions;
+    auto condition = [&](ir_opcode opcode, ir_value value, int constant) {
+        auto dst = function.new_reg();
+        setup.push_back(make_insn(opcode, dst, {value, ir_value::of_constant(constant)}));
+        conditions.push_back(ir_value::of_reg(dst));
+    };
+    ir_value limit;
+    if (step.is_constant()) {
+        auto delta = (int64_t) m * step.constant;
+        if (delta > half || delta < -half) {
+            return false;
+        }
+        if (bound.is_constant()) {
+            if (!bound_fits(bound.constant)) {
+                return false;
+            }
+            limit = ir_value::of_constant((int) (bound.constant - delta));
+        } else {
+            condition(up ? IR_GREATER_OR_EQUAL : IR_LESS_OR_EQUAL, bound, up ? -half : half);
+            limit = ir_value::of_reg(function.new_reg());
+            setup.push_back(make_insn(IR_ADD, limit.reg, {bound, ir_value::of_constant((int) -delta)}));
+        }
+    } else {
+        if (bound.is_constant() && !bound_fits(bound.constant)) {
+            return false;
+        }
+        if (!bound.is_constant()) {
+            condition(up ? IR_GREATER_OR_EQUAL : IR_LESS_OR_EQUAL, bound, up ? -half : half);
+        }
+        auto largest = m > 0 ? half / m : INT_MAX;
+        condition(up ? IR_GREATER : IR_LESS, step, 0);
+        condition(up ? IR_LESS_OR_EQUAL : IR_GREATER_OR_EQUAL, step, up ? largest : -largest);
+        auto delta = function.new_reg();
+        setup.push_back(make_insn(IR_MUL, delta, {step, ir_value::of_constant(m)}));
+        limit = ir_value::of_reg(function.new_reg());
+        setup.push_back(make_insn(IR_SUB, limit.reg, {bound, ir_value::of_reg(delta)}));
+    }
+    // the conditions are 0 or 1, so their product tells whether all hold
+    auto all_hold = conditions.empty() ? ir_value::of_constant(1) : conditions[0];
+    for (size_t i = 1; i < conditions.size(); i++) {
+        auto dst = function.new_reg();
+        setup.push_back(make_insn(IR_MUL, dst, {all_hold, conditions[i]}));
+        all_hold = ir_value::of_reg(dst);
+    }
+
+    auto original = function.blocks[b].insns;
+    auto entry = preheader(function, loop);
+    auto guard = function.new_block();
+    auto unrolled = function.new_block();
+    auto guard_value = function.new_reg();
+    function.blocks[guard].insns.push_back(
+            make_insn(cont, guard_value, {ir_value::of_reg(induction.reg), limit}));
+    auto branch = make_insn(IR_BRANCH, -1, {ir_value::of_reg(guard_value)});
+    branch.arg = unrolled;
+    branch.other = b;
+    function.blocks[guard].insns.push_back(branch);
+    auto& entry_insns = function.blocks[entry].insns;
+    entry_insns.pop_back();
+    entry_insns.insert(entry_insns.end(), setup.begin(), setup.end());
+    branch.in = {all_hold};
+    branch.arg = guard;
+    entry_insns.push_back(branch);
+
+    // i + k * step, where i is the value of the induction variable at the start of the copies
+    map<int, ir_value> steps, values;
+    auto step_times = [&](int k) {
+        if (step.is_constant()) {
+            return ir_value::of_constant((int) ((unsigned) step.constant * (unsigned) k));
+        }
+        if (!steps.count(k)) {
+            auto dst = function.new_reg();
+            insert_before_terminator(function.blocks[entry],
+                                     make_insn(IR_MUL, dst, {step, ir_value::of_constant(k)}));
+            steps[k] = ir_value::of_reg(dst);
+        }
+        return steps[k];
+    };
+    vector<ir_insn> insns;
+    auto value_at = [&](int k) {
+        if (k == 0) {
+            return ir_value::of_reg(induction.reg);
+        }
+        if (!values.count(k)) {
+            auto dst = function.new_reg();
+            insns.push_back(make_insn(IR_ADD, dst, {ir_value::of_reg(induction.reg), step_times(k)}));
+            values[k] = ir_value::of_reg(dst);
+        }
+        return values[k];
+    };
+    // the promoted cells that accesses at addresses the induction variable steps through could hit
+    int lowest = INT_MAX, highest = INT_MIN;
+    ir_affine affine;
+    affine.k_of[induction.reg] = 0;
+    affine.step = step;
+    affine.has_step = true;
+    for (int copy = 0; copy < factor; copy++) {
+        ir_cloner cloner{function, counts, {}};
+        for (auto& original_insn : original) {
+            auto last = is_terminator(original_insn.opcode);
+            if (last && copy < factor - 1) {
+                continue;
+            }
+            auto insn = cloner.clone(original_insn);
+            int k;
+            if (affine.follows(insn, invariant, k) &&
+                (insn.dst == induction.reg || counts.defs[original_insn.dst] == 1)) {
+                affine.k_of[insn.dst] = k;
+                continue;
+            }
+            auto address = insn.in.empty() || insn.in[0].is_constant() ? affine.k_of.end()
+                                                                        : affine.k_of.find(insn.in[0].reg);
+            if ((insn.opcode == IR_LOAD || insn.opcode == IR_STORE) && !insn.aliases.empty() &&
+                address != affine.k_of.end() && address->second <= m) {
+                // between i and the values the guard checked, which are all past the promoted cells
+                for (auto alias : insn.aliases) {
+                    lowest = min(lowest, alias.cell);
+                    highest = max(highest, alias.cell);
+                }
+                insn.aliases.clear();
+            }
+            for_each_operand(function, insn, [&](ir_value& value) {
+                auto known = value.is_constant() ? affine.k_of.end() : affine.k_of.find(value.reg);
+                if (known != affine.k_of.end()) {
+                    value = value_at(known->second);
+                }
+            });
+            for_each_write(insn, [&](int written) { affine.k_of.erase(written); });
+            if (last) {
+                // the only step of the induction variable left
+                auto k = affine.k_of.at(induction.reg);
+                if (values.count(k)) {
+                    insns.push_back(make_insn(IR_COPY, induction.reg, {values[k]}));
+                } else {
+                    insns.push_back(make_insn(IR_ADD, induction.reg, {ir_value::of_reg(induction.reg), step_times(k)}));
+                }
+            }
+            insns.push_back(std::move(insn));
+        }
+    }
+    function.blocks[unrolled].insns = std::move(insns);
+    if (lowest <= highest) {
+        // These addresses only move away from i, which itself only moves away from where it starts,
+        // so the copies never hit a promoted cell if i starts past all of them
+        auto past = function.new_reg(), both = function.new_reg();
+        auto& entry_block = function.blocks[entry];
+        insert_before_terminator(entry_block, make_insn(up ? IR_GREATER : IR_LESS, past, {
+                ir_value::of_reg(induction.reg), ir_value::of_constant(up ? highest : lowest)}));
+        insert_before_terminator(entry_block, make_insn(IR_MUL, both, {
+                entry_block.terminator().in[0], ir_value::of_reg(past)}));
+        entry_block.insns.back().in = {ir_value::of_reg(both)};
+    }
+    retarget(function.blocks[unrolled], b, guard);
+    return true;
+}
+
+void optimize_ir(ir_function& function, const ir_options& options) {
+    clean_up(function);
+    if (!options.loops) {
+        return;
+    }
+    // every pass below changes the blocks, so the loops are found again after each change
+    auto each_loop = [&](auto pass) {
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (auto& loop : find_loops(function)) {
+                if (pass(loop)) {
+                    clean_up(function);
+                    changed = true;
+                    break;
+                }
+            }
+        }
+    };
+    each_loop([&](const ir_loop& loop) { return rotate_loop(function, loop); });
+    set<int> promoted;
+    each_loop([&](const ir_loop& loop) {
+        if (loop.parent >= 0 || !promoted.insert(loop.header).second) {
+            return false;
+        }
+        promote_cells(function, loop);
+        return true;
+    });
+    each_loop([&](const ir_loop& loop) { return hoist_invariants(function, loop); });
+    if (options.unroll > 1) {
+        set<int> unrolled;
+        each_loop([&](const ir_loop& loop) {
+            return unrolled.insert(loop.header).second && unroll_loop(function, loop, options.unroll);
+        });
+    }
+}
+
+static const char* const ir_opcode_names[] = {
+        "COPY", "ADD", "SUB", "MUL", "DIV", "EQUAL", "LESS", "LESS_OR_EQUAL", "GREATER", "GREATER_OR_EQUAL",
+        "LOAD", "STORE", "CHECK_ADDRESS", "CHECK_NONZERO", "CHECK_QUOTIENT", "PRINT", "BULK", "CALL", "FUEL",
+        "JUMP", "BRANCH", "EXIT", "RETURN", "TAIL_CALL"
+};
+
+static ostream& operator<<(ostream& out, ir_value value) {
+    return value.is_constant() ? out << value.constant : out << 'r' << value.reg;
+}
+
+static void dump_cells(ostream& out, const char* what, const vector<ir_cell>& cells) {
+    if (!cells.empty()) {
+        out << ' ' << what;
+        for (auto cell : cells) {
+            out << ' ' << cell.cell << ":r" << cell.reg;
+        }
+    }
+}
+
+vector<int> ir_def_counts(const ir_function& function) {
+    return count_regs(function).defs;
+}
+
+vector<int> ir_read_counts(const ir_function& function) {
+    return count_regs(function).reads;
+}
+
+string dump_ir(const ir_function& function) {
+    ostringstream out;
+    out << "inputs";
+    for (auto input : function.inputs) {
+        out << " r" << input;
+    }
+    out << '\n';
+    for (auto b : ir_block_order(function)) {
+        out << 'b' << b << ":\n";
+        for (auto& insn : function.blocks[b].insns) {
+            out << "    ";
+            if (insn.dst >= 0) {
+                out << 'r' << insn.dst << " = ";
+            }
+            out << ir_opcode_names[insn.opcode];
+            if (insn.opcode == IR_BULK) {
+                out << ' ' << opcode_mnemonics[insn.arg].name;
+            } else if (insn.opcode == IR_CALL || insn.opcode == IR_TAIL_CALL) {
+                out << " f" << insn.arg;
+            }
+            for (size_t i = 0; i < insn.in.size(); i++) {
+                out << (i ? ", " : " ") << insn.in[i];
+            }
+            for (auto target : targets(insn)) {
+                out << " b" << target;
+            }
+            dump_cells(out, "aliases", insn.aliases);
+            if (has_exit(insn)) {
+                auto& exit = function.exits[insn.exit];
+                if (exit.kind == EXIT_TO_INTERPRETER) {
+                    out << " exit to " << exit.ip << " [";
+                    for (size_t i = 0; i < exit.stack.size(); i++) {
+                        out << (i ? ", " : "") << exit.stack[i];
+                    }
+                    out << ']';
+                } else if (exit.kind == EXIT_STOP) {
+                    out << " stop " << exit.reason << ' ' << exit.value;
+                } else {
+                    out << " stopped";
+                }
+                dump_cells(out, "spills", exit.spills);
+            }
+            out << '\n';
+        }
+    }
+    return out.str();
+}
@@ -0,0 +1,206 @@
+#ifndef JIT_IR_H
+#define JIT_IR_H
+
+#include <string>
+#include <vector>
+
+// The JIT doesn't go from bytecode to libjit directly. build_ir() first turns a range of the program
+// into this IR: basic blocks of three address instructions on virtual registers, where the operand
+// stack is gone and every stack entry that lives across blocks has a register of its own.
+// optimize_ir() then works on the loops, and jit_compiled_func lowers the result one instruction at a
+// time. Registers that are written once stay libjit temporaries, the others become libjit locals.
+//
+// Nothing in here knows about libjit, see vm.h for the lowering.
+
+struct bytecode;
+struct function_info;
+
+// a register, or a constant if reg is -1
+struct ir_value {
+    int reg = -1;
+    int constant = 0;
+
+    static ir_value of_reg(int reg) {
+        return {reg, 0};
+    }
+
+    static ir_value of_constant(int constant) {
+        return {-1, constant};
+    }
+
+    bool is_constant() const {
+        return reg < 0;
+    }
+
+    bool operator==(const ir_value& other) const {
+        return reg == other.reg && (reg >= 0 || constant == other.constant);
+    }
+
+    bool operator!=(const ir_value& other) const {
+        return !(*this == other);
+    }
+};
+
+enum ir_opcode {
+    // dst = in[0]
+    IR_COPY,
+    // dst = in[0] op in[1]; a DIV always comes after a CHECK_NONZERO of in[1]
+    IR_ADD,
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    // dst = 1 if in[0] op in[1], 0 otherwise
+    IR_EQUAL,
+    IR_LESS,
+    IR_LESS_OR_EQUAL,
+    IR_GREATER,
+    IR_GREATER_OR_EQUAL,
+    // dst = memory[in[0]]
+    IR_LOAD,
+    // memory[in[0]] = in[1]
+    IR_STORE,
+    // leave through exit unless in[0] is inside memory, or if in[0] is 0
+    IR_CHECK_ADDRESS,
+    IR_CHECK_NONZERO,
+    // leave through exit if in[0] / in[1] doesn't fit into an int, INT_MIN / -1
+    IR_CHECK_QUOTIENT,
+    // prints in[0]
+    IR_PRINT,
+    // the bulk memory or atomic instruction arg (OP_FILL...) on in, dst for the SCANs and the atomics.
+    // Leaves through exit on a bad address. SPAWN, JOIN, POP_RES and NATIVE are calls of the same kind,
+    // in[0] is where SPAWN starts the worker and the host function NATIVE calls; JOIN leaves through exit
+    // if it ended the program, NATIVE if there is no such host function
+    IR_BULK,
+    // dst = function arg called with in, dst is -1 for functions without a result. Leaves through
+    // exit if the program ended in the function
+    IR_CALL,
+    // takes a unit of fuel at a backward jump of a metered run, leaves through exit if there is none left
+    IR_FUEL,
+    // Terminators, the last instruction of every block and nowhere else.
+    // to block target
+    IR_JUMP,
+    // to block target if in[0] is not 0, to block other otherwise
+    IR_BRANCH,
+    // leaves through exit
+    IR_EXIT,
+    // returns from a function, with in[0] unless it is void
+    IR_RETURN,
+    // returns what function arg returns when called with in
+    IR_TAIL_CALL
+};
+
+// a promoted memory cell and the register that holds it
+struct ir_cell {
+    int cell;
+    int reg;
+};
+
+enum ir_exit_kind {
+    // writes stack back to VM::stack and continues in the interpreter at ip
+    EXIT_TO_INTERPRETER,
+    // a function reports reason for value and returns
+    EXIT_STOP,
+    // the program ended already: a function returns, other code returns ip
+    EXIT_STOPPED
+};
+
+// How control leaves the compiled code. Every instruction that can leave has an exit of its own
+struct ir_exit {
+    ir_exit_kind kind;
+    int ip;
+    int reason;
+    ir_value value;
+    std::vector<ir_value> stack;
+    // promoted cells that may have changed, written back to memory before leaving
+    std::vector<ir_cell> spills;
+};
+
+struct ir_insn {
+    ir_opcode opcode;
+    int dst = -1;
+    std::vector<ir_value> in;
+    // the bulk memory, atomic, SPAWN, JOIN, POP_RES or NATIVE opcode, the function for calls, the target
+    // block for jumps
+    int arg = 0;
+    int other = -1;
+    int exit = -1;
+    // For LOAD and STORE with a computed address in a loop with promoted cells: an address between
+    // the lowest and the highest of these cells takes a slow path that writes them back before the
+    // access and, for STORE, loads them again after it
+    std::vector<ir_cell> aliases;
+    // of the bytecode instruction it comes from
+    int ip = -1;
+};
+
+struct ir_block {
+    std::vector<ir_insn> insns;
+
+    const ir_insn& terminator() const {
+        return insns.back();
+    }
+};
+
+struct ir_function {
+    // blocks[0] is the entry, blocks nothing jumps to are empty
+    std::vector<ir_block> blocks;
+    std::vector<ir_exit> exits;
+    int regs = 0;
+    // the registers of the stack entries or arguments the code starts with, bottom first
+    std::vector<int> inputs;
+    // cells of VM memory, constant addresses below it are known to be good
+    int memory_size = 0;
+
+    int new_reg() {
+        return regs++;
+    }
+
+    int new_block() {
+        blocks.emplace_back();
+        return (int) blocks.size() - 1;
+    }
+};
+
+// What build_ir() translates: the instructions in [ip_start, ip_end) entered at ip_start with
+// entry_depth values on the stack, see jit_compiled_func. functions is null where calls leave to the
+// interpreter
+struct ir_source {
+    const bytecode* program;
+    const std::vector<function_info>* functions;
+    int ip_start, ip_end, entry_depth, frame_base;
+    bool is_function, is_void;
+    // LOAD and STORE check their address, where there are no guard pages
+    bool check_addresses;
+    // backward jumps take fuel, see VM::set_fuel()
+    bool fuel;
+    int memory_size;
+};
+
+// the stack depth before every instruction of the range, -1 for unreachable ones, indexed by
+// ip - ip_start. False if the depth depends on the path or goes below zero
+bool ir_stack_depths(const ir_source& source, std::vector<int>& depths);
+
+ir_function build_ir(const ir_source& source, const std::vector<int>& depths);
+
+// How hard optimize_ir() works: the block optimizations (constant folding, copy propagation, dead code)
+// always run, loops only get promoted cells, hoisting and unrolling with loops set
+struct ir_options {
+    bool loops = true;
+    // loops are unrolled this often, if they are counted and small enough
+    int unroll = 4;
+};
+
+void optimize_ir(ir_function& function, const ir_options& options);
+
+// how often every register is written, the inputs counting once
+std::vector<int> ir_def_counts(const ir_function& function);
+
+// how often every register is read, by instructions and by the exits they may take
+std::vector<int> ir_read_counts(const ir_function& function);
+
+// the blocks the entry leads to, in the order they are laid out in
+std::vector<int> ir_block_order(const ir_function& function);
+
+// one line per instruction, for --dump-ir
+std::string dump_ir(const ir_function& function);
+
+#endif //JIT_IR_H
@@ -0,0 +1,440 @@
+#include <climits>
+#include <cstring>
+#include "vm.h"
+
+using namespace std;
+
+jit_compiled_func::jit_compiled_func(jit_context& context, const bytecode& program, bool is_void, int num_args, int ip_start, int ip_end, int entry_depth, int* memory, int* stack, int* stack_size, vm_output* output,
+                                     jit_runtime* runtime, int frame_base, int64_t* fuel,
+                                     const vector<vm_native>* natives, bool check_addresses):
+                 jit_function(context),
+                 program(program), num_args(num_args), ip_start(ip_start), ip_end(ip_end), entry_depth(entry_depth), frame_base(frame_base), is_void(is_void),
+                 is_function(base_opcode(program.opcode(ip_start)) == OP_ENTER), check_addresses(check_addresses) {
+    this->memory_outer = memory;
+    this->stack_outer = stack;
+    this->stack_size_ptr_outer = stack_size;
+    this->output_outer = output;
+    this->runtime_outer = runtime;
+    this->fuel_outer = fuel;
+    this->natives_outer = natives;
+    create();
+    set_recompilable();
+}
+
+void jit_compiled_func::compile_now(const ir_options& options, ostream* dump) {
+    this->options = options;
+    this->dump = dump;
+    build_start();
+    build();
+    compile();
+    build_end();
+}
+
+size_t jit_compiled_func::code_size() {
+    auto start = (char*) closure();
+    auto context = jit_function_get_context(raw());
+    auto inside = [&](size_t offset) {
+        return jit_function_from_pc(context, start + offset, nullptr) == raw();
+    };
+    // inside(low) and !inside(high)
+    size_t low = 0, high = 1;
+    while (inside(high)) {
+        low = high;
+        high *= 2;
+    }
+    while (high - low > 1) {
+        auto middle = (low + high) / 2;
+        (inside(middle) ? low : high) = middle;
+    }
+    return high;
+}
+
+void jit_compiled_func::build() {
+    memory = new_constant(memory_outer);
+    stack = new_constant(stack_outer);
+    stack_size_ptr = new_constant(stack_size_ptr_outer);
+    output = new_constant((void*) output_outer);
+    if (runtime_outer) {
+        runtime = new_constant((void*) runtime_outer);
+        stopped_ptr = new_constant((void*) &runtime_outer->stopped);
+        call_depth_ptr = new_constant((void*) &runtime_outer->call_depth);
+    }
+    if (fuel_outer) {
+        fuel_ptr = new_constant((void*) fuel_outer);
+    }
+    auto range = source();
+    // verify_program() made sure of the depths for the main program and functions, analyze() for loops
+    vector<int> depths;
+    ir_stack_depths(range, depths);
+    ir = build_ir(range, depths);
+    optimize_ir(ir, options);
+    if (dump) {
+        *dump << "; " << (is_function ? "function" : "code") << " [" << ip_start << ", " << ip_end << ")\n"
+              << dump_ir(ir);
+    }
+    lower();
+}
+
+void jit_compiled_func::lower() {
+    auto defs = ir_def_counts(ir);
+    values.assign(ir.regs, jit_value());
+    locals.assign(ir.regs, false);
+    for (auto& block : ir.blocks) {
+        for (auto& insn : block.insns) {
+            if (insn.opcode == IR_LOAD && !insn.aliases.empty()) {
+                locals[insn.dst] = true;
+            }
+        }
+    }
+    for (int reg = 0; reg < ir.regs; reg++) {
+        if (defs[reg] > 1 || locals[reg]) {
+            locals[reg] = true;
+            values[reg] = new_value(jit_type_int);
+        }
+    }
+    if (is_function) {
+        auto call_depth = insn_load_relative(call_depth_ptr, 0, jit_type_int);
+        jit_label fits = new_label();
+        insn_branch_if(call_depth < new_constant(MAX_CALL_DEPTH), fits);
+        stop(STOP_CALL_DEPTH, new_constant(0));
+        insn_label(fits);
+        insn_store_relative(call_depth_ptr, 0, call_depth + new_constant(1));
+    }
+    for (size_t i = 0; i < ir.inputs.size(); i++) {
+        write(ir.inputs[i], is_function ? get_param(i) : insn_load_elem(stack, new_constant((int) i), jit_type_int));
+    }
+    block_labels.clear();
+    for (size_t b = 0; b < ir.blocks.size(); b++) {
+        block_labels.push_back(new_label());
+    }
+    exit_labels.clear();
+    for (size_t e = 0; e < ir.exits.size(); e++) {
+        exit_labels.push_back(new_label());
+    }
+    exits_taken.assign(ir.exits.size(), false);
+    auto order = ir_block_order(ir);
+    for (size_t i = 0; i < order.size(); i++) {
+        insn_label(block_labels[order[i]]);
+        auto next = i + 1 < order.size() ? order[i + 1] : -1;
+        for (auto& insn : ir.blocks[order[i]].insns) {
+            lower(insn, next);
+        }
+    }
+    for (size_t e = 0; e < ir.exits.size(); e++) {
+        if (exits_taken[e]) {
+            insn_label(exit_labels[e]);
+            leave(ir.exits[e]);
+        }
+    }
+}
+
+void jit_compiled_func::write(int reg, const jit_value& value) {
+    if (locals[reg]) {
+        store(values[reg], value);
+    } else {
+        values[reg] = value;
+    }
+}
+
+void jit_compiled_func::lower(const ir_insn& insn, int next) {
+    switch (insn.opcode) {
+        case IR_COPY: {
+            auto value = read(insn.in[0]);
+            // a temporary must not follow later changes of a local
+            if (!locals[insn.dst] && !insn.in[0].is_constant() && locals[insn.in[0].reg]) {
+                value = insn_dup(value);
+            }
+            write(insn.dst, value);
+            break;
+        }
+        case IR_ADD:
+            write(insn.dst, read(insn.in[0]) + read(insn.in[1]));
+            break;
+        case IR_SUB:
+            write(insn.dst, read(insn.in[0]) - read(insn.in[1]));
+            break;
+        case IR_MUL:
+            write(insn.dst, read(insn.in[0]) * read(insn.in[1]));
+            break;
+        case IR_DIV:
+            write(insn.dst, read(insn.in[0]) / read(insn.in[1]));
+            break;
+        case IR_EQUAL:
+            write(insn.dst, read(insn.in[0]) == read(insn.in[1]));
+            break;
+        case IR_LESS:
+            write(insn.dst, read(insn.in[0]) < read(insn.in[1]));
+            break;
+        case IR_LESS_OR_EQUAL:
+            write(insn.dst, read(insn.in[0]) <= read(insn.in[1]));
+            break;
+        case IR_GREATER:
+            write(insn.dst, read(insn.in[0]) > read(insn.in[1]));
+            break;
+        case IR_GREATER_OR_EQUAL:
+            write(insn.dst, read(insn.in[0]) >= read(insn.in[1]));
+            break;
+        case IR_LOAD: {
+            auto addr = read(insn.in[0]);
+            if (!insn.aliases.empty()) {
+                // the promoted cells go to memory first if the address is one of them
+                jit_label fast = new_label();
+                insn_branch_if_not(hits(addr, insn.aliases), fast);
+                spill(insn.aliases);
+                insn_label(fast);
+            }
+            write(insn.dst, insn_load_elem(memory, addr, jit_type_int));
+            break;
+        }
+        case IR_STORE: {
+            auto addr = read(insn.in[0]);
+            auto val = read(insn.in[1]);
+            if (!insn.aliases.empty() && insn.exit >= 0) {
+                // the interpreter runs the STORE again, after the exit wrote the cells back
+                insn_branch_if(hits(addr, insn.aliases), exit_label(insn.exit));
+            } else if (!insn.aliases.empty()) {
+                jit_label fast = new_label(), done = new_label();
+                insn_branch_if_not(hits(addr, insn.aliases), fast);
+                spill(insn.aliases);
+                insn_store_elem(memory, addr, val);
+                for (auto cell : insn.aliases) {
+                    store(values[cell.reg], insn_load_elem(memory, new_constant(cell.cell), jit_type_int));
+                }
+                insn_branch(done);
+                insn_label(fast);
+                insn_store_elem(memory, addr, val);
+                insn_label(done);
+                break;
+            }
+            insn_store_elem(memory, addr, val);
+            break;
+        }
+        case IR_CHECK_ADDRESS: {
+            auto in_memory = insn_convert(read(insn.in[0]), jit_type_uint) < new_constant((jit_uint) program.memory_size);
+            insn_branch_if_not(in_memory, exit_label(insn.exit));
+            break;
+        }
+        case IR_CHECK_NONZERO: {
+            insn_branch_if_not(read(insn.in[0]), exit_label(insn.exit));
+            break;
+        }
+        case IR_CHECK_QUOTIENT: {
+            jit_label fits = new_label();
+            insn_branch_if(read(insn.in[0]) != new_constant(INT_MIN), fits);
+            insn_branch_if(read(insn.in[1]) == new_constant(-1), exit_label(insn.exit));
+            insn_label(fits);
+            break;
+        }
+        case IR_PRINT: {
+            jit_value_t args[] = {output.raw(), read(insn.in[0]).raw()};
+            this->insn_call_native("print_int", (void *)(&print_int),
+                                   signature_helper(jit_type_void, jit_type_void_ptr, jit_type_int, end_params),
+                                   args, 2, 0);
+            break;
+        }
+        case IR_BULK: {
+            bulk_memory(insn);
+            break;
+        }
+        case IR_CALL: {
+            auto result = call(insn, 0);
+            insn_branch_if(insn_load_relative(stopped_ptr, 0, jit_type_int), exit_label(insn.exit));
+            if (insn.dst >= 0) {
+                write(insn.dst, result);
+            }
+            break;
+        }
+        case IR_FUEL: {
+            auto left = insn_load_relative(fuel_ptr, 0, jit_type_long) - new_constant((jit_long) 1);
+            insn_store_relative(fuel_ptr, 0, left);
+            insn_branch_if(left < new_constant((jit_long) 0), exit_label(insn.exit));
+            break;
+        }
+        case IR_JUMP: {
+            if (insn.arg != next) {
+                insn_branch(block_labels[insn.arg]);
+            }
+            break;
+        }
+        case IR_BRANCH: {
+            auto cond = read(insn.in[0]);
+            if (insn.arg == next) {
+                insn_branch_if_not(cond, block_labels[insn.other]);
+            } else {
+                insn_branch_if(cond, block_labels[insn.arg]);
+                if (insn.other != next) {
+                    insn_branch(block_labels[insn.other]);
+                }
+            }
+            break;
+        }
+        case IR_EXIT: {
+            insn_branch(exit_label(insn.exit));
+            break;
+        }
+        case IR_RETURN: {
+            insn_store_relative(call_depth_ptr, 0, insn_load_relative(call_depth_ptr, 0, jit_type_int) - new_constant(1));
+            if (is_void) {
+                insn_return();
+            } else {
+                insn_return(read(insn.in[0]));
+            }
+            break;
+        }
+        case IR_TAIL_CALL: {
+            // the callee counts itself in call_depth instead of this function
+            insn_store_relative(call_depth_ptr, 0, insn_load_relative(call_depth_ptr, 0, jit_type_int) - new_constant(1));
+            auto result = call(insn, JIT_CALL_TAIL);
+            if (is_void) {
+                insn_return();
+            } else {
+                insn_return(result);
+            }
+            break;
+        }
+    }
+}
+
+jit_value jit_compiled_func::hits(const jit_value& addr, const vector<ir_cell>& cells) {
+    auto [lowest, highest] = minmax_element(cells.begin(), cells.end(), [](ir_cell a, ir_cell b) {
+        return a.cell < b.cell;
+    });
+    if (lowest->cell == highest->cell) {
+        return addr == new_constant(lowest->cell);
+    }
+    return insn_convert(addr - new_constant(lowest->cell), jit_type_uint) <=
+           new_constant((jit_uint) (highest->cell - lowest->cell));
+}
+
+jit_value jit_compiled_func::call(const ir_insn& insn, int flags) {
+    jit_value_t args[MAX_FUNCTION_ARGS];
+    for (size_t i = 0; i < insn.in.size(); i++) {
+        args[i] = read(insn.in[i]).raw();
+    }
+    return insn_call("pvm function", runtime_outer->code[insn.arg], nullptr, args, insn.in.size(), flags);
+}
+
+void jit_compiled_func::leave(const ir_exit& exit) {
+    spill(exit.spills);
+    switch (exit.kind) {
+        case EXIT_TO_INTERPRETER: {
+            for (size_t i = 0; i < exit.stack.size(); i++) {
+                insn_store_elem(stack, new_constant((int) i), read(exit.stack[i]));
+            }
+            insn_store_elem(stack_size_ptr, new_constant(0), new_constant((int) exit.stack.size()));
+            insn_return(new_constant(exit.ip));
+            break;
+        }
+        case EXIT_STOP: {
+            stop((jit_stop_reason) exit.reason, read(exit.value));
+            break;
+        }
+        case EXIT_STOPPED: {
+            if (is_function) {
+                return_stopped();
+            } else {
+                // jit_run() doesn't continue in the interpreter
+                insn_return(new_constant(exit.ip));
+            }
+            break;
+        }
+    }
+}
+
+void jit_compiled_func::bulk_memory(const ir_insn& insn) {
+    auto opcode = insn.arg;
+    if (opcode == OP_NATIVE) {
+        native(insn);
+        return;
+    }
+    auto reports = is_function || opcode == OP_SPAWN || opcode == OP_JOIN || opcode == OP_POP_RES;
+    jit_value_t args[7] = {(reports ? runtime : new_constant((void*) nullptr)).raw(), memory.raw(),
+                           new_constant(program.memory_size).raw()};
+    unsigned nargs = 3;
+    for (auto& value : insn.in) {
+        args[nargs++] = read(value).raw();
+    }
+    if (opcode == OP_SCAN_ZERO || opcode == OP_SCAN_NONZERO) {
+        args[nargs++] = new_constant(opcode == OP_SCAN_ZERO).raw();
+    }
+    jit_type_t params[7] = {jit_type_void_ptr, jit_type_void_ptr};
+    for (unsigned i = 2; i < nargs; i++) {
+        params[i] = jit_type_int;
+    }
+    auto signature = jit_type_create_signature(jit_abi_cdecl, jit_type_long, params, nargs, 1);
+    void* helper;
+    switch (opcode) {
+        case OP_FILL:
+            helper = (void*) &jit_fill;
+            break;
+        case OP_COPY:
+            helper = (void*) &jit_copy;
+            break;
+        case OP_ATOMIC_ADD:
+            helper = (void*) &jit_atomic_add;
+            break;
+        case OP_CAS:
+            helper = (void*) &jit_cas;
+            break;
+        case OP_SPAWN:
+            helper = (void*) &jit_spawn;
+            break;
+        case OP_JOIN:
+            helper = (void*) &jit_join;
+            break;
+        case OP_POP_RES:
+            helper = (void*) &jit_pop_res;
+            break;
+        default:
+            helper = (void*) &jit_scan;
+            break;
+    }
+    auto result = insn_call_native(opcode_mnemonics[opcode].name, helper, signature, args, nargs, 0);
+    insn_branch_if(result == new_constant((jit_long) numeric_limits<int64_t>::min()), exit_label(insn.exit));
+    if (insn.dst >= 0) {
+        write(insn.dst, insn_convert(result, jit_type_int));
+    }
+}
+
+void jit_compiled_func::native(const ir_insn& insn) {
+    auto index = insn.in[0].constant;
+    if (!natives_outer || index < 0 || index >= (int) natives_outer->size()) {
+        if (is_function) {
+            stop(STOP_BAD_NATIVE, new_constant(index));
+        } else {
+            insn_branch(exit_label(insn.exit));
+        }
+        write(insn.dst, new_constant(0));
+        return;
+    }
+    auto& native = (*natives_outer)[index];
+    jit_value_t args[] = {new_constant(native.data).raw(), read(insn.in[1]).raw()};
+    write(insn.dst, insn_call_native(native.name.c_str(), (void*) native.function,
+                                     signature_helper(jit_type_int, jit_type_void_ptr, jit_type_int, end_params),
+                                     args, 2, 0));
+}
+
+void jit_compiled_func::stop(jit_stop_reason reason, const jit_value& value) {
+    jit_value_t args[] = {runtime.raw(), new_constant((int) reason).raw(), value.raw()};
+    insn_call_native("stop_program", (void*) &stop_program,
+                     signature_helper(jit_type_void, jit_type_void_ptr, jit_type_int, jit_type_int, end_params),
+                     args, 3, 0);
+    return_stopped();
+}
+
+void jit_compiled_func::return_stopped() {
+    if (is_void) {
+        insn_return();
+    } else {
+        insn_return(new_constant(0));
+    }
+}
+
+jit_type_t jit_compiled_func::create_signature() {
+    auto ret_type = (is_void ? jit_type_void : jit_type_int);
+    jit_type_t params[num_args];
+    for (int i = 0; i < num_args; i++) {
+        params[i] = jit_type_int;
+    }
+    return jit_type_create_signature(jit_abi_cdecl, ret_type, params, num_args, 1);
+}
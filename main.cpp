@@ -0,0 +1,335 @@
+#include <sstream>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include "vm.h"
+
+using namespace std;
+
+// Calls job(thread, job) for every job in [0, jobs_count) on threads_count threads. Each thread
+// starts with a queue of consecutive jobs, takes them from its front and, once it is empty, steals
+// from the back of the other queues
+template<typename Job>
+void run_work_stealing(size_t jobs_count, unsigned threads_count, Job job) {
+    struct job_queue {
+        mutex lock;
+        deque<size_t> jobs;
+    };
+    vector<job_queue> queues(threads_count);
+    for (size_t i = 0; i < jobs_count; i++) {
+        queues[i * threads_count / jobs_count].jobs.push_back(i);
+    }
+    auto take = [&](unsigned queue, bool front, size_t& next) {
+        lock_guard<mutex> guard(queues[queue].lock);
+        auto& jobs = queues[queue].jobs;
+        if (jobs.empty()) {
+            return false;
+        }
+        next = front ? jobs.front() : jobs.back();
+        front ? jobs.pop_front() : jobs.pop_back();
+        return true;
+    };
+    vector<thread> threads;
+    for (unsigned t = 0; t < threads_count; t++) {
+        threads.emplace_back([&, t] {
+            size_t next;
+            while (true) {
+                bool found = take(t, true, next);
+                for (unsigned i = 1; !found && i < threads_count; i++) {
+                    found = take((t + i) % threads_count, false, next);
+                }
+                // no jobs are added later, so every queue stays empty
+                if (!found) {
+                    return;
+                }
+                job(t, next);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+// Runs every program repeat times on threads_count threads. Each thread has one VM on the heap
+// that it reuses, and compiled code with it as long as the thread stays on the same program.
+// Output is collected per run and written out in order at the end, followed by the throughput
+void run_batch(vector<program_file>& files, unsigned repeat, unsigned threads_count, run_mode mode,
+               unsigned hot_loop_threshold, const ir_options& jit_options, bool perf_map, bool binary_output) {
+    size_t jobs_count = files.size() * repeat;
+    threads_count = (unsigned) min<size_t>(threads_count, jobs_count);
+    vector<string> outputs(jobs_count), errors(jobs_count);
+    vector<unique_ptr<VM>> vms(threads_count);
+    vector<const program_file*> loaded(threads_count);
+    auto start = chrono::steady_clock::now();
+    run_work_stealing(jobs_count, threads_count, [&](unsigned t, size_t job) {
+        auto& file = files[job / repeat];
+        auto& vm = vms[t];
+        if (!vm) {
+            vm = make_unique<VM>();
+            vm->set_hot_loop_threshold(hot_loop_threshold);
+            vm->set_jit_options(jit_options);
+            vm->get_output().set_binary(binary_output);
+        }
+        if (loaded[t] == &file) {
+            vm->reset();
+        } else {
+            string error;
+            if (!vm->load(file.program, error)) {
+                errors[job] = error + "\n";
+                loaded[t] = nullptr;
+                return;
+            }
+            if (perf_map) {
+                vm->set_perf_map(file.path, file.have_map ? &file.map : nullptr);
+            }
+            vm->add_hot_loops(file.plan.hot_loops);
+            loaded[t] = &file;
+        }
+        ostringstream out, err;
+        vm->set_output(out, err);
+        run_vm(*vm, mode);
+        // the streams go away with this job
+        vm->get_output().close();
+        outputs[job] = out.str();
+        errors[job] = err.str();
+    });
+    auto seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (size_t job = 0; job < jobs_count; job++) {
+        cout << outputs[job];
+        cerr << errors[job];
+    }
+    cout.flush();
+    cerr << "batch: " << jobs_count << " runs of " << files.size() << " programs on " << threads_count
+         << " threads in " << seconds << " s, " << jobs_count / seconds << " runs/s\n";
+}
+
+// runs of run_scheduled() that have a VM at the same time: every VM holds a memfd and reserves address
+// space for its memory, so there can't be one for each of thousands of runs
+const size_t MAX_SCHEDULED_VMS = 256;
+
+// Runs every program repeat times as green threads of a vm_scheduler on threads_count threads, each run
+// on a VM that gets fuel units at a time. A VM whose run ended goes on with the next run that didn't
+// start yet, or goes away with its memory once there is none. Output is written out in order at the
+// end, like for run_batch()
+void run_scheduled(vector<program_file>& files, unsigned repeat, unsigned threads_count, int64_t fuel,
+                   unsigned hot_loop_threshold, const ir_options& jit_options, bool perf_map, bool binary_output) {
+    size_t jobs_count = files.size() * repeat;
+    vector<ostringstream> outputs(jobs_count), errors(jobs_count);
+    // a VM with the program it loaded last
+    struct scheduled_run {
+        unique_ptr<VM> vm;
+        const program_file* loaded = nullptr;
+    };
+    map<VM*, scheduled_run> runs;
+    mutex lock;
+    size_t next_job = 0;
+    // Makes run the next one that has memory, on a new VM if it has none yet; false if there is none
+    // left. With lock held
+    auto start_next = [&](scheduled_run& run) {
+        while (next_job < jobs_count) {
+            auto job = next_job++;
+            auto& file = files[job / repeat];
+            if (!run.vm) {
+                run.vm = make_unique<VM>();
+                run.vm->set_hot_loop_threshold(hot_loop_threshold);
+                run.vm->set_jit_options(jit_options);
+                run.vm->get_output().set_binary(binary_output);
+            }
+            if (run.loaded == &file) {
+                run.vm->reset();
+            } else {
+                string error;
+                if (!run.vm->load(file.program, error)) {
+                    errors[job] << error << "\n";
+                    run.loaded = nullptr;
+                    continue;
+                }
+                if (perf_map) {
+                    run.vm->set_perf_map(file.path, file.have_map ? &file.map : nullptr);
+                }
+                run.vm->add_hot_loops(file.plan.hot_loops);
+                run.loaded = &file;
+            }
+            run.vm->set_output(outputs[job], errors[job]);
+            return true;
+        }
+        return false;
+    };
+    auto start = chrono::steady_clock::now();
+    uint64_t slices;
+    {
+        vm_scheduler scheduler(threads_count, fuel, [&](VM& vm) -> VM* {
+            lock_guard<mutex> guard(lock);
+            // the streams go away with this run
+            vm.get_output().close();
+            auto it = runs.find(&vm);
+            if (!start_next(it->second)) {
+                runs.erase(it);
+                return nullptr;
+            }
+            return &vm;
+        });
+        {
+            lock_guard<mutex> guard(lock);
+            while (runs.size() < MAX_SCHEDULED_VMS) {
+                scheduled_run run;
+                if (!start_next(run)) {
+                    break;
+                }
+                auto& vm = *run.vm;
+                runs.emplace(&vm, std::move(run));
+                scheduler.add(vm);
+            }
+        }
+        scheduler.wait();
+        slices = scheduler.slices();
+    }
+    auto seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    for (size_t job = 0; job < jobs_count; job++) {
+        cout << outputs[job].str();
+        cerr << errors[job].str();
+    }
+    cout.flush();
+    cerr << "scheduled: " << jobs_count << " runs of " << files.size() << " programs on " << threads_count
+         << " threads in " << slices << " slices of " << fuel << " fuel, " << seconds << " s\n";
+}
+
+int main(int argc, char** argv) {
+    program_options options;
+    bool batch = false, usage_error = false, profile = false, profile_cycles = false, perf_map = false;
+    bool binary_output = false, dump_ir = false;
+    ir_options jit_options;
+    // PRINT output goes to stdout unless there is an output file
+    const char* output_path = nullptr;
+    run_mode mode = RUN_INTERPRETER;
+    unsigned hot_loop_threshold = DEFAULT_HOT_LOOP_THRESHOLD;
+    unsigned threads_count = max(1u, thread::hardware_concurrency()), repeat = 1;
+    // 0 runs unmetered
+    int64_t fuel = 0;
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+        if (strcmp(argv[arg], "--jit") == 0) {
+            mode = RUN_JIT;
+        } else if (strcmp(argv[arg], "--threaded") == 0) {
+            mode = RUN_THREADED;
+        } else if (strcmp(argv[arg], "--registers") == 0) {
+            mode = RUN_REGISTERS;
+        } else if (strcmp(argv[arg], "--no-fuse") == 0) {
+            options.fuse = false;
+        } else if (strcmp(argv[arg], "--no-jit-cache") == 0) {
+            options.use_cache = false;
+        } else if (strcmp(argv[arg], "--hot-loop-threshold") == 0 && arg + 1 < argc) {
+            hot_loop_threshold = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "--no-loop-opt") == 0) {
+            jit_options.loops = false;
+        } else if (strcmp(argv[arg], "--dump-ir") == 0) {
+            dump_ir = true;
+        } else if (strcmp(argv[arg], "--memory-size") == 0 && arg + 1 < argc) {
+            if (!parse_size(argv[++arg], MAX_MEMORY_SIZE, options.memory_size)) {
+                usage_error = true;
+                break;
+            }
+        } else if (strcmp(argv[arg], "--stack-size") == 0 && arg + 1 < argc) {
+            if (!parse_size(argv[++arg], MAX_STACK_SIZE, options.stack_size)) {
+                usage_error = true;
+                break;
+            }
+        } else if (strcmp(argv[arg], "--profile") == 0) {
+            profile = true;
+        } else if (strcmp(argv[arg], "--profile-cycles") == 0) {
+            profile = profile_cycles = true;
+        } else if (strcmp(argv[arg], "--perf-map") == 0) {
+            perf_map = true;
+        } else if (strcmp(argv[arg], "--output") == 0 && arg + 1 < argc) {
+            output_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--binary-output") == 0) {
+            binary_output = true;
+        } else if (strcmp(argv[arg], "--batch") == 0) {
+            batch = true;
+        } else if (strcmp(argv[arg], "--jobs") == 0 && arg + 1 < argc) {
+            threads_count = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "--repeat") == 0 && arg + 1 < argc) {
+            repeat = atoi(argv[++arg]);
+        } else if (strcmp(argv[arg], "--fuel") == 0 && arg + 1 < argc) {
+            fuel = atoll(argv[++arg]);
+        } else {
+            usage_error = true;
+            break;
+        }
+    }
+    int files_count = argc - arg;
+    if (usage_error || files_count == 0 || (!batch && files_count != 1) || (batch && (profile || output_path || dump_ir)) ||
+        threads_count == 0 || repeat == 0 || fuel < 0 || (fuel && (mode != RUN_INTERPRETER || profile))) {
+        cerr << "usage ./vm [--jit | --threaded | --registers] [--no-fuse] [--no-jit-cache] [--hot-loop-threshold N]\n"
+                "         [--no-loop-opt] [--dump-ir]\n"
+                "         [--memory-size CELLS] [--stack-size ENTRIES] [--profile | --profile-cycles] [--perf-map]\n"
+                "         [--output FILE] [--binary-output] [--fuel UNITS] program.pvm\n"
+                "      ./vm --batch [--jobs N] [--repeat N] [options] program.pvm...\n"
+                "--fuel runs in slices of UNITS backward jumps and calls, and the runs of --batch as green threads\n"
+                "on the --jobs threads; only the interpreter and its hot loops are metered\n";
+        return 1;
+    }
+    if (!batch) {
+        program_file file;
+        if (!open_program(argv[arg], options, file)) {
+            return 1;
+        }
+        auto vm = make_unique<VM>();
+        string error;
+        if (!vm->load(file.program, error)) {
+            cerr << error << "\n";
+            return 1;
+        }
+        vm->set_hot_loop_threshold(hot_loop_threshold);
+        // the IR of everything the JIT compiles or translates for --registers goes to stderr
+        vm->set_jit_options(jit_options, dump_ir ? &cerr : nullptr);
+        if (!output_path) {
+            vm->get_output().to_fd(STDOUT_FILENO);
+        } else if (!vm->get_output().to_file(output_path, error)) {
+            cerr << error << "\n";
+            return 1;
+        }
+        vm->get_output().set_binary(binary_output);
+        if (perf_map) {
+            vm->set_perf_map(file.path, file.have_map ? &file.map : nullptr);
+        }
+        vm->add_hot_loops(file.plan.hot_loops);
+        if (profile) {
+            // the interpreter does the counting, whatever engine was asked for
+            auto result = vm->run_profiled(profile_cycles);
+            write_profile(cerr, file.program, result, file.have_map ? &file.map : nullptr);
+            return close_program(file) ? 0 : 1;
+        }
+        if (fuel) {
+            vm->set_fuel(fuel);
+            vm->run();
+            while (vm->is_suspended()) {
+                vm->set_fuel(fuel);
+                vm->resume();
+            }
+        } else {
+            run_vm(*vm, mode);
+        }
+        update_jit_plan(file, *vm);
+        return close_program(file) ? 0 : 1;
+    }
+    // plans are read but not written in batch mode: the VMs move between programs
+    vector<program_file> files(files_count);
+    for (int i = 0; i < files_count; i++) {
+        if (!open_program(argv[arg + i], options, files[i])) {
+            return 1;
+        }
+    }
+    if (fuel) {
+        run_scheduled(files, repeat, threads_count, fuel, hot_loop_threshold, jit_options, perf_map, binary_output);
+    } else {
+        run_batch(files, repeat, threads_count, mode, hot_loop_threshold, jit_options, perf_map, binary_output);
+    }
+    for (auto& file : files) {
+        if (!close_program(file)) {
+            return 1;
+        }
+    }
+}
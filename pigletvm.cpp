@@ -0,0 +1,59 @@
+#include "pigletvm.h"
+#include "vm.h"
+
+using namespace std;
+
+struct piglet_vm::impl {
+    // what vm runs, program.code points into it
+    program_buffer buffer;
+    VM vm;
+    bool loaded = false;
+};
+
+piglet_vm::piglet_vm() : state(new impl) {}
+
+piglet_vm::~piglet_vm() = default;
+
+bool piglet_vm::load_program(const void* data, size_t size, string& error) {
+    state->loaded = false;
+    program_buffer buffer;
+    if (!::load_program(data, size, {}, buffer, error) || !state->vm.load(buffer.program, error)) {
+        return false;
+    }
+    // moving keeps the code where it is
+    state->buffer = std::move(buffer);
+    state->loaded = true;
+    return true;
+}
+
+bool piglet_vm::bind_memory(int* cells, int size, string& error) {
+    if (!state->loaded) {
+        error = "no program loaded";
+        return false;
+    }
+    return state->vm.bind_memory(cells, size, error);
+}
+
+int piglet_vm::add_native(const string& name, vm_native_function function, void* data) {
+    return state->vm.add_native(name, function, data);
+}
+
+void piglet_vm::set_output(ostream& output, ostream& errors) {
+    state->vm.set_output(output, errors);
+}
+
+bool piglet_vm::run(run_mode mode) {
+    if (!state->loaded) {
+        return false;
+    }
+    run_vm(state->vm, mode);
+    return true;
+}
+
+void piglet_vm::reset() {
+    state->vm.reset();
+}
+
+const vector<int>& piglet_vm::get_results() const {
+    return state->vm.get_results();
+}
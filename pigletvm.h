@@ -0,0 +1,76 @@
+#ifndef PIGLETVM_H
+#define PIGLETVM_H
+
+#include <cstddef>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+// The API of the pigletvm library for programs that embed the VM. Everything else, vm.h and the
+// headers it includes, is the VM's own and only used by the tools built with it
+
+// A host function for NATIVE: gets data and the value on top of the stack, its result replaces it.
+// It runs on the thread of the VM, or of a worker, and may read and write VM memory
+typedef int (*vm_native_function)(void* data, int value);
+
+// the engines: the switch interpreter, which compiles hot loops and functions, the threaded
+// interpreter, the whole program compiled up front, and the register code
+enum run_mode {
+    RUN_INTERPRETER,
+    RUN_THREADED,
+    RUN_JIT,
+    RUN_REGISTERS,
+};
+
+// Whether VM memory made from now on gets guard pages, on by default where there are any. While there
+// is such memory SIGSEGV is taken over and the faults outside of it go on to the action the host had.
+// The memory that VMs already have keeps what it has; the next load_program() makes it anew
+void set_guard_pages(bool on);
+bool guard_pages_enabled();
+
+// A VM that runs one program at a time, as often as the host likes, with what it compiled kept
+// between runs. Errors in the program end the run and go to the error stream, see set_output()
+class piglet_vm {
+public:
+    // runs nothing until a load_program() that succeeds
+    piglet_vm();
+
+    piglet_vm(const piglet_vm&) = delete;
+    piglet_vm& operator=(const piglet_vm&) = delete;
+
+    ~piglet_vm();
+
+    // Loads size bytes of a .pvm file at data, which the caller may free afterwards, with zeroed
+    // memory and an empty stack of the sizes the file asks for. What is wrong with the program, or
+    // that the system has no memory for it, goes to error; the VM then has no program
+    bool load_program(const void* data, size_t size, std::string& error);
+
+    // Runs the program on size cells that the caller owns, without copying them, until the next
+    // load_program(). The caller keeps them alive as long as the VM runs on them. Every access is
+    // checked, and a program that uses constant addresses past size can't run on them
+    bool bind_memory(int* cells, int size, std::string& error);
+
+    // Makes function what NATIVE calls with the next index, counting from 0, and returns that index.
+    // data goes to every call. The functions stay for the programs loaded later
+    int add_native(const std::string& name, vm_native_function function, void* data = nullptr);
+
+    // where PRINT and DONE write to and where errors are reported, std::cout and std::cerr by default
+    void set_output(std::ostream& output, std::ostream& errors);
+
+    // Runs the program from its entry; false if there is none. Memory and stack stay as the run left
+    // them, see reset()
+    bool run(run_mode mode = RUN_INTERPRETER);
+
+    // zeroes the VM's own memory and empties the stack for the next run; bound memory is the caller's
+    void reset();
+
+    // what POP_RES popped during the last run, in order
+    const std::vector<int>& get_results() const;
+
+private:
+    struct impl;
+    std::unique_ptr<impl> state;
+};
+
+#endif //PIGLETVM_H
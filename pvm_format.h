@@ -0,0 +1,177 @@
+#ifndef PVM_FORMAT_H
+#define PVM_FORMAT_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+
+// Version 2 of the .pvm format, written by asm.cpp and read by vm.cpp.
+//
+// A file starts with pvm_header, followed by code_size bytes of code. Every instruction is a one
+// byte opcode followed by its arguments, each a 4 byte little endian int, without any alignment.
+// Jump arguments and the entry point are byte offsets into the code. There are no label marks.
+//
+// A function starts with ENTER args and runs up to the next ENTER or the end of the code; the code
+// before the first function is the main program. CALL pushes a return address and jumps to an ENTER,
+// which makes the top args stack entries the first slots of the function's frame. LOADL and STOREL
+// read and write frame slots, RET results moves the top results entries to the start of the frame,
+// drops the rest of it and returns.
+//
+// SPAWN target pops a value and starts a worker at target, in the main program, with that value as the
+// only entry of a stack of its own, and pushes the worker's id. JOIN pops an id, waits for that worker
+// to end and pushes the top of its stack at its DONE, or 0 if it was empty. Workers run on other threads
+// and share memory with the program: ATOMIC_ADD (addr value) and CAS (addr expected desired) change a cell
+// atomically and push what it held before. Plain LOADs and STOREs aren't synchronised, a value that
+// another worker writes has to be read with an atomic or after JOINing it.
+//
+// NATIVE index pops a value, calls host function index of the VM with it and pushes what it returns.
+// The host registers its functions with VM::add_native(), a program refers to them by number. POP_RES
+// pops a value into the results of the run, which the host reads with VM::get_results().
+//
+// Files that don't start with PVM_MAGIC are in the legacy format: a plain array of ints where
+// opcodes, arguments and the 0xcafe 0xbabe label marks take one int each.
+
+const uint32_t PVM_MAGIC = 0x324d5650; // "PVM2"
+const uint32_t PVM_VERSION = 2;
+
+// opcodes as they are stored in both formats
+enum pvm_opcode {
+    OP_PUSHI,
+    OP_LOADI,
+    OP_LOADADDI,
+    OP_STOREI,
+    OP_LOAD,
+    OP_STORE,
+    OP_DUP,
+    OP_DISCARD,
+    OP_ADD,
+    OP_ADDI,
+    OP_SUB,
+    OP_DIV,
+    OP_MUL,
+    OP_JUMP,
+    OP_JUMP_IF_TRUE,
+    OP_JUMP_IF_FALSE,
+    OP_EQUAL,
+    OP_LESS,
+    OP_LESS_OR_EQUAL,
+    OP_GREATER,
+    OP_GREATER_OR_EQUAL,
+    OP_GREATER_OR_EQUALI,
+    OP_POP_RES,
+    OP_DONE,
+    OP_PRINT,
+    OP_ABORT,
+    // functions: CALL target, RET results, ENTER args, LOADL slot, STOREL slot
+    OP_CALL,
+    OP_RET,
+    OP_ENTER,
+    OP_LOADL,
+    OP_STOREL,
+    // bulk memory, see bulk_memory.h: FILL, COPY, SCAN_ZERO, SCAN_NONZERO
+    OP_FILL,
+    OP_COPY,
+    OP_SCAN_ZERO,
+    OP_SCAN_NONZERO,
+    // workers: SPAWN target, JOIN, ATOMIC_ADD, CAS
+    OP_SPAWN,
+    OP_JOIN,
+    OP_ATOMIC_ADD,
+    OP_CAS,
+    // host functions: NATIVE index
+    OP_NATIVE,
+    PVM_OPCODES_COUNT
+};
+
+// how the argument of an instruction is written in the source
+enum argument_kind {
+    NO_ARGUMENT,
+    INT_ARGUMENT,
+    LABEL_ARGUMENT,
+    // written like a number, taken from the .func the instruction is in
+    FUNCTION_ARGUMENT
+};
+
+struct mnemonic {
+    const char* name;
+    argument_kind argument;
+};
+
+// mnemonics as asm.cpp reads them and the VM prints them, indexed by opcode
+inline const mnemonic opcode_mnemonics[PVM_OPCODES_COUNT] = {
+        {"PUSHI", INT_ARGUMENT},
+        {"LOADI", INT_ARGUMENT},
+        {"LOADADDI", INT_ARGUMENT},
+        {"STOREI", INT_ARGUMENT},
+        {"LOAD", NO_ARGUMENT},
+        {"STORE", NO_ARGUMENT},
+        {"DUP", NO_ARGUMENT},
+        {"DISCARD", NO_ARGUMENT},
+        {"ADD", NO_ARGUMENT},
+        {"ADDI", INT_ARGUMENT},
+        {"SUB", NO_ARGUMENT},
+        {"DIV", NO_ARGUMENT},
+        {"MUL", NO_ARGUMENT},
+        {"JUMP", LABEL_ARGUMENT},
+        {"JUMP_IF_TRUE", LABEL_ARGUMENT},
+        {"JUMP_IF_FALSE", LABEL_ARGUMENT},
+        {"EQUAL", NO_ARGUMENT},
+        {"LESS", NO_ARGUMENT},
+        {"LESS_OR_EQUAL", NO_ARGUMENT},
+        {"GREATER", NO_ARGUMENT},
+        {"GREATER_OR_EQUAL", NO_ARGUMENT},
+        {"GREATER_OR_EQUALI", INT_ARGUMENT},
+        {"PRES", NO_ARGUMENT},
+        {"DONE", NO_ARGUMENT},
+        {"PRINT", NO_ARGUMENT},
+        {"ABORT", NO_ARGUMENT},
+        {"CALL", LABEL_ARGUMENT},
+        {"RET", FUNCTION_ARGUMENT},
+        {"ENTER", FUNCTION_ARGUMENT},
+        {"LOADL", INT_ARGUMENT},
+        {"STOREL", INT_ARGUMENT},
+        {"FILL", NO_ARGUMENT},
+        {"COPY", NO_ARGUMENT},
+        {"SCAN_ZERO", NO_ARGUMENT},
+        {"SCAN_NONZERO", NO_ARGUMENT},
+        {"SPAWN", LABEL_ARGUMENT},
+        {"JOIN", NO_ARGUMENT},
+        {"ATOMIC_ADD", NO_ARGUMENT},
+        {"CAS", NO_ARGUMENT},
+        {"NATIVE", INT_ARGUMENT}
+};
+
+// Compiled functions take their arguments as native ones and return at most one value
+const int MAX_FUNCTION_ARGS = 16, MAX_FUNCTION_RESULTS = 1;
+
+// the most memory cells and stack entries that a program can ask for
+const int MAX_STACK_SIZE = 1 << 24, MAX_MEMORY_SIZE = 1 << 30;
+
+// parses a --memory-size or --stack-size argument, a decimal number from 1 up to max
+inline bool parse_size(const char* text, int max, uint32_t& size) {
+    if (*text < '0' || *text > '9') {
+        return false;
+    }
+    char* end;
+    errno = 0;
+    unsigned long value = strtoul(text, &end, 10);
+    if (*end || errno == ERANGE || value == 0 || value > (unsigned long) max) {
+        return false;
+    }
+    size = (uint32_t) value;
+    return true;
+}
+
+struct pvm_header {
+    uint32_t magic;
+    uint32_t version;
+    // bytes of code after the header
+    uint32_t code_size;
+    // memory cells and stack entries the program needs, 0 for the VM defaults
+    uint32_t memory_size;
+    uint32_t stack_size;
+    // offset of the first instruction to run
+    uint32_t entry;
+};
+
+#endif //PVM_FORMAT_H
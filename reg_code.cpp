@@ -0,0 +1,310 @@
+#include <algorithm>
+#include <map>
+#include <set>
+#include <sstream>
+#include "reg_code.h"
+#include "vm.h"
+
+using namespace std;
+
+// Lays out the blocks of an IR function in ir_block_order() and translates their instructions
+struct reg_builder {
+    const ir_function& ir;
+    reg_function function;
+    // constant -> its register
+    map<int, int> constants;
+    vector<int> defs, reads;
+    // pc of the first instruction of every block, and the jumps whose target is a block for now
+    vector<int> block_pcs;
+    vector<int> fixups;
+
+    explicit reg_builder(const ir_function& ir)
+            : ir(ir), defs(ir_def_counts(ir)), reads(ir_read_counts(ir)), block_pcs(ir.blocks.size(), -1) {}
+
+    int reg(ir_value value) {
+        if (!value.is_constant()) {
+            return value.reg;
+        }
+        auto constant = constants.find(value.constant);
+        if (constant == constants.end()) {
+            constant = constants.emplace(value.constant, ir.regs + (int) constants.size()).first;
+        }
+        return constant->second;
+    }
+
+    reg_insn& emit(reg_opcode opcode, int dst = -1, int a = -1, int b = -1, int target = -1) {
+        function.code.push_back({opcode, dst, a, b, target});
+        return function.code.back();
+    }
+
+    void jump(reg_opcode opcode, int block, int a = -1, int b = -1) {
+        fixups.push_back((int) function.code.size());
+        emit(opcode, -1, a, b, block);
+    }
+
+    int operands(const vector<ir_value>& in) {
+        auto offset = (int) function.operands.size();
+        function.operands.push_back((int) in.size());
+        for (auto& value : in) {
+            function.operands.push_back(reg(value));
+        }
+        return offset;
+    }
+
+    int aliases(const vector<ir_cell>& cells) {
+        auto [lowest, highest] = minmax_element(cells.begin(), cells.end(), [](ir_cell a, ir_cell b) {
+            return a.cell < b.cell;
+        });
+        function.aliases.push_back({cells, lowest->cell, highest->cell});
+        return (int) function.aliases.size() - 1;
+    }
+
+    reg_function build() {
+        function.regs = ir.regs;
+        function.inputs = ir.inputs;
+        for (auto& exit : ir.exits) {
+            vector<int> stack;
+            for (auto& value : exit.stack) {
+                stack.push_back(reg(value));
+            }
+            auto value = exit.kind == EXIT_STOP ? reg(exit.value) : -1;
+            function.exits.push_back({exit.kind, exit.ip, exit.reason, value, std::move(stack), exit.spills});
+        }
+        auto order = ir_block_order(ir);
+        for (size_t i = 0; i < order.size(); i++) {
+            block_pcs[order[i]] = (int) function.code.size();
+            auto next = i + 1 < order.size() ? order[i + 1] : -1;
+            auto& insns = ir.blocks[order[i]].insns;
+            auto compare = fused_compare(insns);
+            for (size_t j = 0; j + 1 < insns.size(); j++) {
+                if ((int) j == compare) {
+                    continue;
+                }
+                if (j + 2 < insns.size() && moves_result(insns[j], insns[j + 1])) {
+                    // the result goes where the copy of it would go
+                    auto insn = insns[j];
+                    insn.dst = insns[j + 1].dst;
+                    translate(insn, next);
+                    j++;
+                    continue;
+                }
+                translate(insns[j], next);
+            }
+            if (compare >= 0) {
+                branch(insns.back(), next, &insns[compare]);
+            } else {
+                translate(insns.back(), next);
+            }
+        }
+        for (auto pc : fixups) {
+            function.code[pc].target = block_pcs[function.code[pc].target];
+        }
+        function.frame.assign(ir.regs + constants.size(), 0);
+        for (auto [constant, r] : constants) {
+            function.frame[r] = constant;
+        }
+        return std::move(function);
+    }
+
+    // The comparison whose result only goes to the branch at the end of the block, -1 if there is none.
+    // It moves down to the branch, so nothing after it may change its operands
+    int fused_compare(const vector<ir_insn>& insns) const {
+        auto& branch = insns.back();
+        if (branch.opcode != IR_BRANCH || branch.in[0].is_constant() || reads[branch.in[0].reg] != 1) {
+            return -1;
+        }
+        set<int> written;
+        for (auto j = (int) insns.size() - 2; j >= 0; j--) {
+            auto& insn = insns[j];
+            if (insn.dst == branch.in[0].reg) {
+                auto fuses = insn.opcode >= IR_EQUAL && insn.opcode <= IR_GREATER_OR_EQUAL;
+                for (auto& value : insn.in) {
+                    fuses = fuses && (value.is_constant() || !written.count(value.reg));
+                }
+                return fuses ? j : -1;
+            }
+            written.insert(insn.dst);
+            if (insn.opcode == IR_STORE && insn.exit < 0) {
+                for (auto& alias : insn.aliases) {
+                    written.insert(alias.reg);
+                }
+            }
+        }
+        return -1;
+    }
+
+    // whether insn computes a register that only copy reads, right after it
+    bool moves_result(const ir_insn& insn, const ir_insn& copy) const {
+        return insn.dst >= 0 && copy.opcode == IR_COPY && copy.in[0] == ir_value::of_reg(insn.dst) &&
+               reads[insn.dst] == 1 && defs[insn.dst] == 1;
+    }
+
+    static reg_opcode jump_opcode(ir_opcode compare, bool negate) {
+        switch (compare) {
+            case IR_EQUAL:
+                return negate ? REG_JUMP_IF_NOT_EQUAL : REG_JUMP_IF_EQUAL;
+            case IR_LESS:
+                return negate ? REG_JUMP_IF_GREATER_OR_EQUAL : REG_JUMP_IF_LESS;
+            case IR_LESS_OR_EQUAL:
+                return negate ? REG_JUMP_IF_GREATER : REG_JUMP_IF_LESS_OR_EQUAL;
+            case IR_GREATER:
+                return negate ? REG_JUMP_IF_LESS_OR_EQUAL : REG_JUMP_IF_GREATER;
+            default:
+                return negate ? REG_JUMP_IF_LESS : REG_JUMP_IF_GREATER_OR_EQUAL;
+        }
+    }
+
+    // the branch to insn.arg if the condition holds and to insn.other otherwise, with the condition
+    // computed by compare if there is one. Only one of them is a jump if the other target comes next
+    void branch(const ir_insn& insn, int next, const ir_insn* compare) {
+        auto negate = insn.arg == next;
+        auto target = negate ? insn.other : insn.arg;
+        if (compare) {
+            jump(jump_opcode(compare->opcode, negate), target, reg(compare->in[0]), reg(compare->in[1]));
+        } else {
+            jump(negate ? REG_JUMP_IF_FALSE : REG_JUMP_IF_TRUE, target, reg(insn.in[0]));
+        }
+        if (!negate && insn.other != next) {
+            jump(REG_JUMP, insn.other);
+        }
+    }
+
+    void translate(const ir_insn& insn, int next) {
+        switch (insn.opcode) {
+            case IR_COPY:
+                emit(REG_MOVE, insn.dst, reg(insn.in[0]));
+                break;
+            case IR_ADD:
+            case IR_SUB:
+            case IR_MUL:
+            case IR_DIV:
+            case IR_EQUAL:
+            case IR_LESS:
+            case IR_LESS_OR_EQUAL:
+            case IR_GREATER:
+            case IR_GREATER_OR_EQUAL:
+                emit((reg_opcode) (REG_ADD + (insn.opcode - IR_ADD)), insn.dst, reg(insn.in[0]), reg(insn.in[1]));
+                break;
+            case IR_LOAD:
+                if (insn.aliases.empty()) {
+                    emit(REG_LOAD, insn.dst, reg(insn.in[0]));
+                } else {
+                    emit(REG_LOAD_ALIASED, insn.dst, reg(insn.in[0]), aliases(insn.aliases));
+                }
+                break;
+            case IR_STORE:
+                if (insn.aliases.empty()) {
+                    emit(REG_STORE, -1, reg(insn.in[0]), reg(insn.in[1]));
+                } else {
+                    emit(REG_STORE_ALIASED, aliases(insn.aliases), reg(insn.in[0]), reg(insn.in[1]), insn.exit);
+                }
+                break;
+            case IR_CHECK_ADDRESS:
+                emit(REG_CHECK_ADDRESS, -1, reg(insn.in[0]), -1, insn.exit);
+                break;
+            case IR_CHECK_NONZERO:
+                emit(REG_CHECK_NONZERO, -1, reg(insn.in[0]), -1, insn.exit);
+                break;
+            case IR_CHECK_QUOTIENT:
+                emit(REG_CHECK_QUOTIENT, -1, reg(insn.in[0]), reg(insn.in[1]), insn.exit);
+                break;
+            case IR_PRINT:
+                emit(REG_PRINT, -1, reg(insn.in[0]));
+                break;
+            case IR_BULK:
+                emit(REG_BULK, insn.dst, operands(insn.in), insn.arg, insn.exit);
+                break;
+            case IR_CALL:
+                emit(REG_CALL, insn.dst, operands(insn.in), insn.arg, insn.exit);
+                break;
+            case IR_FUEL:
+                // register code isn't metered, translate_registers() asks for none
+                break;
+            case IR_JUMP:
+                if (insn.arg != next) {
+                    jump(REG_JUMP, insn.arg);
+                }
+                break;
+            case IR_BRANCH:
+                branch(insn, next, nullptr);
+                break;
+            case IR_EXIT:
+                emit(REG_EXIT, -1, -1, -1, insn.exit);
+                break;
+            case IR_RETURN:
+                emit(REG_RETURN, -1, insn.in.empty() ? -1 : reg(insn.in[0]));
+                break;
+            case IR_TAIL_CALL:
+                emit(REG_TAIL_CALL, -1, operands(insn.in), insn.arg);
+                break;
+        }
+    }
+};
+
+reg_function build_reg_code(const ir_function& function) {
+    return reg_builder(function).build();
+}
+
+static const char* const reg_opcode_names[] = {
+        "MOVE", "ADD", "SUB", "MUL", "DIV", "EQUAL", "LESS", "LESS_OR_EQUAL", "GREATER", "GREATER_OR_EQUAL",
+        "LOAD", "STORE", "LOAD_ALIASED", "STORE_ALIASED", "CHECK_ADDRESS", "CHECK_NONZERO", "CHECK_QUOTIENT",
+        "PRINT", "BULK", "CALL", "JUMP", "JUMP_IF_TRUE", "JUMP_IF_FALSE", "JUMP_IF_EQUAL", "JUMP_IF_NOT_EQUAL", "JUMP_IF_LESS",
+        "JUMP_IF_LESS_OR_EQUAL", "JUMP_IF_GREATER", "JUMP_IF_GREATER_OR_EQUAL", "EXIT", "RETURN", "TAIL_CALL"
+};
+
+string dump_reg_code(const reg_function& function) {
+    ostringstream out;
+    out << "constants";
+    for (auto r = function.regs; r < (int) function.frame.size(); r++) {
+        out << " r" << r << '=' << function.frame[r];
+    }
+    out << '\n';
+    for (size_t pc = 0; pc < function.code.size(); pc++) {
+        auto& insn = function.code[pc];
+        out << "    " << pc << ": ";
+        if (insn.dst >= 0 && insn.opcode != REG_STORE_ALIASED) {
+            out << 'r' << insn.dst << " = ";
+        }
+        out << reg_opcode_names[insn.opcode];
+        switch (insn.opcode) {
+            case REG_BULK:
+            case REG_CALL:
+            case REG_TAIL_CALL: {
+                if (insn.opcode == REG_BULK) {
+                    out << ' ' << opcode_mnemonics[insn.b].name;
+                } else {
+                    out << " f" << insn.b;
+                }
+                for (int i = 1; i <= function.operands[insn.a]; i++) {
+                    out << (i > 1 ? ", r" : " r") << function.operands[insn.a + i];
+                }
+                break;
+            }
+            case REG_LOAD_ALIASED:
+            case REG_STORE_ALIASED: {
+                out << " r" << insn.a;
+                if (insn.opcode == REG_STORE_ALIASED) {
+                    out << ", r" << insn.b;
+                }
+                auto& aliases = function.aliases[insn.opcode == REG_LOAD_ALIASED ? insn.b : insn.dst];
+                out << " aliases " << aliases.lowest << ".." << aliases.highest;
+                break;
+            }
+            default: {
+                if (insn.a >= 0) {
+                    out << " r" << insn.a;
+                }
+                if (insn.b >= 0) {
+                    out << ", r" << insn.b;
+                }
+                break;
+            }
+        }
+        if (insn.target >= 0) {
+            out << (insn.opcode >= REG_JUMP && insn.opcode <= REG_JUMP_IF_GREATER_OR_EQUAL ? " to " : " exit ")
+                << insn.target;
+        }
+        out << '\n';
+    }
+    return out.str();
+}
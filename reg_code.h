@@ -0,0 +1,109 @@
+#ifndef REG_CODE_H
+#define REG_CODE_H
+
+#include <cstdint>
+#include <vector>
+#include "jit_ir.h"
+
+// Code for the register interpreter, VM::run_registers(). It is the IR of jit_ir.h after optimize_ir(),
+// laid out flat: one instruction per IR instruction, with operands that are indexes into a frame of
+// registers instead of entries of VM::stack. Constants get registers of their own at the end of the
+// frame, so that every operand is read the same way, and a comparison that only feeds the branch after
+// it becomes part of the branch. Jumps to the next block are dropped.
+//
+// A frame is the IR registers followed by the constants; every call copies frame, the template with
+// the constants in place, and puts the arguments into inputs.
+
+enum reg_opcode : uint8_t {
+    // dst = a
+    REG_MOVE,
+    // dst = a op b
+    REG_ADD,
+    REG_SUB,
+    REG_MUL,
+    REG_DIV,
+    REG_EQUAL,
+    REG_LESS,
+    REG_LESS_OR_EQUAL,
+    REG_GREATER,
+    REG_GREATER_OR_EQUAL,
+    // dst = memory[a]
+    REG_LOAD,
+    // memory[a] = b
+    REG_STORE,
+    // LOAD and STORE with the aliases b (LOAD) or dst (STORE), see ir_insn::aliases. A STORE leaves
+    // through target when it hits one, unless target is -1
+    REG_LOAD_ALIASED,
+    REG_STORE_ALIASED,
+    // leave through target unless a is inside memory, or if a is 0
+    REG_CHECK_ADDRESS,
+    REG_CHECK_NONZERO,
+    // leave through target if a / b doesn't fit into an int
+    REG_CHECK_QUOTIENT,
+    // prints a
+    REG_PRINT,
+    // the bulk memory, atomic, SPAWN, JOIN, POP_RES or NATIVE opcode b on the operands from a, see IR_BULK.
+    // Leaves through target on a bad address or native, or a JOIN that ended the program
+    REG_BULK,
+    // dst = function b called with the operands from a, -1 for functions without a result. Leaves
+    // through target if the program ended in the function
+    REG_CALL,
+    // to target
+    REG_JUMP,
+    // to target if a is not 0, or if it is 0
+    REG_JUMP_IF_TRUE,
+    REG_JUMP_IF_FALSE,
+    // to target if a op b
+    REG_JUMP_IF_EQUAL,
+    REG_JUMP_IF_NOT_EQUAL,
+    REG_JUMP_IF_LESS,
+    REG_JUMP_IF_LESS_OR_EQUAL,
+    REG_JUMP_IF_GREATER,
+    REG_JUMP_IF_GREATER_OR_EQUAL,
+    // leaves through target
+    REG_EXIT,
+    // returns a from a function, -1 for void ones
+    REG_RETURN,
+    // returns what function b returns when called with the operands from a
+    REG_TAIL_CALL
+};
+
+struct reg_insn {
+    reg_opcode opcode;
+    int32_t dst = -1, a = -1, b = -1, target = -1;
+};
+
+// promoted cells that a LOAD or STORE at a computed address may hit, lowest and highest of them
+struct reg_aliases {
+    std::vector<ir_cell> cells;
+    int lowest, highest;
+};
+
+// ir_exit with registers of the frame; value is -1 where there is none
+struct reg_exit {
+    ir_exit_kind kind;
+    int ip;
+    int reason;
+    int value;
+    std::vector<int> stack;
+    std::vector<ir_cell> spills;
+};
+
+struct reg_function {
+    std::vector<reg_insn> code;
+    // registers of the IR, the constants come after them
+    int regs = 0;
+    std::vector<int> frame;
+    std::vector<int> inputs;
+    std::vector<reg_exit> exits;
+    std::vector<reg_aliases> aliases;
+    // the arguments of calls and bulk memory instructions: how many there are, then their registers
+    std::vector<int> operands;
+};
+
+reg_function build_reg_code(const ir_function& function);
+
+// one line per instruction, for --dump-ir
+std::string dump_reg_code(const reg_function& function);
+
+#endif //REG_CODE_H
@@ -1,422 +1,1058 @@
-#include <vector>
-#include <iostream>
+#include <atomic>
+#include <mutex>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-#include <cstring>
-#include <sys/mman.h>
-#include <unistd.h>
-#include <jit/jit-plus.h>
-#include <jit/jit.h>
+#include <fstream>
+#include <limits>
+#include "vm.h"
 
 using namespace std;
 
-enum opcodes {
-    OP_PUSHI,
-    OP_LOADI,
-    OP_LOADADDI,
-    OP_STOREI,
-    OP_LOAD,
-    OP_STORE,
-    OP_DUP,
-    OP_DISCARD,
-    OP_ADD,
-    OP_ADDI,
-    OP_SUB,
-    OP_DIV,
-    OP_MUL,
-    OP_JUMP,
-    OP_JUMP_IF_TRUE,
-    OP_JUMP_IF_FALSE,
-    OP_EQUAL,
-    OP_LESS,
-    OP_LESS_OR_EQUAL,
-    OP_GREATER,
-    OP_GREATER_OR_EQUAL,
-    OP_GREATER_OR_EQUALI,
-    OP_POP_RES,
-    OP_DONE,
-    OP_PRINT,
-    OP_ABORT
-};
-
-const int STACK_SIZE = 8096, MEMORY_SIZE = 140000;
-
-void print_int(int n) {
-    cout << n << "\n";
-}
-
-class jit_compiled_func : public jit_function
-{
-public:
-    explicit jit_compiled_func(jit_context& context, int* instructions, bool is_void, int num_args, int ip_start, int ip_end, int* memory, int* stack, int* stack_size):
-                     jit_function(context),
-                     instructions(instructions), num_args(num_args), ip_start(ip_start), ip_end(ip_end), is_void(is_void)
-    {
-        this->memory_outer = memory;
-        this->stack_outer = stack;
-        this->stack_size_ptr_outer = stack_size;
-        create();
-        set_recompilable();
-    }
-
-    void build() override {
-        auto memory = new_value(jit_type_create_pointer(jit_type_int, 1));
-        memory = this->new_constant(memory_outer);
-        auto stack = new_value(jit_type_create_pointer(jit_type_int, 1));
-        stack = this->new_constant(stack_outer);
-        jit_value stack_size_ptr = new_value(jit_type_create_pointer(jit_type_int, 1));
-        stack_size_ptr = this->new_constant(stack_size_ptr_outer);
-        auto ip = ip_start;
-        while (ip < ip_end) {
-            ip++;
-            switch (instructions[ip - 1]) {
-                case OP_PUSHI: {
-                    auto arg = instructions[ip];
-                    ip++;
-                    push_on_stack(stack, stack_size_ptr, arg);
-                    break;
-                }
-                case OP_STORE: {
-                    auto val = pop_from_stack(stack, stack_size_ptr);
-                    auto index = pop_from_stack(stack, stack_size_ptr);
-                    insn_store_elem(memory, index, val);
-                    break;
-                }
-                case OP_LOAD: {
-                    auto ind = pop_from_stack(stack, stack_size_ptr);
-                    push_on_stack(stack, stack_size_ptr, insn_load_elem(memory, ind, jit_type_int));
-                    break;
-                }
-                case OP_PRINT: {
-                    auto tmp = pop_from_stack(stack, stack_size_ptr).raw();
-                    this->insn_call_native("print_int", (void *)(&print_int), signature_helper(jit_type_void, jit_type_int, end_params),
-                                           &tmp, 1, 0);
-                    break;
-                }
-                case OP_DONE: {
-                    insn_return();
-                    return;
-                }
-                case OP_ADD: {
-                    auto arg1 = pop_from_stack(stack, stack_size_ptr);
-                    auto arg2 = pop_from_stack(stack, stack_size_ptr);
-                    push_on_stack(stack, stack_size_ptr, arg1 + arg2);
-                    break;
-                }
-                case OP_SUB: {
-                    auto arg1 = pop_from_stack(stack, stack_size_ptr);
-                    auto arg2 = pop_from_stack(stack, stack_size_ptr);
-                    push_on_stack(stack, stack_size_ptr, arg2 - arg1);
-                    break;
-                }
-                case OP_MUL: {
-                    auto arg1 = pop_from_stack(stack, stack_size_ptr);
-                    auto arg2 = pop_from_stack(stack, stack_size_ptr);
-                    push_on_stack(stack, stack_size_ptr, arg2 * arg1);
-                    break;
-                }
-                case OP_DIV: {
-                    auto arg1 = pop_from_stack(stack, stack_size_ptr);
-                    auto arg2 = pop_from_stack(stack, stack_size_ptr);
-                    // TODO: check that arg2 is not zero
-                    push_on_stack(stack, stack_size_ptr, arg2 / arg1);
-                    break;
+bool set_program_sizes(bytecode& program, uint32_t memory_size, uint32_t stack_size, string& error) {
+    memory_size = memory_size ? memory_size : DEFAULT_MEMORY_SIZE;
+    stack_size = stack_size ? stack_size : DEFAULT_STACK_SIZE;
+    if (memory_size > (uint32_t) MAX_MEMORY_SIZE || stack_size > (uint32_t) MAX_STACK_SIZE) {
+        error = "program needs " + to_string(memory_size) + " memory cells and " + to_string(stack_size) +
+                " stack entries, the VM allows at most " + to_string(MAX_MEMORY_SIZE) + " and " +
+                to_string(MAX_STACK_SIZE);
+        return false;
+    }
+    program.memory_size = (memory_size + MEMORY_SIZE_ALIGN - 1) / MEMORY_SIZE_ALIGN * MEMORY_SIZE_ALIGN;
+    program.stack_size = stack_size;
+    return true;
+}
+
+bool load_bytecode(unsigned char* data, size_t data_size, bytecode& program, string& error) {
+    pvm_header header = {};
+    if (data_size >= sizeof(header)) {
+        memcpy(&header, data, sizeof(header));
+    }
+    if (header.magic != PVM_MAGIC) {
+        program = {data, (int) (data_size / sizeof(int)), false, 0, 0, 0};
+        return set_program_sizes(program, 0, 0, error);
+    }
+    if (header.version != PVM_VERSION) {
+        error = "unsupported .pvm version " + to_string(header.version);
+        return false;
+    }
+    if (header.code_size > data_size - sizeof(header)) {
+        error = "code size " + to_string(header.code_size) + " is larger than the file";
+        return false;
+    }
+    program = {data + sizeof(header), (int) header.code_size, true, (int) header.entry, 0, 0};
+    return set_program_sizes(program, header.memory_size, header.stack_size, error);
+}
+
+int stack_effect(int opcode) {
+    switch (opcode) {
+        case OP_PUSHI:
+        case OP_LOADI:
+        case OP_DUP:
+        case OP_LOADL:
+            return 1;
+        case OP_STOREI:
+        case OP_DISCARD:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_DIV:
+        case OP_MUL:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:
+        case OP_EQUAL:
+        case OP_LESS:
+        case OP_LESS_OR_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_OR_EQUAL:
+        case OP_POP_RES:
+        case OP_PRINT:
+        case OP_STOREL:
+        case OP_SCAN_ZERO:
+        case OP_SCAN_NONZERO:
+        case OP_ATOMIC_ADD:
+            return -1;
+        case OP_STORE:
+        case OP_CAS:
+            return -2;
+        case OP_COPY:
+            return -3;
+        case OP_FILL:
+            return -4;
+        default:
+            if (is_superinstruction(opcode)) {
+                int effect = 0;
+                for (auto part : superinstruction_sequences[opcode - FIRST_SUPERINSTRUCTION]) {
+                    effect += stack_effect(part);
                 }
-                case OP_EQUAL: {
-                    auto arg1 = pop_from_stack(stack, stack_size_ptr);
-                    auto arg2 = pop_from_stack(stack, stack_size_ptr);
-                    push_on_stack(stack, stack_size_ptr, arg2 == arg1);
+                return effect;
+            }
+            return 0;
+    }
+}
+
+bool valid_address(const bytecode& program, int addr) {
+    return (unsigned) addr < (unsigned) program.memory_size;
+}
+
+bool is_jump(int opcode) {
+    return opcode == OP_JUMP || opcode == OP_JUMP_IF_TRUE || opcode == OP_JUMP_IF_FALSE;
+}
+
+bool is_conditional_jump(int opcode) {
+    if (is_superinstruction(opcode)) {
+        opcode = superinstruction_sequences[opcode - FIRST_SUPERINSTRUCTION].back();
+    }
+    return opcode == OP_JUMP_IF_TRUE || opcode == OP_JUMP_IF_FALSE;
+}
+
+string opcode_name(int opcode) {
+    if (is_superinstruction(opcode)) {
+        string name;
+        for (auto part : superinstruction_sequences[opcode - FIRST_SUPERINSTRUCTION]) {
+            name += (name.empty() ? "" : "+") + opcode_name(part);
+        }
+        return name;
+    }
+    if (opcode < 0 || opcode >= FIRST_SUPERINSTRUCTION) {
+        return "UNKNOWN_" + to_string(opcode);
+    }
+    return opcode_mnemonics[opcode].name;
+}
+
+int fuse_superinstructions(bytecode& program) {
+    auto size = program.size;
+    vector<bool> is_target(size + 1);
+    for (int ip = 0; ip < size; ip += program.length(program.opcode(ip))) {
+        auto opcode = base_opcode(program.opcode(ip));
+        // workers start at the target of a SPAWN
+        if ((is_jump(opcode) || opcode == OP_SPAWN) && program.arg(ip + 1) >= 0 && program.arg(ip + 1) <= size) {
+            is_target[program.arg(ip + 1)] = true;
+        }
+    }
+    int fused = 0;
+    int ip = 0;
+    while (ip < size) {
+        int opcode = FIRST_SUPERINSTRUCTION;
+        for (; opcode < OPCODES_COUNT; opcode++) {
+            int end = ip;
+            bool matches = true;
+            for (auto part : superinstruction_sequences[opcode - FIRST_SUPERINSTRUCTION]) {
+                if (end >= size || program.opcode(end) != part || (end != ip && is_target[end])) {
+                    matches = false;
                     break;
                 }
-                case OP_GREATER: {
-                    auto arg1 = pop_from_stack(stack, stack_size_ptr);
-                    auto arg2 = pop_from_stack(stack, stack_size_ptr);
-                    push_on_stack(stack, stack_size_ptr, arg2 > arg1);
-                    break;
+                end += program.length(part);
+            }
+            // PUSHI_LOAD doesn't check its address, LOAD has to report bad ones
+            if (opcode == OP_PUSHI_LOAD && matches && !valid_address(program, program.arg(ip + 1))) {
+                matches = false;
+            }
+            if (matches && end <= size) {
+                break;
+            }
+        }
+        if (opcode < OPCODES_COUNT) {
+            program.set_opcode(ip, opcode);
+            fused++;
+        }
+        ip += program.length(program.opcode(ip));
+    }
+    return fused;
+}
+
+int stack_inputs(int opcode) {
+    switch (opcode) {
+        case OP_LOADADDI:
+        case OP_STOREI:
+        case OP_LOAD:
+        case OP_DUP:
+        case OP_DISCARD:
+        case OP_ADDI:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:
+        case OP_GREATER_OR_EQUALI:
+        case OP_POP_RES:
+        case OP_PRINT:
+        case OP_STOREL:
+        case OP_SPAWN:
+        case OP_JOIN:
+        case OP_NATIVE:
+            return 1;
+        case OP_STORE:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_DIV:
+        case OP_MUL:
+        case OP_EQUAL:
+        case OP_LESS:
+        case OP_LESS_OR_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_OR_EQUAL:
+        case OP_SCAN_ZERO:
+        case OP_SCAN_NONZERO:
+        case OP_ATOMIC_ADD:
+            return 2;
+        case OP_COPY:
+        case OP_CAS:
+            return 3;
+        case OP_FILL:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+int function_at(const vector<function_info>& functions, int ip) {
+    auto it = lower_bound(functions.begin(), functions.end(), ip, [](const function_info& function, int ip) {
+        return function.entry < ip;
+    });
+    return it != functions.end() && it->entry == ip ? (int) (it - functions.begin()) : -1;
+}
+
+// Follows every path from start through [region_start, end), the main program or a function, entered
+// with depth values in the frame, and records the depth before each instruction in depths. results is
+// what RET has to return, -1 outside of functions. Returns the largest depth, or -1 with error_ip and
+// error set. Works on fused programs as well: the parts of a superinstruction are still in place
+static int frame_depth(const bytecode& program, const vector<function_info>& functions, const vector<bool>& is_start,
+                       int start, int region_start, int end, int depth, int results, vector<int>& depths,
+                       int& error_ip, string& error) {
+    auto fail = [&](int ip, const string& what) {
+        error_ip = ip;
+        error = what;
+        return -1;
+    };
+    int max_depth = depth;
+    vector<pair<int, int>> work = {{start, depth}};
+    while (!work.empty()) {
+        auto [ip, depth] = work.back();
+        work.pop_back();
+        while (true) {
+            if (ip >= end) {
+                return fail(ip, end == program.size ? "execution runs past the end" : "execution runs into a function");
+            }
+            if (depths[ip] >= 0) {
+                if (depths[ip] != depth) {
+                    return fail(ip, "stack depth " + to_string(depth) + " differs from " + to_string(depths[ip]));
                 }
-                case OP_GREATER_OR_EQUAL: {
-                    auto arg1 = pop_from_stack(stack, stack_size_ptr);
-                    auto arg2 = pop_from_stack(stack, stack_size_ptr);
-                    push_on_stack(stack, stack_size_ptr, arg2 >= arg1);
-                    break;
+                break;
+            }
+            depths[ip] = depth;
+            auto opcode = base_opcode(program.opcode(ip));
+            auto arg = argument_count(opcode) ? program.arg(ip + 1) : 0;
+            if (depth < stack_inputs(opcode)) {
+                return fail(ip, "stack underflow");
+            }
+            if (opcode == OP_CALL) {
+                auto callee = function_at(functions, arg);
+                if (callee < 0) {
+                    return fail(ip, "call to " + to_string(arg) + " is not a function");
                 }
-                case OP_LESS: {
-                    auto arg1 = pop_from_stack(stack, stack_size_ptr);
-                    auto arg2 = pop_from_stack(stack, stack_size_ptr);
-                    push_on_stack(stack, stack_size_ptr, arg2 < arg1);
-                    break;
+                if (depth < functions[callee].args) {
+                    return fail(ip, "stack underflow");
                 }
-                case OP_LESS_OR_EQUAL: {
-                    auto arg1 = pop_from_stack(stack, stack_size_ptr);
-                    auto arg2 = pop_from_stack(stack, stack_size_ptr);
-                    push_on_stack(stack, stack_size_ptr, arg2 <= arg1);
-                    break;
+                depth += functions[callee].results - functions[callee].args;
+            } else {
+                depth += stack_effect(opcode);
+            }
+            max_depth = max(max_depth, depth);
+            if (depth > program.stack_size) {
+                return fail(ip, "stack overflow");
+            }
+            if ((opcode == OP_LOADI || opcode == OP_STOREI || opcode == OP_LOADADDI) && !valid_address(program, arg)) {
+                return fail(ip, "address out of memory");
+            }
+            // the depth after LOADL counts the copy, the one after STOREL no longer the value
+            if ((opcode == OP_LOADL || opcode == OP_STOREL) && (arg < 0 || arg >= depth - (opcode == OP_LOADL))) {
+                return fail(ip, "frame slot " + to_string(arg) + " is not on the stack");
+            }
+            if (opcode == OP_ENTER && ip != region_start) {
+                return fail(ip, "ENTER inside of a function");
+            }
+            if (opcode == OP_RET && (results < 0 || arg != results || depth < results)) {
+                return fail(ip, results < 0 ? "RET outside of a function" : "RET " + to_string(arg) + " in a function that returns " + to_string(results));
+            }
+            if (is_jump(opcode)) {
+                if (arg < 0 || arg >= program.size || !is_start[arg]) {
+                    return fail(ip, "jump to " + to_string(arg) + " is not an instruction");
                 }
-                default: {
-                    cerr << "UNKNOWN INSTRUCTION: " << instructions[ip - 1] << endl;
-                    exit(12);
+                // the ENTER of a function only runs on a call
+                if (arg < region_start || arg >= end || (results >= 0 && arg == region_start)) {
+                    return fail(ip, "jump to " + to_string(arg) + " leaves the " + (results < 0 ? "main program" : "function"));
                 }
+                work.emplace_back(arg, depth);
+            }
+            if (opcode == OP_JUMP || opcode == OP_DONE || opcode == OP_ABORT || opcode == OP_RET) {
+                break;
+            }
+            ip += program.length(opcode);
+        }
+    }
+    return max_depth;
+}
+
+vector<function_info> find_functions(const bytecode& program) {
+    vector<function_info> functions;
+    for (int ip = 0; ip < program.size; ip += program.length(base_opcode(program.opcode(ip)))) {
+        auto opcode = base_opcode(program.opcode(ip));
+        if (opcode == OP_ENTER) {
+            if (!functions.empty()) {
+                functions.back().end = ip;
             }
+            functions.push_back({ip, program.size, program.arg(ip + 1), 0, 0});
+        } else if (opcode == OP_RET && !functions.empty()) {
+            functions.back().results = program.arg(ip + 1);
         }
     }
+    if (functions.empty()) {
+        return functions;
+    }
+    // the VM only gets verified programs, the verifier checks the frames itself
+    vector<bool> is_start(program.size, true);
+    vector<int> depths(program.size, -1);
+    for (auto& function : functions) {
+        int error_ip = 0;
+        string error;
+        function.frame_size = function.args;
+        if (function.args < 0 || function.args > MAX_FUNCTION_ARGS || function.results < 0 ||
+            function.results > MAX_FUNCTION_RESULTS) {
+            continue;
+        }
+        function.frame_size = max(function.args, frame_depth(program, functions, is_start, function.entry, function.entry,
+                                                             function.end, function.args, function.results, depths,
+                                                             error_ip, error));
+    }
+    return functions;
+}
 
-    void push_on_stack(jit_value& stack, jit_value& stack_size_ptr, int arg) {
-        this->insn_store_elem(stack, insn_load_elem(stack_size_ptr, new_constant(0), jit_type_int), new_constant(arg));
-        insn_store_elem(stack_size_ptr, new_constant(0),
-                        insn_load_elem(stack_size_ptr, new_constant(0), jit_type_int) + new_constant(1));
+bool verify_program(const bytecode& program, string& error) {
+    auto size = program.size;
+    auto fail = [&](int ip, const string& what) {
+        error = what + " at ip " + to_string(ip);
+        return false;
+    };
+    vector<bool> is_start(size);
+    for (int ip = 0; ip < size; ip += program.length(program.opcode(ip))) {
+        auto opcode = program.opcode(ip);
+        if ((opcode < 0 || opcode >= FIRST_SUPERINSTRUCTION) && (opcode != LABEL_MARK || program.compact)) {
+            return fail(ip, "unknown instruction " + to_string(opcode));
+        }
+        if (ip + program.length(opcode) > size) {
+            return fail(ip, "truncated instruction");
+        }
+        if (opcode == LABEL_MARK && program.arg(ip + 1) != LABEL_MARK_SECOND) {
+            return fail(ip, "broken label mark");
+        }
+        is_start[ip] = true;
+    }
+    auto functions = find_functions(program);
+    auto main_end = functions.empty() ? size : functions[0].entry;
+    if (program.entry < 0 || program.entry >= main_end || !is_start[program.entry]) {
+        return fail(program.entry, "entry point is not an instruction of the main program");
+    }
+    for (auto& function : functions) {
+        if (function.args < 0 || function.args > MAX_FUNCTION_ARGS) {
+            return fail(function.entry, "a function takes at most " + to_string(MAX_FUNCTION_ARGS) + " arguments");
+        }
+        if (function.results < 0 || function.results > MAX_FUNCTION_RESULTS) {
+            return fail(function.entry, "a function returns at most " + to_string(MAX_FUNCTION_RESULTS) + " values");
+        }
+    }
+    vector<int> depths(size, -1);
+    int error_ip = 0;
+    if (frame_depth(program, functions, is_start, program.entry, 0, main_end, 0, -1, depths, error_ip, error) < 0) {
+        return fail(error_ip, error);
+    }
+    for (auto& function : functions) {
+        if (frame_depth(program, functions, is_start, function.entry, function.entry, function.end, function.args,
+                        function.results, depths, error_ip, error) < 0) {
+            return fail(error_ip, error);
+        }
+    }
+    // a worker starts in the main program with its argument on the stack
+    for (int ip = 0; ip < size; ip += program.length(program.opcode(ip))) {
+        if (program.opcode(ip) != OP_SPAWN) {
+            continue;
+        }
+        auto target = program.arg(ip + 1);
+        if (target < 0 || target >= main_end || !is_start[target]) {
+            return fail(ip, "SPAWN of " + to_string(target) + " is not an instruction of the main program");
+        }
+        if (frame_depth(program, functions, is_start, target, 0, main_end, 1, -1, depths, error_ip, error) < 0) {
+            return fail(error_ip, error);
+        }
     }
+    return true;
+}
 
-    void push_on_stack(jit_value& stack, jit_value& stack_size_ptr, jit_value&& arg) {
-        this->insn_store_elem(stack, insn_load_elem(stack_size_ptr, new_constant(0), jit_type_int), arg);
-        insn_store_elem(stack_size_ptr, new_constant(0),
-                        insn_load_elem(stack_size_ptr, new_constant(0), jit_type_int) + new_constant(1));
+bool fits_memory(const bytecode& program, int memory_size, string& error) {
+    for (int ip = 0; ip < program.size; ip += program.length(program.opcode(ip))) {
+        auto opcode = program.opcode(ip);
+        // PUSHI_LOAD was only fused for an address in memory, the parts of the others are still in place
+        auto addr = opcode == OP_PUSHI_LOAD ? program.arg(ip + 1) : 0;
+        for (auto part_ip = ip; part_ip < ip + program.length(opcode);) {
+            auto part = base_opcode(program.opcode(part_ip));
+            if (part == OP_LOADI || part == OP_STOREI || part == OP_LOADADDI) {
+                addr = max(addr, program.arg(part_ip + 1));
+            }
+            part_ip += program.length(part);
+        }
+        if (addr >= memory_size) {
+            error = "address " + to_string(addr) + " out of " + to_string(memory_size) + " memory cells at ip " +
+                    to_string(ip);
+            return false;
+        }
     }
+    return true;
+}
+
+void print_int(vm_output* output, int n) {
+    output->print(n);
+}
 
-    jit_value pop_from_stack(jit_value& stack, jit_value& stack_size_ptr) {
-        insn_store_elem(stack_size_ptr, new_constant(0),
-                        insn_load_elem(stack_size_ptr, new_constant(0), jit_type_int) - new_constant(1));
-        return insn_load_elem(stack, insn_load_elem(stack_size_ptr, new_constant(0), jit_type_int), jit_type_int);
+// The bulk memory instructions for compiled code, with INT64_MIN for a bad address. runtime is only
+// there for functions, which leave it to the helper to report the address
+static int64_t bulk_failed(jit_runtime* runtime, int bad) {
+    if (runtime) {
+        stop_program(runtime, STOP_BAD_ADDRESS, bad);
     }
+    return numeric_limits<int64_t>::min();
+}
+
+int64_t jit_fill(jit_runtime* runtime, int* memory, int memory_size, int addr, int count, int stride, int value) {
+    int bad;
+    return bulk_fill(memory, memory_size, addr, count, stride, value, bad) ? 0 : bulk_failed(runtime, bad);
+}
+
+int64_t jit_copy(jit_runtime* runtime, int* memory, int memory_size, int dst, int src, int count) {
+    int bad;
+    return bulk_copy(memory, memory_size, dst, src, count, bad) ? 0 : bulk_failed(runtime, bad);
+}
 
-protected:
-    jit_type_t create_signature() override {
-        auto ret_type = (is_void ? jit_type_void : jit_type_int);
-        jit_type_t params[num_args];
-        for (int i = 0; i < num_args; i++) {
-            params[i] = jit_type_int;
+int64_t jit_scan(jit_runtime* runtime, int* memory, int memory_size, int addr, int end, int zero) {
+    int result;
+    return bulk_scan(memory, memory_size, addr, end, zero, result) ? result : bulk_failed(runtime, result);
+}
+
+int64_t jit_atomic_add(jit_runtime* runtime, int* memory, int memory_size, int addr, int value) {
+    int result;
+    return atomic_add(memory, memory_size, addr, value, result) ? result : bulk_failed(runtime, result);
+}
+
+int64_t jit_cas(jit_runtime* runtime, int* memory, int memory_size, int addr, int expected, int desired) {
+    int result;
+    return atomic_cas(memory, memory_size, addr, expected, desired, result) ? result : bulk_failed(runtime, result);
+}
+
+int64_t jit_spawn(jit_runtime* runtime, int*, int, int entry, int value) {
+    return runtime->vm->spawn(entry, value);
+}
+
+int64_t jit_join(jit_runtime* runtime, int*, int, int id) {
+    int result;
+    if (!runtime->vm->join(id, result)) {
+        runtime->stopped = 1;
+        return numeric_limits<int64_t>::min();
+    }
+    return result;
+}
+
+int64_t jit_pop_res(jit_runtime* runtime, int*, int, int value) {
+    runtime->results.push_back(value);
+    return 0;
+}
+
+vm_threads::vm_threads(const VM& vm) : vm(vm) {
+    auto count = max(1u, thread::hardware_concurrency());
+    for (unsigned i = 0; i < count; i++) {
+        threads.emplace_back([this] { work(); });
+    }
+}
+
+vm_threads::~vm_threads() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void vm_threads::start(shared_ptr<vm_worker> worker) {
+    {
+        lock_guard<mutex> guard(lock);
+        queue.push_back(std::move(worker));
+    }
+    changed.notify_one();
+}
+
+void vm_threads::wait(const vm_worker& worker) {
+    unique_lock<mutex> guard(lock);
+    while (!worker.finished) {
+        if (queue.empty()) {
+            changed.wait(guard);
+            continue;
         }
-        return jit_type_create_signature(jit_abi_cdecl, ret_type, params, num_args, 1);
+        auto next = std::move(queue.front());
+        queue.pop_front();
+        guard.unlock();
+        run(*next);
+        guard.lock();
     }
+}
 
-private:
-    int* instructions;
-    int num_args, ip_start, ip_end;
-    bool is_void;
-    int* memory_outer;
-    int* stack_outer;
-    int* stack_size_ptr_outer;
-};
+void vm_threads::work() {
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        changed.wait(guard, [this] { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+            return;
+        }
+        auto next = std::move(queue.front());
+        queue.pop_front();
+        guard.unlock();
+        run(*next);
+        guard.lock();
+    }
+}
 
-class VM {
-public:
-    // program is the pointer to instructions; size is the number of instructions
-    explicit VM(int* program, int size) : instructions(program), context(),
-                                          main_func(context, instructions, true, 0, 0, size, &memory[0], &stack[0], &stack_size) {
+void vm_threads::run(vm_worker& worker) {
+    unique_ptr<VM> worker_vm;
+    {
+        lock_guard<mutex> guard(lock);
+        if (!idle.empty()) {
+            worker_vm = std::move(idle.back());
+            idle.pop_back();
+        }
+    }
+    if (!worker_vm) {
+        worker_vm.reset(new VM(vm, *this));
+    }
+    string error;
+    if (worker_vm->allocate_stack(error)) {
+        worker_vm->run_worker(worker);
+    } else {
+        // JOIN reports it like any other error of the worker
+        worker.failed = true;
+        worker.errors = error + "\n";
     }
+    {
+        lock_guard<mutex> guard(lock);
+        idle.push_back(std::move(worker_vm));
+        worker.finished = true;
+    }
+    changed.notify_all();
+}
 
-    void run() {
-        size_t ip = 0;
-        while (true) {
-            ip++;
-            switch (instructions[ip - 1]) {
-                case OP_JUMP: {
-                    auto arg = instructions[ip];
-                    ip++;
-                    ip = arg;
-                    break;
-                }
-                case OP_JUMP_IF_TRUE: {
-                    auto arg = instructions[ip];
-                    ip++;
-                    if (stack_pop()) {
-                        ip = arg;
-                    }
-                    break;
-                }
-                case OP_JUMP_IF_FALSE: {
-                    auto arg = instructions[ip];
-                    ip++;
-                    if (!stack_pop()) {
-                        ip = arg;
-                    }
-                    break;
-                }
-                case OP_LOADADDI: {
-                    auto arg = instructions[ip];
-                    ip++;
-                    stack[stack_size - 1] += memory[arg];
-                    break;
-                }
-                case OP_LOADI: {
-                    auto arg = instructions[ip];
-                    ip++;
-                    stack[stack_size++] = memory[arg];
-                    break;
-                }
-                case OP_PUSHI: {
-                    auto arg = instructions[ip];
-                    ip++;
-                    stack[stack_size++] = arg;
-                    break;
-                }
-                case OP_DISCARD: {
-                    stack_size--;
-                    break;
-                }
-                case OP_STOREI: {
-                    auto addr = instructions[ip];
-                    ip++;
-                    store_to_memory(addr, stack_pop());
-                    break;
-                }
-                case OP_LOAD: {
-                    auto addr = stack_pop();
-                    stack[stack_size++] = memory[addr];
-                    break;
-                }
-                case OP_STORE: {
-                    auto val = stack_pop();
-                    auto addr = stack_pop();
-                    store_to_memory(addr, val);
-                    break;
-                }
-                case OP_ADDI: {
-                    auto arg = instructions[ip];
-                    ip++;
-                    stack[stack_size - 1] += arg;
-                    break;
-                }
-                case OP_DUP: {
-                    stack[stack_size] = stack[stack_size - 1];
-                    stack_size++;
-                    break;
-                }
-                case OP_SUB: {
-                    auto arg = stack_pop();
-                    stack[stack_size - 1] -= arg;
-                    break;
-                }
-                case OP_ADD: {
-                    auto arg = stack_pop();
-                    stack[stack_size - 1] += arg;
-                    break;
-                }
-                case OP_DIV: {
-                    auto arg = stack_pop();
-                    if (arg == 0) {
-                        cerr << "ZERO DIVISION\n";
-                        return;
-                    }
-                    stack[stack_size - 1] /= arg;
-                    break;
-                }
-                case OP_MUL: {
-                    auto arg = stack_pop();
-                    stack[stack_size - 1] *= arg;
-                    break;
-                }
-                case OP_ABORT: {
-                    cerr << "OP_ABORT called\n";
-                    return;
-                }
-                case OP_DONE: {
-                    cout << "program DONE\n";
-                    return;
-                }
-                case OP_PRINT: {
-                    cout << stack_pop() << "\n";
-                    break;
-                }
-                case OP_POP_RES: {
-                    stack_pop();
-                    break;
-                }
-                case OP_GREATER_OR_EQUALI: {
-                    auto arg = instructions[ip];
-                    ip++;
-                    stack[stack_size - 1] = stack[stack_size - 1] >= arg;
-                    break;
-                }
-                case OP_GREATER_OR_EQUAL: {
-                    auto arg = stack_pop();
-                    stack[stack_size - 1] = stack[stack_size - 1] >= arg;
-                    break;
-                }
-                case OP_GREATER: {
-                    auto arg = stack_pop();
-                    stack[stack_size - 1] = stack[stack_size - 1] > arg;
-                    break;
-                }
-                case OP_LESS: {
-                    auto arg = stack_pop();
-                    stack[stack_size - 1] = stack[stack_size - 1] < arg;
-                    break;
-                }
-                case OP_LESS_OR_EQUAL: {
-                    auto arg = stack_pop();
-                    stack[stack_size - 1] = stack[stack_size - 1] <= arg;
-                    break;
-                }
-                case OP_EQUAL: {
-                    auto arg = stack_pop();
-                    stack[stack_size - 1] = stack[stack_size - 1] == arg;
-                    break;
-                }
-                case 0xcafe: {
-                    // skip 0xbabe
-                    ip++;
-                }
-            }
+vm_scheduler::vm_scheduler(unsigned threads_count, int64_t slice, end_function on_end)
+        : slice(slice), on_end(std::move(on_end)) {
+    for (unsigned i = 0; i < max(1u, threads_count); i++) {
+        threads.emplace_back([this] { work(); });
+    }
+}
+
+vm_scheduler::~vm_scheduler() {
+    wait();
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void vm_scheduler::add(VM& vm) {
+    {
+        lock_guard<mutex> guard(lock);
+        queue.push_back(&vm);
+        running++;
+    }
+    changed.notify_one();
+}
+
+void vm_scheduler::wait() {
+    unique_lock<mutex> guard(lock);
+    ended.wait(guard, [this] { return running == 0; });
+}
+
+uint64_t vm_scheduler::slices() const {
+    lock_guard<mutex> guard(lock);
+    return slices_run;
+}
+
+void vm_scheduler::work() {
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        changed.wait(guard, [this] { return stopping || !queue.empty(); });
+        if (queue.empty()) {
+            return;
         }
+        auto vm = queue.front();
+        queue.pop_front();
+        guard.unlock();
+        vm->set_fuel(slice);
+        if (vm->is_suspended()) {
+            vm->resume();
+        } else {
+            vm->run();
+        }
+        auto suspended = vm->is_suspended();
+        VM* next = nullptr;
+        if (!suspended && on_end) {
+            // vm may be gone after this
+            next = on_end(*vm);
+        }
+        guard.lock();
+        slices_run++;
+        if (suspended) {
+            queue.push_back(vm);
+        } else if (next) {
+            // takes the place of vm in running, this thread goes on with the queue
+            queue.push_back(next);
+        } else if (--running == 0) {
+            ended.notify_all();
+        }
+    }
+}
+
+void stop_program(jit_runtime* runtime, int reason, int value) {
+    switch (reason) {
+        case STOP_DONE:
+            runtime->done = 1;
+            if (!runtime->is_worker) {
+                runtime->output->message("program DONE\n");
+            }
+            break;
+        case STOP_ABORT:
+            **runtime->err << "OP_ABORT called\n";
+            break;
+        case STOP_ZERO_DIVISION:
+            **runtime->err << "ZERO DIVISION\n";
+            break;
+        case STOP_DIVISION_OVERFLOW:
+            **runtime->err << "DIVISION OVERFLOW\n";
+            break;
+        case STOP_BAD_ADDRESS:
+            **runtime->err << "BAD MEMORY ACCESS: " << value << "\n";
+            break;
+        case STOP_CALL_DEPTH:
+            **runtime->err << "CALL STACK OVERFLOW\n";
+            break;
+        case STOP_BAD_NATIVE:
+            **runtime->err << "BAD NATIVE: " << value << "\n";
+            break;
+    }
+    runtime->stopped = 1;
+}
+
+thread_local guarded_run* current_run = nullptr;
+
+// what SIGSEGV did before the VM took it over, for the faults that aren't in VM memory
+static struct sigaction previous_fault_action;
+
+static void on_memory_fault(int signal, siginfo_t* info, void* context) {
+    auto run = current_run;
+    // bound memory has no guard pages
+    if (run && run->memory && run->memory->fault_cell(info->si_addr, run->bad_cell)) {
+        siglongjmp(run->jump, 1);
+    }
+    auto& previous = previous_fault_action;
+    if (previous.sa_flags & SA_SIGINFO) {
+        previous.sa_sigaction(signal, info, context);
+    } else if (previous.sa_handler != SIG_DFL && previous.sa_handler != SIG_IGN) {
+        previous.sa_handler(signal);
+    } else {
+        // a real crash: the instruction faults again, this time with the action from before
+        sigaction(signal, &previous, nullptr);
+    }
+}
+
+static atomic<bool> guard_pages(HAVE_GUARD_PAGES);
+
+void set_guard_pages(bool on) {
+    guard_pages = on && HAVE_GUARD_PAGES;
+}
+
+bool guard_pages_enabled() {
+    return guard_pages;
+}
+
+static mutex fault_handler_mutex;
+// VM memories with guard pages
+static int fault_handler_users = 0;
+
+void vm_memory::acquire_fault_handler() {
+    lock_guard<mutex> lock(fault_handler_mutex);
+    if (fault_handler_users++ > 0) {
+        return;
     }
+    struct sigaction action = {};
+    action.sa_sigaction = on_memory_fault;
+    // a fault from running out of stack can only be handled on the alternate one
+    action.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &previous_fault_action);
+}
 
-    void jit_run() {
-        //main_func.build_start();
-        //main_func.build();
-        //main_func.compile();
-        //main_func.build_end();
-        auto func_ptr = (void (*)())(main_func.closure());
-        func_ptr();
+void vm_memory::release_fault_handler() {
+    lock_guard<mutex> lock(fault_handler_mutex);
+    if (--fault_handler_users > 0) {
+        return;
+    }
+    // unless the host has put its own in place since
+    struct sigaction current;
+    sigaction(SIGSEGV, nullptr, &current);
+    if ((current.sa_flags & SA_SIGINFO) && current.sa_sigaction == on_memory_fault) {
+        sigaction(SIGSEGV, &previous_fault_action, nullptr);
     }
+}
 
-private:
-    friend class jit_compiled_func;
+vm_memory::~vm_memory() {
+    if (reservation) {
+        munmap(reservation, reservation_bytes);
+        release_fault_handler();
+    } else if (cells) {
+        munmap(cells, bytes);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
 
-    void store_to_memory(int addr, int value) {
-        memory[addr] = value;
+bool vm_memory::snapshot(string& error) {
+    if (pwrite(fd, cells, bytes, 0) != (ssize_t) bytes) {
+        return fail("CAN'T SNAPSHOT VM MEMORY", error);
     }
+    // the private copies now hold the same as the memfd
+    madvise(cells, bytes, MADV_DONTNEED);
+    return true;
+}
 
-    int stack_pop() {
-        return stack[--stack_size];
+bool vm_memory::clear(string& error) {
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, bytes) < 0) {
+        return fail("CAN'T RESET VM MEMORY", error);
     }
+    reset();
+    return true;
+}
 
-    int* instructions;
-    jit_context context;
-    jit_compiled_func main_func;
-    int stack[STACK_SIZE];
-    int memory[MEMORY_SIZE];
-    int stack_size = 0;
-};
+bool vm_memory::fault_cell(const void* address, long& cell) const {
+    if (!reservation || address < reservation || address >= (char*) reservation + reservation_bytes) {
+        return false;
+    }
+    cell = ((const char*) address - (const char*) cells) / (long) sizeof(int);
+    return true;
+}
 
-int main(int argc, char** argv) {
-    if (argc != 2) {
-        cerr << "usage ./vm program.pvm\n";
-        return 1;
+bool vm_memory::map(string& error) {
+    fd = memfd_create("pigletvm-memory", MFD_CLOEXEC);
+    if (fd < 0 || ftruncate(fd, bytes) < 0) {
+        return fail("CAN'T CREATE VM MEMORY", error);
+    }
+    void* at = nullptr;
+    int fixed = 0;
+    if (guarded) {
+        // cells are at most 4 bytes times INT_MIN below and INT_MAX above the start of memory
+        reservation_bytes = (size_t) 16 << 30;
+        auto mapping = mmap(nullptr, reservation_bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mapping == MAP_FAILED) {
+            return fail("CAN'T RESERVE VM MEMORY", error);
+        }
+        reservation = mapping;
+        at = (char*) reservation + reservation_bytes / 2;
+        fixed = MAP_FIXED;
+        acquire_fault_handler();
     }
-    int fd = open(argv[1], O_RDONLY);
-    if (fd < 0) {
-        cerr << strerror(errno);
-        return 1;
+    auto mapping = mmap(at, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_NORESERVE | fixed, fd, 0);
+    if (mapping == MAP_FAILED) {
+        return fail("CAN'T CREATE VM MEMORY", error);
+    }
+    cells = (int*) mapping;
+    return true;
+}
+
+bool open_program(const char* path, const program_options& options, program_file& file) {
+    file.path = path;
+    file.have_map = load_source_map(file.path + ".map", file.map);
+    file.fd = open(path, O_RDONLY);
+    if (file.fd < 0) {
+        cerr << path << ": " << strerror(errno) << "\n";
+        return false;
     }
     struct stat file_info = {};
-    int ret = fstat(fd, &file_info);
+    int ret = fstat(file.fd, &file_info);
     if (ret < 0) {
-        cerr << strerror(errno);
-        return 1;
+        cerr << path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    file.size = file_info.st_size;
+    // private and writable so that fuse_superinstructions() can rewrite the pages it touches
+    auto data = mmap(nullptr, file.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file.fd, 0);
+    if (data == MAP_FAILED) {
+        cerr << path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    file.data = (unsigned char*) data;
+    string error;
+    if (!load_bytecode(file.data, file.size, file.program, error)) {
+        cerr << path << ": BAD PROGRAM FILE: " << error << "\n";
+        return false;
     }
-    auto file_size = file_info.st_size;
-    int* memory = (int *) mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
-    if (memory == MAP_FAILED) {
-        cerr << strerror(errno);
-        return 1;
+    if ((options.memory_size || options.stack_size) &&
+        !set_program_sizes(file.program, options.memory_size ? options.memory_size : file.program.memory_size,
+                           options.stack_size ? options.stack_size : file.program.stack_size, error)) {
+        cerr << path << ": " << error << "\n";
+        return false;
     }
-    VM vm(memory, file_size / sizeof(*memory));
-    for (int i = 0; i < 1; i++) {
+    // The key is taken before fuse_superinstructions() rewrites the code. The sizes are part of it
+    // because the loops compiled depend on them
+    int sizes[] = {file.program.memory_size, file.program.stack_size};
+    file.cache_key = fnv1a(sizes, sizeof(sizes), jit_plan_key(file.data, file.size));
+    file.cache_path = options.use_cache ? jit_plan_path(file.cache_key) : "";
+    file.have_plan = !file.cache_path.empty() && load_jit_plan(file.cache_path, file.cache_key, file.plan);
+    // a plan doesn't vouch for the program, it may come from anywhere
+    if (!verify_program(file.program, error)) {
+        cerr << path << ": VERIFICATION FAILED: " << error << "\n";
+        return false;
+    }
+    if (options.fuse) {
+        fuse_superinstructions(file.program);
+    }
+    if (mprotect(file.data, file.size, PROT_READ) < 0) {
+        cerr << path << ": " << strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
+
+bool load_program(const void* data, size_t size, const program_options& options, program_buffer& buffer,
+                  string& error) {
+    auto bytes = (const unsigned char*) data;
+    buffer.data.assign(bytes, bytes + size);
+    if (!load_bytecode(buffer.data.data(), size, buffer.program, error)) {
+        error = "BAD PROGRAM FILE: " + error;
+        return false;
+    }
+    auto& program = buffer.program;
+    if ((options.memory_size || options.stack_size) &&
+        !set_program_sizes(program, options.memory_size ? options.memory_size : program.memory_size,
+                           options.stack_size ? options.stack_size : program.stack_size, error)) {
+        return false;
+    }
+    if (!verify_program(program, error)) {
+        error = "VERIFICATION FAILED: " + error;
+        return false;
+    }
+    if (options.fuse) {
+        fuse_superinstructions(program);
+    }
+    return true;
+}
+
+bool close_program(program_file& file) {
+    if ((file.data && munmap(file.data, file.size) < 0) || (file.fd >= 0 && close(file.fd) < 0)) {
+        cerr << strerror(errno) << "\n";
+        return false;
+    }
+    return true;
+}
+
+void update_jit_plan(program_file& file, const VM& vm) {
+    if (file.cache_path.empty()) {
+        return;
+    }
+    auto loops = vm.hot_loops();
+    // loops from the plan are compiled again, so a plan only grows
+    if (!file.have_plan || loops.size() != file.plan.hot_loops.size()) {
+        file.plan.hot_loops = std::move(loops);
+        store_jit_plan(file.cache_path, file.cache_key, file.plan);
+    }
+}
+
+void run_vm(VM& vm, run_mode mode) {
+    if (mode == RUN_JIT) {
+        vm.jit_run();
+    } else if (mode == RUN_THREADED) {
+        vm.run_threaded();
+    } else if (mode == RUN_REGISTERS) {
+        vm.run_registers();
+    } else {
         vm.run();
     }
-    if (munmap(memory, file_size) < 0 || close(fd)) {
-        cerr << strerror(errno);
-        return 1;
+}
+
+bool load_source_map(const string& path, source_map& map) {
+    ifstream in(path);
+    string kind;
+    int version = 0;
+    if (!(in >> kind >> version) || kind != "pvm-map" || version != 1) {
+        return false;
+    }
+    while (in >> kind) {
+        if (kind == "source") {
+            in >> ws;
+            getline(in, map.source);
+        } else if (kind == "label") {
+            int ip;
+            string name;
+            in >> ip >> name;
+            map.labels.emplace(ip, name);
+        } else if (kind == "line") {
+            int ip, line;
+            in >> ip >> line;
+            map.lines[ip] = line;
+        } else if (kind == "block") {
+            int ip;
+            in >> ip;
+            map.blocks.insert(ip);
+        } else {
+            // written by a newer assembler
+            in.ignore(numeric_limits<streamsize>::max(), '\n');
+        }
+    }
+    return true;
+}
+
+string jit_symbol(const string& program, const source_map* map, int ip_start, int ip_end, const string& kind) {
+    string name = "pvm " + program.substr(program.rfind('/') + 1) + " " + kind;
+    if (map && kind != "main" && map->labels.count(ip_start)) {
+        name += " " + map->labels.find(ip_start)->second;
+    }
+    name += " [" + to_string(ip_start) + "," + to_string(ip_end) + ")";
+    if (map) {
+        // the label mark in the legacy format has no line, the instruction after it has
+        auto line = map->lines.lower_bound(ip_start);
+        if (line != map->lines.end() && line->first < ip_end) {
+            name += " " + map->source.substr(map->source.rfind('/') + 1) + ":" + to_string(line->second);
+        }
+    }
+    return name;
+}
+
+void write_perf_map(const void* start, size_t size, const string& symbol) {
+    static mutex lock;
+    static FILE* file = nullptr;
+    static bool failed = false;
+    lock_guard<mutex> guard(lock);
+    if (!file && !failed) {
+        auto path = "/tmp/perf-" + to_string(getpid()) + ".map";
+        file = fopen(path.c_str(), "a");
+        if (!file) {
+            cerr << path << ": " << strerror(errno) << "\n";
+            failed = true;
+        }
+    }
+    if (!file) {
+        return;
+    }
+    // flushed right away: perf reads the file when the VM may still be running or already killed
+    fprintf(file, "%lx %zx %s\n", (unsigned long) start, size, symbol.c_str());
+    fflush(file);
+}
+
+void write_profile(ostream& out, const bytecode& program, const vm_profile& profile, const source_map* map) {
+    vector<string> source_lines;
+    if (map) {
+        ifstream source(map->source);
+        for (string line; getline(source, line);) {
+            auto start = line.find_first_not_of(" \t");
+            source_lines.push_back(start == string::npos ? "" : line.substr(start));
+        }
+    }
+    uint64_t total = 0, unfused = 0, total_cycles = 0;
+    vector<uint64_t> opcode_counts(OPCODES_COUNT), opcode_cycles(OPCODES_COUNT);
+    for (int ip = 0; ip < program.size; ip++) {
+        auto opcode = program.opcode(ip);
+        // label marks run in the legacy format, but they aren't instructions
+        if (!profile.counts[ip] || (!program.compact && opcode == LABEL_MARK)) {
+            continue;
+        }
+        total += profile.counts[ip];
+        unfused += profile.counts[ip] * instruction_count(opcode);
+        opcode_counts[opcode] += profile.counts[ip];
+        if (profile.has_cycles) {
+            total_cycles += profile.cycles[ip];
+            opcode_cycles[opcode] += profile.cycles[ip];
+        }
+    }
+    char row[256];
+    out << "profile: " << total << " instructions run, " << unfused << " without superinstructions";
+    if (profile.has_cycles) {
+        out << ", " << total_cycles << " cycles";
+    }
+    out << "\n\n";
+
+    vector<int> opcodes;
+    for (int opcode = 0; opcode < OPCODES_COUNT; opcode++) {
+        if (opcode_counts[opcode]) {
+            opcodes.push_back(opcode);
+        }
     }
-}
\ No newline at end of file
+    sort(opcodes.begin(), opcodes.end(), [&](int a, int b) {
+        return opcode_counts[a] > opcode_counts[b];
+    });
+    snprintf(row, sizeof(row), "%-40s %14s %7s", "opcode", "count", "%");
+    out << row << (profile.has_cycles ? "         cycles  cycles/run\n" : "\n");
+    for (auto opcode : opcodes) {
+        snprintf(row, sizeof(row), "%-40s %14llu %6.2f%%", opcode_name(opcode).c_str(),
+                 (unsigned long long) opcode_counts[opcode], 100.0 * opcode_counts[opcode] / total);
+        out << row;
+        if (profile.has_cycles) {
+            snprintf(row, sizeof(row), " %14llu %11.1f", (unsigned long long) opcode_cycles[opcode],
+                     (double) opcode_cycles[opcode] / opcode_counts[opcode]);
+            out << row;
+        }
+        out << "\n";
+    }
+
+    out << "\n";
+    snprintf(row, sizeof(row), "%8s %6s %14s %14s %14s", "ip", "line", "count", "taken", "not taken");
+    out << row << (profile.has_cycles ? "         cycles  instruction\n" : "  instruction\n");
+    bool listed = false;
+    for (int ip = 0; ip < program.size; ip += program.length(program.opcode(ip))) {
+        auto opcode = program.opcode(ip);
+        if (!profile.counts[ip]) {
+            continue;
+        }
+        if (map) {
+            // an empty line between basic blocks
+            if (map->blocks.count(ip) && listed) {
+                out << "\n";
+            }
+            listed = true;
+            // in the legacy format labels point to their label mark
+            auto labels = map->labels.equal_range(ip);
+            for (auto it = labels.first; it != labels.second; ++it) {
+                out << it->second << ":\n";
+            }
+        }
+        if (!program.compact && opcode == LABEL_MARK) {
+            continue;
+        }
+        int line = 0;
+        if (map && map->lines.count(ip)) {
+            line = map->lines.at(ip);
+        }
+        auto count = profile.counts[ip];
+        auto line_column = line ? to_string(line) : string("-");
+        if (is_conditional_jump(opcode)) {
+            snprintf(row, sizeof(row), "%8d %6s %14llu %14llu %14llu", ip, line_column.c_str(), (unsigned long long) count,
+                     (unsigned long long) profile.taken[ip], (unsigned long long) (count - profile.taken[ip]));
+        } else {
+            snprintf(row, sizeof(row), "%8d %6s %14llu %14s %14s", ip, line_column.c_str(), (unsigned long long) count, "", "");
+        }
+        out << row;
+        if (profile.has_cycles) {
+            snprintf(row, sizeof(row), " %14llu", (unsigned long long) profile.cycles[ip]);
+            out << row;
+        }
+        out << "  " << (line > 0 && line <= (int) source_lines.size() ? source_lines[line - 1] : opcode_name(opcode));
+        if (is_superinstruction(opcode)) {
+            out << "  [" << opcode_name(opcode) << "]";
+        }
+        out << "\n";
+    }
+}
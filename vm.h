@@ -0,0 +1,1085 @@
+#ifndef VM_H
+#define VM_H
+
+#include <vector>
+#include <map>
+#include <set>
+#include <memory>
+#include <unordered_map>
+#include <string>
+#include <iostream>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <cerrno>
+#include <csetjmp>
+#include <csignal>
+#include <cstring>
+#include <sys/mman.h>
+#include <jit/jit-plus.h>
+#include <jit/jit.h>
+#include "pigletvm.h"
+#include "pvm_format.h"
+#include "jit_cache.h"
+#include "vm_output.h"
+#include "bulk_memory.h"
+#include "jit_ir.h"
+#include "reg_code.h"
+
+// The VM itself, for the tools built here and the sources of the library. Programs that embed the VM
+// use pigletvm.h instead
+
+// superinstructions, only created by fuse_superinstructions() when a program is loaded. They
+// follow the opcodes of the format in pvm_format.h
+enum opcodes {
+    OP_DUP_GREATER_OR_EQUALI_JUMP_IF_FALSE = PVM_OPCODES_COUNT,
+    OP_DUP_GREATER_OR_EQUALI_JUMP_IF_TRUE,
+    OP_DUP_PUSHI_STORE,
+    OP_DUP_LOAD,
+    OP_PUSHI_LOAD,
+    OP_LOADI_ADDI,
+    OP_LESS_JUMP_IF_FALSE,
+    OP_GREATER_JUMP_IF_FALSE,
+    OPCODES_COUNT
+};
+
+const int FIRST_SUPERINSTRUCTION = OP_DUP_GREATER_OR_EQUALI_JUMP_IF_FALSE;
+
+// The sequences the superinstructions stand for, indexed by opcode - FIRST_SUPERINSTRUCTION.
+// Picked from the most frequent opcode pairs and triples executed by sieve, fib and fact.
+// Fusing keeps the layout: the first word of the sequence becomes the superinstruction and the
+// rest stays in place, so arguments are read from where they were and no ip changes
+inline const std::vector<int> superinstruction_sequences[] = {
+        {OP_DUP, OP_GREATER_OR_EQUALI, OP_JUMP_IF_FALSE},
+        {OP_DUP, OP_GREATER_OR_EQUALI, OP_JUMP_IF_TRUE},
+        {OP_DUP, OP_PUSHI, OP_STORE},
+        {OP_DUP, OP_LOAD},
+        {OP_PUSHI, OP_LOAD},
+        {OP_LOADI, OP_ADDI},
+        {OP_LESS, OP_JUMP_IF_FALSE},
+        {OP_GREATER, OP_JUMP_IF_FALSE}
+};
+
+inline bool is_superinstruction(int opcode) {
+    return opcode >= FIRST_SUPERINSTRUCTION && opcode < OPCODES_COUNT;
+}
+
+// the first instruction of the sequence a superinstruction stands for
+inline int base_opcode(int opcode) {
+    return is_superinstruction(opcode) ? superinstruction_sequences[opcode - FIRST_SUPERINSTRUCTION][0] : opcode;
+}
+
+// the mnemonic, or the mnemonics of the parts joined by + for a superinstruction
+std::string opcode_name(int opcode);
+
+// how many instructions of the unfused program an opcode stands for
+inline int instruction_count(int opcode) {
+    return is_superinstruction(opcode) ? (int) superinstruction_sequences[opcode - FIRST_SUPERINSTRUCTION].size() : 1;
+}
+
+// sizes for programs that don't ask for others, in memory cells and stack entries
+const int DEFAULT_STACK_SIZE = 8096, DEFAULT_MEMORY_SIZE = 140000;
+// memory sizes are rounded up to a multiple of this, 64 KB, so that the end of memory is the end of a
+// page on every host and the guard pages catch any access past it
+const int MEMORY_SIZE_ALIGN = 16384;
+
+// asm.cpp puts this pair in front of every label
+const int LABEL_MARK = 0xcafe, LABEL_MARK_SECOND = 0xbabe;
+
+// run_threaded() needs the labels as values extension
+#if defined(__GNUC__) && !defined(PIGLET_NO_THREADED_DISPATCH)
+#define HAVE_THREADED_DISPATCH 1
+#else
+#define HAVE_THREADED_DISPATCH 0
+#endif
+
+// With guard pages the memory sits in a reservation that covers every int address, so a bad address
+// faults and VM::run_guarded() reports it, instead of a check on every LOAD and STORE. While there is
+// VM memory with guard pages SIGSEGV is taken over, on the alternate signal stack if the thread has one,
+// and the faults elsewhere go on to the action that the host had. A host that installs its own, or
+// doesn't want it taken over, calls set_guard_pages(false) or builds with PIGLET_NO_GUARD_PAGES
+#if UINTPTR_MAX > 0xffffffffu && defined(__linux__) && !defined(PIGLET_NO_GUARD_PAGES)
+#define HAVE_GUARD_PAGES 1
+#else
+#define HAVE_GUARD_PAGES 0
+#endif
+
+// backward jumps to a loop header, or calls of a function, before run() compiles it
+const unsigned DEFAULT_HOT_LOOP_THRESHOLD = 1000;
+
+// Calls nested deeper than this end the program, so that recursion in compiled code can't
+// overflow the native stack
+const int MAX_CALL_DEPTH = 10000;
+
+// number of arguments after the opcode; a label mark counts as an opcode with one argument.
+// Superinstructions have the arguments and the opcodes of their parts after them instead
+inline int argument_count(int opcode) {
+    switch (opcode) {
+        case OP_PUSHI:
+        case OP_LOADI:
+        case OP_LOADADDI:
+        case OP_STOREI:
+        case OP_ADDI:
+        case OP_GREATER_OR_EQUALI:
+        case OP_JUMP:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:
+        case OP_CALL:
+        case OP_RET:
+        case OP_ENTER:
+        case OP_LOADL:
+        case OP_STOREL:
+        case OP_SPAWN:
+        case OP_NATIVE:
+        case LABEL_MARK:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// How the engines read the two .pvm formats. In the legacy one every opcode, argument and label mark
+// takes one int and ips count ints; in version 2 (pvm_format.h) opcodes take one byte, arguments
+// four and ips count bytes. Both are executed in place from the mapped file
+struct word_format {
+    static const int ARG_SIZE = 1;
+
+    static int opcode(const unsigned char* code, size_t ip) {
+        return ((const int*) code)[ip];
+    }
+
+    // the argument that starts at ip
+    static int arg(const unsigned char* code, size_t ip) {
+        return ((const int*) code)[ip];
+    }
+
+    static void set_opcode(unsigned char* code, size_t ip, int opcode) {
+        ((int*) code)[ip] = opcode;
+    }
+};
+
+struct byte_format {
+    static const int ARG_SIZE = 4;
+
+    static int opcode(const unsigned char* code, size_t ip) {
+        return code[ip];
+    }
+
+    static int arg(const unsigned char* code, size_t ip) {
+        int arg;
+        memcpy(&arg, code + ip, sizeof(arg));
+        return arg;
+    }
+
+    static void set_opcode(unsigned char* code, size_t ip, int opcode) {
+        code[ip] = opcode;
+    }
+};
+
+// a loaded program in either format, for the code that isn't performance critical
+struct bytecode {
+    unsigned char* code;
+    // in ips
+    int size;
+    // version 2 format
+    bool compact;
+    int entry;
+    // memory cells, a multiple of MEMORY_SIZE_ALIGN, and stack entries to run it with
+    int memory_size;
+    int stack_size;
+
+    int opcode(int ip) const {
+        return compact ? byte_format::opcode(code, ip) : word_format::opcode(code, ip);
+    }
+
+    int arg(int ip) const {
+        return compact ? byte_format::arg(code, ip) : word_format::arg(code, ip);
+    }
+
+    void set_opcode(int ip, int opcode) {
+        if (compact) {
+            byte_format::set_opcode(code, ip, opcode);
+        } else {
+            word_format::set_opcode(code, ip, opcode);
+        }
+    }
+
+    // in ips, including the opcode
+    int length(int opcode) const {
+        if (is_superinstruction(opcode)) {
+            int length = 0;
+            for (auto part : superinstruction_sequences[opcode - FIRST_SUPERINSTRUCTION]) {
+                length += this->length(part);
+            }
+            return length;
+        }
+        return 1 + argument_count(opcode) * (compact ? byte_format::ARG_SIZE : word_format::ARG_SIZE);
+    }
+};
+
+// Sets the memory and stack size of program, 0 for the defaults
+bool set_program_sizes(bytecode& program, uint32_t memory_size, uint32_t stack_size, std::string& error);
+
+// Checks the header of a mapped .pvm file and sets up program to run it in place
+bool load_bytecode(unsigned char* data, size_t data_size, bytecode& program, std::string& error);
+
+// how many values an instruction leaves on the stack minus how many it takes
+int stack_effect(int opcode);
+
+bool valid_address(const bytecode& program, int addr);
+
+bool is_jump(int opcode);
+
+// JUMP_IF_TRUE, JUMP_IF_FALSE and the superinstructions that end with one
+bool is_conditional_jump(int opcode);
+
+// Replaces the sequences from superinstruction_sequences in the program with their superinstructions,
+// unless a jump lands inside of one. Returns how many were replaced
+int fuse_superinstructions(bytecode& program);
+
+// how many values an instruction takes from the stack
+int stack_inputs(int opcode);
+
+// A function of a program: ENTER args at entry up to the next function or the end of the program
+struct function_info {
+    int entry, end;
+    int args, results;
+    // most stack entries above the frame start the function uses, counting its arguments
+    int frame_size;
+};
+
+// the functions of a program in ip order, empty when it has none. Also works on fused programs
+std::vector<function_info> find_functions(const bytecode& program);
+
+// index of the function whose ENTER is at ip, -1 if there is none
+int function_at(const std::vector<function_info>& functions, int ip);
+
+// Checks a program as it comes from the assembler, before fuse_superinstructions(): every
+// opcode is known and fits into the program, jumps land on instruction starts, the stack depth
+// before an instruction is the same on every path, never below what the instruction takes
+// and never above program.stack_size, constant addresses are inside memory and execution can't run
+// past the end. For functions the depth counts from the start of the frame: jumps stay inside the
+// function, CALL goes to an ENTER, RET only appears in functions and always returns the same number
+// of values, LOADL and STOREL stay inside the frame and the main program doesn't run into a function.
+// SPAWN starts workers in the main program, where their code is checked from a depth of one.
+// The engines skip all of these checks on verified programs; only addresses computed at runtime
+// (LOAD, STORE, the bulk memory and atomic instructions), how deep calls nest and the ids JOIN gets
+// are still checked, or caught by the guard pages.
+bool verify_program(const bytecode& program, std::string& error);
+
+// whether the addresses that verify_program() and fuse_superinstructions() checked against
+// program.memory_size are below memory_size as well, for a program that runs on fewer cells. The
+// first one that isn't goes to error
+bool fits_memory(const bytecode& program, int memory_size, std::string& error);
+
+// PRINT for compiled code
+void print_int(vm_output* output, int n);
+
+// what asm --map writes next to a program: the source line of every instruction, the labels and the
+// first instructions of basic blocks, by ip
+struct source_map {
+    std::string source;
+    std::map<int, int> lines;
+    std::multimap<int, std::string> labels;
+    std::set<int> blocks;
+};
+
+// false if there is no map at path or it is in another format
+bool load_source_map(const std::string& path, source_map& map);
+
+// What VM::run_profiled() records, indexed by ip
+struct vm_profile {
+    // how often the instruction at ip ran
+    std::vector<uint64_t> counts;
+    // how often the conditional jump at ip was taken
+    std::vector<uint64_t> taken;
+    // cycles from the start of the instruction at ip to the start of the next one, when measured
+    std::vector<uint64_t> cycles;
+    bool has_cycles = false;
+};
+
+// Totals, opcodes by how often they ran, then every instruction that ran in program order with
+// its source line, the labels in front of it and its basic block when there is a map
+void write_profile(std::ostream& out, const bytecode& program, const vm_profile& profile, const source_map* map);
+
+// Name of the code compiled for [ip_start, ip_end) of program, as perf shows it: the label at
+// ip_start and the source line when there is a map, the ips otherwise
+// kind is main, loop or function
+std::string jit_symbol(const std::string& program, const source_map* map, int ip_start, int ip_end, const std::string& kind);
+
+// Adds code of size bytes at start to /tmp/perf-<pid>.map, where perf looks up JIT code that isn't
+// in any binary. Safe to call from several VMs at once
+void write_perf_map(const void* start, size_t size, const std::string& symbol);
+
+// why compiled code ended the program inside a function, where it can't leave to the interpreter
+enum jit_stop_reason {
+    STOP_DONE,
+    STOP_ABORT,
+    STOP_ZERO_DIVISION,
+    STOP_BAD_ADDRESS,
+    STOP_CALL_DEPTH,
+    STOP_BAD_NATIVE,
+    STOP_DIVISION_OVERFLOW
+};
+
+class VM;
+
+struct vm_native {
+    std::string name;
+    vm_native_function function;
+    void* data;
+};
+
+// What compiled functions share with their VM
+struct jit_runtime {
+    // set once compiled code ended the program, every compiled caller returns right away
+    int stopped = 0;
+    // calls in progress, interpreted and compiled
+    int call_depth = 0;
+    // set by DONE, the only way a worker ends without failing; workers end without a message
+    int done = 0;
+    bool is_worker = false;
+    // for SPAWN and JOIN
+    VM* vm = nullptr;
+    vm_output* output = nullptr;
+    std::ostream** err = nullptr;
+    std::vector<function_info> functions;
+    // by index into functions, all created before code that calls one of them is built
+    std::vector<jit_function_t> code;
+    // what NATIVE calls, by index, and what POP_RES popped during the run
+    std::vector<vm_native> natives;
+    std::vector<int> results;
+};
+
+// reports the end of the program the way the interpreter does and sets runtime->stopped.
+// value is the bad address for STOP_BAD_ADDRESS and the index for STOP_BAD_NATIVE
+void stop_program(jit_runtime* runtime, int reason, int value);
+
+// FILL, COPY, the SCANs and the atomics for compiled code: the result of a SCAN or the old value of an
+// atomic, 0 for the others and INT64_MIN for a bad address, which they only report when they get a runtime
+int64_t jit_fill(jit_runtime* runtime, int* memory, int memory_size, int addr, int count, int stride, int value);
+int64_t jit_copy(jit_runtime* runtime, int* memory, int memory_size, int dst, int src, int count);
+int64_t jit_scan(jit_runtime* runtime, int* memory, int memory_size, int addr, int end, int zero);
+int64_t jit_atomic_add(jit_runtime* runtime, int* memory, int memory_size, int addr, int value);
+int64_t jit_cas(jit_runtime* runtime, int* memory, int memory_size, int addr, int expected, int desired);
+
+// SPAWN, JOIN and POP_RES for compiled code, with the signature of the helpers above so that they are
+// called the same way. They always get a runtime and report errors themselves: INT64_MIN for a JOIN that
+// ended the program, the worker's id or result otherwise, 0 for POP_RES
+int64_t jit_spawn(jit_runtime* runtime, int* memory, int memory_size, int entry, int value);
+int64_t jit_join(jit_runtime* runtime, int* memory, int memory_size, int id);
+int64_t jit_pop_res(jit_runtime* runtime, int* memory, int memory_size, int value);
+
+// Compiles the instructions in [ip_start, ip_end), entered at ip_start with entry_depth values on VM::stack.
+// The compiled code returns the ip at which the interpreter has to continue: the target of a jump
+// out of the range, the end of the range, or an instruction it leaves to the interpreter
+// (DONE, ABORT, division by zero, RET, and CALL without a runtime). frame_base is where LOADL and
+// STOREL count from. With fuel, every backward jump takes a unit of it and one that finds none
+// leaves to the interpreter at its target with *fuel below zero, see VM::set_fuel(). NATIVE calls
+// the host functions of natives directly. Addresses are checked with check_addresses, otherwise the
+// guard pages catch bad ones.
+// A range that starts with ENTER is a function instead: it takes its arguments as native ones,
+// returns its result and calls other functions natively through runtime. It can't leave to the
+// interpreter, so it reports the end of the program itself and returns with runtime->stopped set.
+// The range goes through the IR of jit_ir.h on the way, where loops are optimised, see build()
+class jit_compiled_func : public jit_function
+{
+public:
+    explicit jit_compiled_func(jit_context& context, const bytecode& program, bool is_void, int num_args, int ip_start, int ip_end, int entry_depth, int* memory, int* stack, int* stack_size, vm_output* output,
+                               jit_runtime* runtime = nullptr, int frame_base = 0, int64_t* fuel = nullptr,
+                               const std::vector<vm_native>* natives = nullptr, bool check_addresses = true);
+
+    // whether build() can handle the range, i.e. the stack depth is known everywhere
+    bool analyze() {
+        std::vector<int> depths;
+        return ir_stack_depths(source(), depths);
+    }
+
+    // build and compile right away instead of on the first call. The IR goes to dump if there is one
+    void compile_now(const ir_options& options = {}, std::ostream* dump = nullptr);
+
+    int get_entry_depth() const {
+        return entry_depth;
+    }
+
+    int get_ip_start() const {
+        return ip_start;
+    }
+
+    int get_ip_end() const {
+        return ip_end;
+    }
+
+    bool compiles_function() const {
+        return is_function;
+    }
+
+    // libjit doesn't tell how big the compiled code is. It is contiguous, so look for where
+    // jit_function_from_pc() stops finding this function
+    size_t code_size();
+
+    void build() override;
+
+    ir_source source() const {
+        return {&program, runtime_outer ? &runtime_outer->functions : nullptr, ip_start, ip_end, entry_depth,
+                frame_base, is_function, is_void, check_addresses, fuel_outer != nullptr, program.memory_size};
+    }
+
+    // Registers written once are the libjit values of their instruction, the others are locals,
+    // as are the results of LOADs with a slow path. Exits are emitted after the blocks
+    void lower();
+
+    jit_value read(ir_value value) {
+        return value.is_constant() ? new_constant(value.constant) : values[value.reg];
+    }
+
+    void write(int reg, const jit_value& value);
+
+    jit_label& exit_label(int exit) {
+        exits_taken[exit] = true;
+        return exit_labels[exit];
+    }
+
+    // next is the block laid out after this one, jumps to it fall through
+    void lower(const ir_insn& insn, int next);
+
+    // whether addr is between the lowest and the highest of cells
+    jit_value hits(const jit_value& addr, const std::vector<ir_cell>& cells);
+
+    // writes promoted cells back to memory
+    void spill(const std::vector<ir_cell>& cells) {
+        for (auto cell : cells) {
+            insn_store_elem(memory, new_constant(cell.cell), values[cell.reg]);
+        }
+    }
+
+    // Calls function insn.arg natively with the arguments in insn.in
+    jit_value call(const ir_insn& insn, int flags);
+
+    // Writes the promoted cells back and leaves: to the interpreter with the stack written back to
+    // VM::stack, or from a function that ends the program. Callers of a function that ended the
+    // program return as well
+    void leave(const ir_exit& exit);
+
+    // Calls the helper for FILL, COPY, a SCAN or an atomic. A bad address leaves to the interpreter, which
+    // runs the instruction again and reports it, or ends a function after the helper reported it. SPAWN,
+    // JOIN and POP_RES go through helpers of the same kind, which always report
+    void bulk_memory(const ir_insn& insn);
+
+    // Calls the host function of a NATIVE the way PRINT calls print_int(). There is none to call for an
+    // index the VM doesn't know: a function reports that, other code leaves to the interpreter, which does
+    void native(const ir_insn& insn);
+
+    // reports the end of the program from a function and returns
+    void stop(jit_stop_reason reason, const jit_value& value);
+
+    // what a function returns once the program ended; nobody looks at the result
+    void return_stopped();
+
+protected:
+    jit_type_t create_signature() override;
+
+private:
+    bytecode program;
+    int num_args, ip_start, ip_end, entry_depth, frame_base;
+    bool is_void, is_function, check_addresses;
+    int* memory_outer;
+    int* stack_outer;
+    int* stack_size_ptr_outer;
+    vm_output* output_outer;
+    jit_runtime* runtime_outer;
+    int64_t* fuel_outer;
+    const std::vector<vm_native>* natives_outer;
+    ir_options options;
+    std::ostream* dump = nullptr;
+    jit_value memory, stack, stack_size_ptr, output, runtime, stopped_ptr, call_depth_ptr, fuel_ptr;
+    // lower() state: what build_ir() made, the libjit value of every register and whether it is a local
+    ir_function ir;
+    std::vector<jit_value> values;
+    std::vector<bool> locals;
+    std::vector<jit_label> block_labels, exit_labels;
+    std::vector<bool> exits_taken;
+};
+
+// Memory of a VM: a private mapping of a memfd that holds the snapshot. Writes during a run go to
+// private copies of the pages, so reset() only has to drop those, and the cells stay at the same
+// address for the compiled code. Pages are only committed when they are touched
+class vm_memory {
+public:
+    // size zeroed cells, null if the system has no memory for them, with the reason in error
+    static std::unique_ptr<vm_memory> create(int size, std::string& error) {
+        std::unique_ptr<vm_memory> memory(new vm_memory(size));
+        return memory->map(error) ? std::move(memory) : nullptr;
+    }
+
+    vm_memory(const vm_memory&) = delete;
+    vm_memory& operator=(const vm_memory&) = delete;
+
+    ~vm_memory();
+
+    // the current contents become what reset() goes back to
+    bool snapshot(std::string& error);
+
+    // back to the snapshot; only the pages written since then are touched
+    void reset() {
+        madvise(cells, bytes, MADV_DONTNEED);
+    }
+
+    // zeroes the snapshot and the cells
+    bool clear(std::string& error);
+
+    // the cell that address belongs to, if it is in the reservation
+    bool fault_cell(const void* address, long& cell) const;
+
+    int* cells = nullptr;
+    const int size;
+    // in a reservation with guard pages, a bad address faults instead of needing a check
+    const bool guarded;
+
+private:
+    explicit vm_memory(int size) : size(size), guarded(guard_pages_enabled()), bytes((size_t) size * sizeof(int)) {}
+
+    bool map(std::string& error);
+
+    static bool fail(const char* what, std::string& error) {
+        error = std::string(what) + ": " + strerror(errno);
+        return false;
+    }
+
+    // SIGSEGV is taken over while there is memory with guard pages, and given back after the last
+    static void acquire_fault_handler();
+    static void release_fault_handler();
+
+    size_t bytes;
+    int fd = -1;
+    void* reservation = nullptr;
+    size_t reservation_bytes = 0;
+};
+
+// the run of VM::run_guarded() on this thread, where a fault in the guard pages jumps back to
+struct guarded_run {
+    const vm_memory* memory;
+    sigjmp_buf jump;
+    long bad_cell;
+};
+
+extern thread_local guarded_run* current_run;
+
+// instruction of the threaded interpreter: address of its handler in run_threaded() and its argument
+struct threaded_insn {
+    const void* handler;
+    // arg2 is the second argument of superinstructions
+    int arg, arg2;
+};
+
+// what CALL saves and RET goes back to: the ip after the CALL, or the index for the threaded
+// interpreter, and the frame of the caller
+struct call_frame {
+    int return_to;
+    int fp;
+};
+
+// a call in progress in the register interpreter: the caller, the instruction after its CALL and
+// where the caller's registers start
+struct reg_frame {
+    const reg_function* function;
+    const reg_insn* return_to;
+    int base;
+};
+
+// A worker started by SPAWN: where it starts, its argument and its fuel, -1 unless the VM that started
+// it is metered, and once it ended what JOIN pushes and passes on to the VM that joins it
+struct vm_worker {
+    vm_worker(int entry, int arg, int64_t fuel) : entry(entry), arg(arg), fuel(fuel) {}
+
+    int entry, arg;
+    int64_t fuel;
+    // set under vm_threads::lock
+    bool finished = false;
+    // ended with an error instead of DONE
+    bool failed = false;
+    int result = 0;
+    std::string output, errors;
+};
+
+// The threads of a VM, created on its first SPAWN and shared with every worker it starts and the ones
+// those start: a thread per core that runs queued workers, and the worker VMs that aren't running one,
+// which keep what they compiled for the next worker. A thread that waits in JOIN runs queued workers
+// itself meanwhile, so a worker waiting for another one never waits for a free thread
+class vm_threads {
+public:
+    explicit vm_threads(const VM& vm);
+
+    vm_threads(const vm_threads&) = delete;
+    vm_threads& operator=(const vm_threads&) = delete;
+
+    ~vm_threads();
+
+    void start(std::shared_ptr<vm_worker> worker);
+
+    // runs queued workers until worker finished
+    void wait(const vm_worker& worker);
+
+private:
+    void work();
+
+    // on a worker VM, which comes back to idle afterwards
+    void run(vm_worker& worker);
+
+    // whose program and memory the workers share
+    const VM& vm;
+    std::mutex lock;
+    std::condition_variable changed;
+    std::deque<std::shared_ptr<vm_worker>> queue;
+    std::vector<std::unique_ptr<VM>> idle;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+};
+
+// Green threads: runs any number of VMs on a fixed set of threads, each VM for a slice of fuel at a
+// time, see VM::set_fuel(), after which it goes to the back of the queue if it was suspended. A VM
+// runs on one thread at a time, but any of them may run its next slice. One that ran into an endless
+// loop only ever takes its slices, the others go on around it
+class vm_scheduler {
+public:
+    // on_end is called on a scheduler thread with every VM that ended, and may return another one
+    // to run in its place, so that only as many VMs as run at once need to exist
+    using end_function = std::function<VM*(VM& vm)>;
+
+    vm_scheduler(unsigned threads_count, int64_t slice, end_function on_end = nullptr);
+
+    vm_scheduler(const vm_scheduler&) = delete;
+    vm_scheduler& operator=(const vm_scheduler&) = delete;
+
+    // waits for the VMs added
+    ~vm_scheduler();
+
+    // vm starts at the entry of its program on its first slice, or goes on if it is suspended. It has
+    // to stay around until it ended
+    void add(VM& vm);
+
+    // until every VM added ended
+    void wait();
+
+    // slices run so far
+    uint64_t slices() const;
+
+private:
+    void work();
+
+    int64_t slice;
+    end_function on_end;
+    mutable std::mutex lock;
+    // the queue got a VM, running came down to 0
+    std::condition_variable changed, ended;
+    std::deque<VM*> queue;
+    // VMs added that didn't end yet
+    size_t running = 0;
+    uint64_t slices_run = 0;
+    std::vector<std::thread> threads;
+    bool stopping = false;
+};
+
+class VM {
+public:
+    // runs nothing until a load() that succeeds
+    VM();
+
+    VM(const VM&) = delete;
+    VM& operator=(const VM&) = delete;
+
+    ~VM() {
+        own_threads.reset();
+        free_stack();
+    }
+
+    // Switches to another program, which has to pass verify_program(), dropping the code compiled for
+    // the old one. False if the system has no memory or stack for it, with the reason in error; the VM
+    // then has no program until the next load()
+    bool load(const bytecode& new_program, std::string& error);
+
+    // makes the current memory and stack what reset() goes back to, only the stack with bound memory
+    bool snapshot(std::string& error);
+
+    // Goes back to the last snapshot, zeroed memory and an empty stack if there is none, for the next
+    // run. Only the pages written since then are touched; compiled code is kept
+    void reset();
+
+    // Runs the program on size cells that the caller owns from now on, in place of memory of the VM's
+    // own; nothing is copied and the caller keeps them alive as long as the VM runs on them. There are
+    // no guard pages around them, so every access is checked, and snapshot() and reset() leave them to
+    // the caller. The program sees size cells, a program verified for more has to fit into them. The
+    // next load() goes back to memory of the VM's own. Drops the code compiled so far, which points to
+    // the old memory
+    bool bind_memory(int* cells, int size, std::string& error);
+
+    // Makes function what NATIVE calls with the next index, counting from 0, and returns that index.
+    // data goes to every call. Drops the code compiled so far, which only knows the functions there were
+    int add_native(const std::string& name, vm_native_function function, void* data = nullptr) {
+        drop_compiled();
+        runtime.natives.push_back({name, function, data});
+        return (int) runtime.natives.size() - 1;
+    }
+
+    // what POP_RES popped during the last run, in order; what workers pop is dropped
+    const std::vector<int>& get_results() const {
+        return runtime.results;
+    }
+
+    // where PRINT and DONE write to and where errors are reported
+    void set_output(std::ostream& output_stream, std::ostream& errors) {
+        output.to_stream(output_stream);
+        err = &errors;
+    }
+
+    // PRINT and DONE output, for the other destinations and binary output
+    vm_output& get_output() {
+        return output;
+    }
+
+    // hot_loop_threshold == 0 turns off compiling of hot loops
+    void set_hot_loop_threshold(unsigned threshold) {
+        hot_loop_threshold = threshold;
+    }
+
+    // how the JIT optimises the code it compiles from now on, and where it writes the IR of that code, if
+    // anywhere
+    void set_jit_options(const ir_options& options, std::ostream* ir_dump = nullptr) {
+        jit_options = options;
+        this->ir_dump = ir_dump;
+    }
+
+    // Writes everything compiled from now on to the perf map, named after program and the labels
+    // and lines in map, which may be null. Has to be called again after load()ing another program
+    void set_perf_map(const std::string& program, const source_map* map) {
+        perf_map = true;
+        program_name = program;
+        symbols = map;
+    }
+
+    // loops that were hot in an earlier run get compiled on their first backward jump
+    void add_hot_loops(const std::vector<hot_loop>& loops);
+
+    // loops compiled so far, ordered by header
+    std::vector<hot_loop> hot_loops() const;
+
+    void run();
+
+    // Meters run() and resume() from now on, with units of fuel left: every backward jump and every CALL
+    // takes one, and a run that finds none left is suspended there, see resume(). Compiled loops take fuel
+    // the same way, functions aren't compiled any more so that a run can be suspended in any of them.
+    // The other ways of running only take fuel in what they leave to the interpreter. Workers started by
+    // SPAWN get the fuel left at that point, and fail once they run out since nobody resumes them
+    void set_fuel(int64_t units);
+
+    int64_t get_fuel() const {
+        return fuel;
+    }
+
+    // whether the last run ran out of fuel; its ip, stack and calls in progress stay as they were
+    bool is_suspended() const {
+        return suspended;
+    }
+
+    // goes on with a suspended run, usually after set_fuel() gave it more
+    void resume();
+
+    // Interprets the program once, without compiling hot loops, and records how often each instruction
+    // runs and each conditional jump is taken; with cycles also how long each instruction takes
+    vm_profile run_profiled(bool cycles);
+
+    // how many instructions of the unfused program run
+    uint64_t count_instructions();
+
+    // How many instructions of the register code run, see run_registers(). What it leaves to the
+    // interpreter, like the DONE at the end, isn't counted
+    uint64_t count_register_instructions();
+
+    // time spent compiling, the whole program for jit_run() and hot loops for run(), and translating
+    // for run_registers()
+    double get_compile_seconds() const {
+        return compile_seconds;
+    }
+
+    void run_threaded();
+
+    // interprets from ip on
+    void run(size_t ip);
+
+    // PROFILE records every instruction in *profile, see run_profiled()
+    template<typename F, bool PROFILE = false>
+    void run_code(size_t ip);
+
+    // compiles the whole program up front, every function on its own; DONE, ABORT and errors
+    // outside of functions are left to the interpreter
+    void jit_run();
+
+    // Same semantics as run(), on register code instead of the bytecode: the program is translated once
+    // into the IR of the JIT, optimised the same way and laid out flat by build_reg_code(), the code
+    // before the first function and every function on its own. What the JIT leaves to the interpreter
+    // is left to it here as well
+    void run_registers();
+
+#if HAVE_THREADED_DISPATCH
+    // Same semantics as run(), with one indirect branch per handler instead of a shared switch.
+    // The program is decoded once into threaded_code: label marks are dropped and jump and call
+    // arguments become indexes into threaded_code. No compiling of hot loops or functions here
+    void run_threaded_code();
+#else
+    void run_threaded_code() {
+        run(program.entry);
+    }
+#endif
+
+private:
+    friend class jit_compiled_func;
+    friend class vm_threads;
+    friend int64_t jit_spawn(jit_runtime*, int*, int, int, int);
+    friend int64_t jit_join(jit_runtime*, int*, int, int);
+
+    // A worker of root, see vm_threads: the same program and memory, with a stack, output and compiled
+    // code of its own. It only runs the interpreter, which compiles hot loops and functions as usual
+    VM(const VM& root, vm_threads& threads);
+
+    // drops the compiled code and the worker VMs, which run the program on this memory with these natives
+    void drop_compiled();
+
+    // program.stack_size entries, unless the stack has that size already
+    bool allocate_stack(std::string& error);
+
+    // after a load() that failed: no program, memory or stack
+    bool unload();
+
+    // runs worker on this thread, with its output and errors kept in it for JOIN
+    void run_worker(vm_worker& worker);
+
+    // SPAWN: starts a worker at entry with value on its stack and returns its id, which counts from 1
+    int spawn(int entry, int value);
+
+    // JOIN: waits for worker id and passes on what it wrote. False if there is no such worker or it
+    // failed, which ends the program
+    bool join(int id, int& result);
+
+    // the end of a run waits for the workers nobody joined, in the order they were started
+    void join_all();
+
+    // header is the target of a backward jump that ends at loop_end. Counts how often the loop
+    // runs and once it is hot compiles [header, loop_end) and continues in the compiled code.
+    // Returns the ip at which to continue interpreting, SUSPENDED if the run ran out of fuel
+    size_t on_backedge(size_t header, size_t loop_end);
+
+    // takes a unit of fuel before going on at ip, or suspends the run there if there is none left
+    bool take_fuel(size_t ip);
+
+    void suspend(size_t ip) {
+        suspended = true;
+        resume_ip = ip;
+    }
+
+    // the register code of [ip_start, ip_end), function if the range is one
+    reg_function translate_registers(int ip_start, int ip_end, const function_info* function);
+
+    // fills register_code, the main code last, unless that is done already
+    void translate_registers();
+
+    // Copies the frame of function to base and its arguments into its inputs, args being the operands of
+    // the call in the registers from. False if that is a call too deep, which ends the program
+    bool enter_registers(const reg_function& function, int base, const int* args, int from);
+
+    void spill_registers(const std::vector<ir_cell>& cells, const int* r) {
+        for (auto cell : cells) {
+            memory[cell.cell] = r[cell.reg];
+        }
+    }
+
+    // Leaves the register code through exit of function, whose registers start at base: returns the ip
+    // at which the interpreter goes on, or -1 if the program ended, after every caller left through the
+    // exit of its CALL
+    int leave_registers(const reg_function* function, int exit, int base);
+
+    int unwind_registers();
+
+    // Runs the register code of the program, see run_registers(). Calls stay in this loop, with the
+    // registers of the callee right after the ones of its caller. Returns the ip at which the interpreter
+    // goes on with the stack written back, or -1 once the program ended
+    template<bool counted>
+    int run_register_code();
+
+#if HAVE_THREADED_DISPATCH
+    // fills threaded_code from the program; the abort handler also guards the end of the program
+    bool decode_threaded(const void* const* handlers, int handlers_count, const void* end_handler);
+#endif
+
+    // accounts for the instruction that ran before the one at ip
+    void profile_instruction(size_t ip);
+
+    void compile(jit_compiled_func& func);
+
+    // every function gets its jit_function before the first one is built, so that calls between
+    // them are direct
+    void create_functions();
+
+    // compiles function index and every function it calls, unless that is done already
+    jit_compiled_func& compile_function(int index);
+
+    // whether the calls nest and the callee's frame fits on the stack, which has its arguments
+    // on top; reports why not
+    bool can_call(const function_info& function);
+
+    // CALL target with ip after it: runs the compiled function once it is hot, otherwise pushes a
+    // frame and continues at target. False if the program ended or the run was suspended, in the callee
+    bool call_function(int target, size_t& ip);
+
+    // runs function index compiled, its arguments on top of the stack are replaced by its result
+    bool call_compiled(int index);
+
+    // FILL, COPY, a SCAN or an atomic with the operands below top; a SCAN or an atomic leaves its result in
+    // place of the first. Reports a bad address and returns false
+    bool bulk_memory(int opcode, int* top);
+
+    // NATIVE: replaces value with what host function index returns for it. Reports an index there is no
+    // function for and returns false
+    bool call_native(int index, int& value);
+
+    void store_to_memory(int addr, int value) {
+        memory[addr] = value;
+    }
+
+    // always true with guard pages, a bad address faults instead
+    bool in_memory(int addr) const {
+        return memory_guarded || (unsigned) addr < (unsigned) program.memory_size;
+    }
+
+    // whether compiled code has to check addresses
+    bool checks_addresses() const {
+        return !memory_guarded;
+    }
+
+    // calls run, reporting an access to the guard pages as a bad memory access that ends the run.
+    // The output goes out at the end, the workers are waited for unless the run was suspended
+    template<typename Run>
+    void run_guarded(Run run, bool resuming = false);
+
+    void free_stack();
+
+    int stack_pop() {
+        return stack[--stack_size];
+    }
+
+    bytecode program;
+    jit_context context;
+    std::unique_ptr<jit_compiled_func> main_func;
+    unsigned hot_loop_threshold = DEFAULT_HOT_LOOP_THRESHOLD;
+    ir_options jit_options;
+    std::ostream* ir_dump = nullptr;
+    double compile_seconds = 0;
+    // set_perf_map() state
+    bool perf_map = false;
+    std::string program_name;
+    const source_map* symbols = nullptr;
+    // run_profiled() state: where to record, the instruction before and when it started
+    vm_profile* profile = nullptr;
+    int profiled_ip = -1;
+    uint64_t profiled_cycles = 0;
+    // indexed by the ip of a loop header or the ENTER of a function
+    std::vector<unsigned> backedge_counters;
+    // loop header -> compiled loop, nullptr if the loop can't be compiled
+    std::unordered_map<size_t, std::unique_ptr<jit_compiled_func>> compiled_loops;
+#if HAVE_THREADED_DISPATCH
+    std::vector<threaded_insn> threaded_code;
+    int threaded_entry = 0;
+#endif
+    // the functions of the program and what their compiled code shares with the VM
+    jit_runtime runtime;
+    // by function index, created on the first compile of any of them
+    std::vector<std::unique_ptr<jit_compiled_func>> compiled_functions;
+    std::vector<bool> function_compiled;
+    // SPAWN and JOIN state: the VM whose program and memory a worker runs on, null for that VM itself, its
+    // threads, and the workers this VM started by id - 1, null once they are joined
+    const VM* root = nullptr;
+    std::unique_ptr<vm_threads> own_threads;
+    vm_threads* threads = nullptr;
+    std::vector<std::shared_ptr<vm_worker>> workers;
+    // set_fuel() state: whether runs are metered, the fuel left, and where a suspended run goes on
+    static const size_t SUSPENDED = ~(size_t) 0;
+    bool metered = false;
+    int64_t fuel = 0;
+    bool suspended = false;
+    size_t resume_ip = 0;
+    // calls in progress in the interpreters and the start of the current frame on the stack
+    std::vector<call_frame> frames;
+    int fp = 0;
+    // run_registers() state: the code of every function and then of the main code, the registers of
+    // the calls in progress and the calls themselves. register_count is for count_register_instructions()
+    std::vector<reg_function> register_code;
+    std::vector<int> registers;
+    std::vector<reg_frame> register_frames;
+    uint64_t register_count = 0;
+    vm_output output;
+    std::ostream* err = &std::cerr;
+    // program.stack_size entries
+    int* stack = nullptr;
+    int stack_capacity = 0;
+    // memory_area->cells, or the cells of bind_memory(), with memory_area null
+    int* memory = nullptr;
+    std::unique_ptr<vm_memory> memory_area;
+    // memory_area has guard pages, false for bound memory
+    bool memory_guarded = false;
+    std::vector<int> snapshot_stack;
+    int stack_size = 0;
+};
+
+// a .pvm file mapped into memory, checked and ready to run
+struct program_file {
+    std::string path;
+    int fd = -1;
+    unsigned char* data = nullptr;
+    size_t size = 0;
+    bytecode program = {};
+    // cache_path is empty when the JIT cache is off
+    uint64_t cache_key = 0;
+    std::string cache_path;
+    jit_plan plan;
+    bool have_plan = false;
+    // from <path>.map, when the assembler wrote one
+    source_map map;
+    bool have_map = false;
+};
+
+struct program_options {
+    bool fuse = true;
+    bool use_cache = true;
+    // 0 keeps the sizes from the file
+    uint32_t memory_size = 0, stack_size = 0;
+};
+
+// maps, loads, verifies and fuses the program; the code is read only afterwards, so that any
+// number of VMs can share the mapping
+bool open_program(const char* path, const program_options& options, program_file& file);
+
+// a program loaded by load_program(), with a copy of the code of its own. program.code points into data,
+// so it can be moved but not copied
+struct program_buffer {
+    program_buffer() = default;
+    program_buffer(program_buffer&&) = default;
+    program_buffer& operator=(program_buffer&&) = default;
+
+    std::vector<unsigned char> data;
+    bytecode program = {};
+};
+
+// open_program() for size bytes of a .pvm file at data, which the caller may free afterwards, without
+// the JIT cache and the source map. What is wrong with the program goes to error
+bool load_program(const void* data, size_t size, const program_options& options, program_buffer& buffer,
+                  std::string& error);
+
+bool close_program(program_file& file);
+
+// stores the loops vm compiled as the program's plan, unless the plan already has them
+void update_jit_plan(program_file& file, const VM& vm);
+
+void run_vm(VM& vm, run_mode mode);
+
+#endif //VM_H
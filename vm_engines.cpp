@@ -0,0 +1,1571 @@
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <csetjmp>
+#include <cstring>
+#include <limits>
+#include <sstream>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "vm.h"
+
+using namespace std;
+
+// rdtsc where there is one, nanoseconds elsewhere
+static uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+VM::VM() : context() {
+    runtime.output = &output;
+    output.to_stream(cout);
+    runtime.err = &err;
+    runtime.vm = this;
+}
+
+bool VM::load(const bytecode& new_program, string& error) {
+    // the worker VMs run the old one
+    drop_compiled();
+    program = new_program;
+    suspended = false;
+    backedge_counters.assign(program.size, 0);
+    runtime.functions = find_functions(program);
+#if HAVE_THREADED_DISPATCH
+    threaded_code.clear();
+#endif
+    // the snapshot of the old program goes, the new one starts from zeroed memory of the VM's own
+    snapshot_stack.clear();
+    if (memory_area && memory_area->size == program.memory_size) {
+        if (!memory_area->clear(error)) {
+            return unload();
+        }
+    } else {
+        memory_area.reset();
+        memory_area = vm_memory::create(program.memory_size, error);
+        if (!memory_area) {
+            return unload();
+        }
+    }
+    memory = memory_area->cells;
+    memory_guarded = memory_area->guarded;
+    if (!allocate_stack(error)) {
+        return unload();
+    }
+    reset();
+    return true;
+}
+
+bool VM::snapshot(string& error) {
+    if (memory_area && !memory_area->snapshot(error)) {
+        return false;
+    }
+    snapshot_stack.assign(stack, stack + stack_size);
+    return true;
+}
+
+void VM::reset() {
+    if (memory_area) {
+        memory_area->reset();
+    }
+    copy(snapshot_stack.begin(), snapshot_stack.end(), stack);
+    stack_size = (int) snapshot_stack.size();
+}
+
+bool VM::bind_memory(int* cells, int size, string& error) {
+    if (size < 0) {
+        error = "memory of " + to_string(size) + " cells";
+        return false;
+    }
+    if (size < program.memory_size && !fits_memory(program, size, error)) {
+        return false;
+    }
+    drop_compiled();
+    program.memory_size = size;
+    memory_area.reset();
+    memory = cells;
+    memory_guarded = false;
+    return true;
+}
+
+void VM::add_hot_loops(const vector<hot_loop>& loops) {
+    for (auto& loop : loops) {
+        if (loop.header >= 0 && loop.header < program.size) {
+            backedge_counters[loop.header] = ~0u;
+        }
+    }
+}
+
+vector<hot_loop> VM::hot_loops() const {
+    vector<hot_loop> loops;
+    for (auto& [header, func] : compiled_loops) {
+        if (func) {
+            loops.push_back({(int32_t) header, func->get_ip_end(), func->get_entry_depth()});
+        }
+    }
+    sort(loops.begin(), loops.end(), [](const hot_loop& a, const hot_loop& b) {
+        return a.header < b.header;
+    });
+    return loops;
+}
+
+void VM::run() {
+    run_guarded([this] { run(program.entry); });
+}
+
+void VM::set_fuel(int64_t units) {
+    if (!metered) {
+        // the loops compiled so far don't take any
+        compiled_loops.clear();
+        metered = true;
+    }
+    fuel = max<int64_t>(units, 0);
+}
+
+void VM::resume() {
+    if (suspended) {
+        run_guarded([this] { run(resume_ip); }, true);
+    }
+}
+
+vm_profile VM::run_profiled(bool cycles) {
+    vm_profile result;
+    result.counts.assign(program.size, 0);
+    result.taken.assign(program.size, 0);
+    result.has_cycles = cycles;
+    if (cycles) {
+        result.cycles.assign(program.size, 0);
+    }
+    profile = &result;
+    profiled_ip = -1;
+    auto threshold = hot_loop_threshold;
+    hot_loop_threshold = 0;
+    profiled_cycles = read_cycles();
+    run_guarded([this] {
+        if (program.compact) {
+            run_code<byte_format, true>(program.entry);
+        } else {
+            run_code<word_format, true>(program.entry);
+        }
+    });
+    if (cycles && profiled_ip >= 0) {
+        result.cycles[profiled_ip] += read_cycles() - profiled_cycles;
+    }
+    hot_loop_threshold = threshold;
+    profile = nullptr;
+    return result;
+}
+
+uint64_t VM::count_instructions() {
+    auto counts = run_profiled(false).counts;
+    uint64_t count = 0;
+    for (int ip = 0; ip < program.size; ip++) {
+        auto opcode = program.opcode(ip);
+        if (counts[ip] && (program.compact || opcode != LABEL_MARK)) {
+            count += counts[ip] * instruction_count(opcode);
+        }
+    }
+    return count;
+}
+
+uint64_t VM::count_register_instructions() {
+    translate_registers();
+    stack_size = 0;
+    register_count = 0;
+    run_guarded([this] {
+        auto ip = run_register_code<true>();
+        if (ip >= 0 && !runtime.stopped) {
+            run(ip);
+        }
+    });
+    return register_count;
+}
+
+void VM::run_threaded() {
+    run_guarded([this] { run_threaded_code(); });
+}
+
+void VM::run(size_t ip) {
+    if (program.compact) {
+        run_code<byte_format>(ip);
+    } else {
+        run_code<word_format>(ip);
+    }
+}
+
+// continues at target; backward jumps go through on_backedge(), which may suspend the run
+#define JUMP_TO(target) do { \
+        if ((size_t) (target) >= ip) { \
+            ip = target; \
+        } else if ((ip = on_backedge(target, ip)) == SUSPENDED) { \
+            return; \
+        } \
+    } while (0)
+
+template<typename F, bool PROFILE>
+void VM::run_code(size_t ip) {
+    const unsigned char* code = program.code;
+    while (true) {
+        auto opcode = F::opcode(code, ip);
+        if (PROFILE) {
+            profile_instruction(ip);
+        }
+        ip++;
+        switch (opcode) {
+            case OP_JUMP: {
+                auto arg = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                JUMP_TO(arg);
+                break;
+            }
+            case OP_JUMP_IF_TRUE: {
+                auto arg = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                if (stack_pop()) {
+                    JUMP_TO(arg);
+                }
+                break;
+            }
+            case OP_JUMP_IF_FALSE: {
+                auto arg = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                if (!stack_pop()) {
+                    JUMP_TO(arg);
+                }
+                break;
+            }
+            case OP_LOADADDI: {
+                auto arg = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                stack[stack_size - 1] += memory[arg];
+                break;
+            }
+            case OP_LOADI: {
+                auto arg = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                stack[stack_size++] = memory[arg];
+                break;
+            }
+            case OP_PUSHI: {
+                auto arg = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                stack[stack_size++] = arg;
+                break;
+            }
+            case OP_DISCARD: {
+                stack_size--;
+                break;
+            }
+            case OP_STOREI: {
+                auto addr = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                store_to_memory(addr, stack_pop());
+                break;
+            }
+            case OP_LOAD: {
+                auto addr = stack_pop();
+                if (!in_memory(addr)) {
+                    *err << "BAD MEMORY ACCESS: " << addr << "\n";
+                    return;
+                }
+                stack[stack_size++] = memory[addr];
+                break;
+            }
+            case OP_STORE: {
+                auto val = stack_pop();
+                auto addr = stack_pop();
+                if (!in_memory(addr)) {
+                    *err << "BAD MEMORY ACCESS: " << addr << "\n";
+                    return;
+                }
+                store_to_memory(addr, val);
+                break;
+            }
+            case OP_ADDI: {
+                auto arg = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                stack[stack_size - 1] += arg;
+                break;
+            }
+            case OP_DUP: {
+                stack[stack_size] = stack[stack_size - 1];
+                stack_size++;
+                break;
+            }
+            case OP_SUB: {
+                auto arg = stack_pop();
+                stack[stack_size - 1] -= arg;
+                break;
+            }
+            case OP_ADD: {
+                auto arg = stack_pop();
+                stack[stack_size - 1] += arg;
+                break;
+            }
+            case OP_DIV: {
+                auto arg = stack_pop();
+                if (arg == 0) {
+                    *err << "ZERO DIVISION\n";
+                    return;
+                }
+                // the quotient doesn't fit, and x86 traps on it
+                if (arg == -1 && stack[stack_size - 1] == INT_MIN) {
+                    *err << "DIVISION OVERFLOW\n";
+                    return;
+                }
+                stack[stack_size - 1] /= arg;
+                break;
+            }
+            case OP_MUL: {
+                auto arg = stack_pop();
+                stack[stack_size - 1] *= arg;
+                break;
+            }
+            case OP_ABORT: {
+                *err << "OP_ABORT called\n";
+                return;
+            }
+            case OP_DONE: {
+                stop_program(&runtime, STOP_DONE, 0);
+                return;
+            }
+            case OP_PRINT: {
+                output.print(stack_pop());
+                break;
+            }
+            case OP_POP_RES: {
+                runtime.results.push_back(stack_pop());
+                break;
+            }
+            case OP_GREATER_OR_EQUALI: {
+                auto arg = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                stack[stack_size - 1] = stack[stack_size - 1] >= arg;
+                break;
+            }
+            case OP_GREATER_OR_EQUAL: {
+                auto arg = stack_pop();
+                stack[stack_size - 1] = stack[stack_size - 1] >= arg;
+                break;
+            }
+            case OP_GREATER: {
+                auto arg = stack_pop();
+                stack[stack_size - 1] = stack[stack_size - 1] > arg;
+                break;
+            }
+            case OP_LESS: {
+                auto arg = stack_pop();
+                stack[stack_size - 1] = stack[stack_size - 1] < arg;
+                break;
+            }
+            case OP_LESS_OR_EQUAL: {
+                auto arg = stack_pop();
+                stack[stack_size - 1] = stack[stack_size - 1] <= arg;
+                break;
+            }
+            case OP_EQUAL: {
+                auto arg = stack_pop();
+                stack[stack_size - 1] = stack[stack_size - 1] == arg;
+                break;
+            }
+            case OP_CALL: {
+                auto target = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                if (!call_function(target, ip)) {
+                    return;
+                }
+                break;
+            }
+            case OP_ENTER: {
+                auto args = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                fp = stack_size - args;
+                break;
+            }
+            case OP_RET: {
+                auto results = F::arg(code, ip);
+                copy(stack + stack_size - results, stack + stack_size, stack + fp);
+                stack_size = fp + results;
+                ip = frames.back().return_to;
+                fp = frames.back().fp;
+                frames.pop_back();
+                break;
+            }
+            case OP_LOADL: {
+                auto slot = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                stack[stack_size] = stack[fp + slot];
+                stack_size++;
+                break;
+            }
+            case OP_STOREL: {
+                auto slot = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                stack[fp + slot] = stack_pop();
+                break;
+            }
+            case OP_FILL:
+            case OP_COPY:
+            case OP_SCAN_ZERO:
+            case OP_SCAN_NONZERO:
+            case OP_ATOMIC_ADD:
+            case OP_CAS: {
+                if (!bulk_memory(opcode, stack + stack_size)) {
+                    return;
+                }
+                stack_size += stack_effect(opcode);
+                break;
+            }
+            case OP_SPAWN: {
+                auto entry = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                stack[stack_size - 1] = spawn(entry, stack[stack_size - 1]);
+                break;
+            }
+            case OP_JOIN: {
+                if (!join(stack[stack_size - 1], stack[stack_size - 1])) {
+                    return;
+                }
+                break;
+            }
+            case OP_NATIVE: {
+                auto index = F::arg(code, ip);
+                ip += F::ARG_SIZE;
+                if (!call_native(index, stack[stack_size - 1])) {
+                    return;
+                }
+                break;
+            }
+            case LABEL_MARK: {
+                // skip 0xbabe
+                ip += F::ARG_SIZE;
+                break;
+            }
+            // superinstructions: the rest of the replaced sequence is still in place after the opcode,
+            // ip points to the opcode of the second instruction
+            case OP_DUP_GREATER_OR_EQUALI_JUMP_IF_FALSE: {
+                auto arg = F::arg(code, ip + 1);
+                auto target = F::arg(code, ip + F::ARG_SIZE + 2);
+                ip += 2 * F::ARG_SIZE + 2;
+                if (!(stack[stack_size - 1] >= arg)) {
+                    JUMP_TO(target);
+                }
+                break;
+            }
+            case OP_DUP_GREATER_OR_EQUALI_JUMP_IF_TRUE: {
+                auto arg = F::arg(code, ip + 1);
+                auto target = F::arg(code, ip + F::ARG_SIZE + 2);
+                ip += 2 * F::ARG_SIZE + 2;
+                if (stack[stack_size - 1] >= arg) {
+                    JUMP_TO(target);
+                }
+                break;
+            }
+            case OP_DUP_PUSHI_STORE: {
+                auto arg = F::arg(code, ip + 1);
+                ip += F::ARG_SIZE + 2;
+                if (!in_memory(stack[stack_size - 1])) {
+                    *err << "BAD MEMORY ACCESS: " << stack[stack_size - 1] << "\n";
+                    return;
+                }
+                store_to_memory(stack[stack_size - 1], arg);
+                break;
+            }
+            case OP_DUP_LOAD: {
+                ip += 1;
+                if (!in_memory(stack[stack_size - 1])) {
+                    *err << "BAD MEMORY ACCESS: " << stack[stack_size - 1] << "\n";
+                    return;
+                }
+                stack[stack_size] = memory[stack[stack_size - 1]];
+                stack_size++;
+                break;
+            }
+            case OP_PUSHI_LOAD: {
+                auto addr = F::arg(code, ip);
+                ip += F::ARG_SIZE + 1;
+                stack[stack_size++] = memory[addr];
+                break;
+            }
+            case OP_LOADI_ADDI: {
+                auto addr = F::arg(code, ip);
+                auto arg = F::arg(code, ip + F::ARG_SIZE + 1);
+                ip += 2 * F::ARG_SIZE + 1;
+                stack[stack_size++] = memory[addr] + arg;
+                break;
+            }
+            case OP_LESS_JUMP_IF_FALSE: {
+                auto target = F::arg(code, ip + 1);
+                ip += F::ARG_SIZE + 1;
+                auto arg = stack_pop();
+                if (!(stack_pop() < arg)) {
+                    JUMP_TO(target);
+                }
+                break;
+            }
+            case OP_GREATER_JUMP_IF_FALSE: {
+                auto target = F::arg(code, ip + 1);
+                ip += F::ARG_SIZE + 1;
+                auto arg = stack_pop();
+                if (!(stack_pop() > arg)) {
+                    JUMP_TO(target);
+                }
+                break;
+            }
+        }
+    }
+}
+
+#undef JUMP_TO
+
+void VM::jit_run() {
+    if (!main_func) {
+        // code before the entry point is only reached by jumps, which leave to the interpreter
+        auto main_end = runtime.functions.empty() ? program.size : runtime.functions[0].entry;
+        create_functions();
+        main_func = make_unique<jit_compiled_func>(context, program, false, 0, program.entry, main_end, 0,
+                                                   &memory[0], &stack[0], &stack_size, &output, &runtime, 0,
+                                                   nullptr, &runtime.natives, checks_addresses());
+        compile(*main_func);
+        for (size_t i = 0; i < runtime.functions.size(); i++) {
+            compile_function(i);
+        }
+    }
+    stack_size = 0;
+    auto func_ptr = (int (*)())(main_func->closure());
+    run_guarded([&] {
+        auto ip = func_ptr();
+        if (!runtime.stopped) {
+            run(ip);
+        }
+    });
+}
+
+void VM::run_registers() {
+    translate_registers();
+    stack_size = 0;
+    run_guarded([this] {
+        auto ip = run_register_code<false>();
+        if (ip >= 0 && !runtime.stopped) {
+            run(ip);
+        }
+    });
+}
+
+#if HAVE_THREADED_DISPATCH
+
+void VM::run_threaded_code() {
+    static const void* const handlers[] = {
+            &&do_pushi, &&do_loadi, &&do_loadaddi, &&do_storei, &&do_load, &&do_store, &&do_dup,
+            &&do_discard, &&do_add, &&do_addi, &&do_sub, &&do_div, &&do_mul, &&do_jump,
+            &&do_jump_if_true, &&do_jump_if_false, &&do_equal, &&do_less, &&do_less_or_equal,
+            &&do_greater, &&do_greater_or_equal, &&do_greater_or_equali, &&do_pop_res, &&do_done,
+            &&do_print, &&do_abort, &&do_call, &&do_ret, &&do_enter, &&do_loadl, &&do_storel,
+            &&do_fill, &&do_copy, &&do_scan_zero, &&do_scan_nonzero, &&do_spawn, &&do_join, &&do_atomic_add,
+            &&do_cas, &&do_native,
+            &&do_dup_greater_or_equali_jump_if_false,
+            &&do_dup_greater_or_equali_jump_if_true, &&do_dup_pushi_store, &&do_dup_load, &&do_pushi_load,
+            &&do_loadi_addi, &&do_less_jump_if_false, &&do_greater_jump_if_false
+    };
+    if (threaded_code.empty() && !decode_threaded(handlers, sizeof(handlers) / sizeof(handlers[0]), &&do_abort)) {
+        return;
+    }
+    const threaded_insn* code = &threaded_code[0];
+    const threaded_insn* pc = code + threaded_entry;
+    int* sp = &stack[stack_size];
+
+#define DISPATCH() goto *pc->handler
+#define NEXT() do { pc++; DISPATCH(); } while (0)
+    DISPATCH();
+do_pushi:
+    *sp++ = pc->arg;
+    NEXT();
+do_loadi:
+    *sp++ = memory[pc->arg];
+    NEXT();
+do_loadaddi:
+    sp[-1] += memory[pc->arg];
+    NEXT();
+do_storei:
+    memory[pc->arg] = *--sp;
+    NEXT();
+do_load:
+    if (!in_memory(sp[-1])) {
+        goto bad_address;
+    }
+    sp[-1] = memory[sp[-1]];
+    NEXT();
+do_store:
+    if (!in_memory(sp[-2])) {
+        // bad_address reports the top of the stack
+        sp--;
+        goto bad_address;
+    }
+    sp -= 2;
+    memory[sp[0]] = sp[1];
+    NEXT();
+do_dup:
+    *sp = sp[-1];
+    sp++;
+    NEXT();
+do_discard:
+    sp--;
+    NEXT();
+do_pop_res:
+    runtime.results.push_back(*--sp);
+    NEXT();
+do_add:
+    sp--;
+    sp[-1] += *sp;
+    NEXT();
+do_addi:
+    sp[-1] += pc->arg;
+    NEXT();
+do_sub:
+    sp--;
+    sp[-1] -= *sp;
+    NEXT();
+do_div:
+    if (sp[-1] == 0) {
+        stack_size = sp - stack - 1;
+        *err << "ZERO DIVISION\n";
+        return;
+    }
+    if (sp[-1] == -1 && sp[-2] == INT_MIN) {
+        stack_size = sp - stack - 1;
+        *err << "DIVISION OVERFLOW\n";
+        return;
+    }
+    sp--;
+    sp[-1] /= *sp;
+    NEXT();
+do_mul:
+    sp--;
+    sp[-1] *= *sp;
+    NEXT();
+do_jump:
+    pc = code + pc->arg;
+    DISPATCH();
+do_jump_if_true:
+    if (*--sp) {
+        pc = code + pc->arg;
+        DISPATCH();
+    }
+    NEXT();
+do_jump_if_false:
+    if (!*--sp) {
+        pc = code + pc->arg;
+        DISPATCH();
+    }
+    NEXT();
+do_equal:
+    sp--;
+    sp[-1] = sp[-1] == *sp;
+    NEXT();
+do_less:
+    sp--;
+    sp[-1] = sp[-1] < *sp;
+    NEXT();
+do_less_or_equal:
+    sp--;
+    sp[-1] = sp[-1] <= *sp;
+    NEXT();
+do_greater:
+    sp--;
+    sp[-1] = sp[-1] > *sp;
+    NEXT();
+do_greater_or_equal:
+    sp--;
+    sp[-1] = sp[-1] >= *sp;
+    NEXT();
+do_greater_or_equali:
+    sp[-1] = sp[-1] >= pc->arg;
+    NEXT();
+do_print:
+    output.print(*--sp);
+    NEXT();
+do_done:
+    stack_size = sp - stack;
+    stop_program(&runtime, STOP_DONE, 0);
+    return;
+do_abort:
+    stack_size = sp - stack;
+    *err << "OP_ABORT called\n";
+    return;
+bad_address:
+    stack_size = sp - stack;
+    *err << "BAD MEMORY ACCESS: " << sp[-1] << "\n";
+    return;
+do_call:
+    stack_size = sp - stack;
+    if (!can_call(runtime.functions[pc->arg2])) {
+        return;
+    }
+    frames.push_back({(int) (pc + 1 - code), fp});
+    pc = code + pc->arg;
+    DISPATCH();
+do_enter:
+    fp = sp - stack - pc->arg;
+    NEXT();
+do_ret:
+    sp -= pc->arg;
+    copy(sp, sp + pc->arg, stack + fp);
+    sp = stack + fp + pc->arg;
+    pc = code + frames.back().return_to;
+    fp = frames.back().fp;
+    frames.pop_back();
+    DISPATCH();
+do_loadl:
+    *sp = stack[fp + pc->arg];
+    sp++;
+    NEXT();
+do_storel:
+    stack[fp + pc->arg] = *--sp;
+    NEXT();
+do_fill:
+    if (!bulk_memory(OP_FILL, sp)) {
+        goto bulk_failed;
+    }
+    sp -= 4;
+    NEXT();
+do_copy:
+    if (!bulk_memory(OP_COPY, sp)) {
+        goto bulk_failed;
+    }
+    sp -= 3;
+    NEXT();
+do_scan_zero:
+    if (!bulk_memory(OP_SCAN_ZERO, sp)) {
+        goto bulk_failed;
+    }
+    sp--;
+    NEXT();
+do_scan_nonzero:
+    if (!bulk_memory(OP_SCAN_NONZERO, sp)) {
+        goto bulk_failed;
+    }
+    sp--;
+    NEXT();
+do_atomic_add:
+    if (!bulk_memory(OP_ATOMIC_ADD, sp)) {
+        goto bulk_failed;
+    }
+    sp--;
+    NEXT();
+do_cas:
+    if (!bulk_memory(OP_CAS, sp)) {
+        goto bulk_failed;
+    }
+    sp -= 2;
+    NEXT();
+bulk_failed:
+    stack_size = sp - stack;
+    return;
+do_spawn:
+    sp[-1] = spawn(pc->arg, sp[-1]);
+    NEXT();
+do_join:
+    if (!join(sp[-1], sp[-1])) {
+        stack_size = sp - stack;
+        return;
+    }
+    NEXT();
+do_native:
+    if (!call_native(pc->arg, sp[-1])) {
+        stack_size = sp - stack;
+        return;
+    }
+    NEXT();
+do_dup_greater_or_equali_jump_if_false:
+    if (!(sp[-1] >= pc->arg)) {
+        pc = code + pc->arg2;
+        DISPATCH();
+    }
+    NEXT();
+do_dup_greater_or_equali_jump_if_true:
+    if (sp[-1] >= pc->arg) {
+        pc = code + pc->arg2;
+        DISPATCH();
+    }
+    NEXT();
+do_dup_pushi_store:
+    if (!in_memory(sp[-1])) {
+        goto bad_address;
+    }
+    memory[sp[-1]] = pc->arg;
+    NEXT();
+do_dup_load:
+    if (!in_memory(sp[-1])) {
+        goto bad_address;
+    }
+    *sp = memory[sp[-1]];
+    sp++;
+    NEXT();
+do_pushi_load:
+    *sp++ = memory[pc->arg];
+    NEXT();
+do_loadi_addi:
+    *sp++ = memory[pc->arg] + pc->arg2;
+    NEXT();
+do_less_jump_if_false:
+    sp -= 2;
+    if (!(sp[0] < sp[1])) {
+        pc = code + pc->arg;
+        DISPATCH();
+    }
+    NEXT();
+do_greater_jump_if_false:
+    sp -= 2;
+    if (!(sp[0] > sp[1])) {
+        pc = code + pc->arg;
+        DISPATCH();
+    }
+    NEXT();
+#undef NEXT
+#undef DISPATCH
+}
+
+#endif
+
+VM::VM(const VM& root, vm_threads& threads) : context() {
+    this->root = &root;
+    this->threads = &threads;
+    program = root.program;
+    memory = root.memory;
+    backedge_counters.assign(program.size, 0);
+    hot_loop_threshold = root.hot_loop_threshold;
+    jit_options = root.jit_options;
+    perf_map = root.perf_map;
+    program_name = root.program_name;
+    symbols = root.symbols;
+    runtime.output = &output;
+    runtime.err = &err;
+    runtime.vm = this;
+    runtime.is_worker = true;
+    runtime.functions = root.runtime.functions;
+    runtime.natives = root.runtime.natives;
+    memory_guarded = root.memory_guarded;
+    output.set_binary(root.output.is_binary());
+}
+
+void VM::drop_compiled() {
+    own_threads.reset();
+    threads = nullptr;
+    main_func.reset();
+    compiled_loops.clear();
+    compiled_functions.clear();
+    function_compiled.clear();
+    register_code.clear();
+    runtime.code.clear();
+}
+
+bool VM::allocate_stack(string& error) {
+    if (stack && stack_capacity == program.stack_size) {
+        return true;
+    }
+    free_stack();
+    auto mapping = mmap(nullptr, program.stack_size * sizeof(int), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mapping == MAP_FAILED) {
+        error = string("CAN'T CREATE VM STACK: ") + strerror(errno);
+        return false;
+    }
+    stack = (int*) mapping;
+    stack_capacity = program.stack_size;
+    return true;
+}
+
+bool VM::unload() {
+    program = {};
+    backedge_counters.clear();
+    runtime.functions.clear();
+    memory_area.reset();
+    memory = nullptr;
+    memory_guarded = false;
+    free_stack();
+    stack_size = 0;
+    return false;
+}
+
+void VM::run_worker(vm_worker& worker) {
+    ostringstream printed, errors;
+    output.to_stream(printed);
+    err = &errors;
+    stack[0] = worker.arg;
+    stack_size = 1;
+    if (worker.fuel >= 0) {
+        set_fuel(worker.fuel);
+    }
+    run_guarded([&] { run(worker.entry); });
+    if (suspended) {
+        // there is nobody to resume it
+        *err << "OUT OF FUEL\n";
+        suspended = false;
+        join_all();
+    }
+    worker.failed = !runtime.done;
+    worker.result = runtime.done && stack_size > 0 ? stack[stack_size - 1] : 0;
+    output.close();
+    err = &cerr;
+    worker.output = printed.str();
+    worker.errors = errors.str();
+}
+
+int VM::spawn(int entry, int value) {
+    if (!threads) {
+        own_threads = make_unique<vm_threads>(*this);
+        threads = own_threads.get();
+    }
+    workers.push_back(make_shared<vm_worker>(entry, value, metered ? fuel : -1));
+    threads->start(workers.back());
+    return (int) workers.size();
+}
+
+bool VM::join(int id, int& result) {
+    if (id <= 0 || id > (int) workers.size() || !workers[id - 1]) {
+        *err << "BAD WORKER: " << id << "\n";
+        return false;
+    }
+    auto worker = std::move(workers[id - 1]);
+    threads->wait(*worker);
+    output.append(worker->output);
+    *err << worker->errors;
+    result = worker->result;
+    return !worker->failed;
+}
+
+void VM::join_all() {
+    for (auto& worker : workers) {
+        if (worker) {
+            threads->wait(*worker);
+            output.append(worker->output);
+            *err << worker->errors;
+        }
+    }
+    workers.clear();
+}
+
+size_t VM::on_backedge(size_t header, size_t loop_end) {
+    if (metered && !take_fuel(header)) {
+        return SUSPENDED;
+    }
+    if (backedge_counters[header] < hot_loop_threshold) {
+        backedge_counters[header]++;
+        return header;
+    }
+    if (hot_loop_threshold == 0) {
+        return header;
+    }
+    auto it = compiled_loops.find(header);
+    if (it == compiled_loops.end()) {
+        // calls and returns leave to the interpreter, frame slots are where the current frame starts
+        auto func = make_unique<jit_compiled_func>(context, program, false, 0, header, loop_end, stack_size,
+                                                   &memory[0], &stack[0], &stack_size, &output, nullptr, fp,
+                                                   metered ? &fuel : nullptr, &runtime.natives,
+                                                   checks_addresses());
+        if (func->analyze()) {
+            compile(*func);
+        } else {
+            // stays interpreted
+            func.reset();
+        }
+        it = compiled_loops.emplace(header, std::move(func)).first;
+    }
+    auto& func = it->second;
+    if (!func || func->get_entry_depth() != stack_size) {
+        return header;
+    }
+    auto func_ptr = (int (*)())(func->closure());
+    auto ip = (size_t) func_ptr();
+    if (fuel < 0) {
+        // the compiled loop ran out at a backward jump and left at its target
+        fuel = 0;
+        suspend(ip);
+        return SUSPENDED;
+    }
+    return ip;
+}
+
+bool VM::take_fuel(size_t ip) {
+    if (fuel > 0) {
+        fuel--;
+        return true;
+    }
+    suspend(ip);
+    return false;
+}
+
+reg_function VM::translate_registers(int ip_start, int ip_end, const function_info* function) {
+    ir_source source = {&program, &runtime.functions, ip_start, ip_end, function ? function->args : 0, 0,
+                        function != nullptr, function && function->results == 0, checks_addresses(), false,
+                        program.memory_size};
+    // verify_program() made sure of the depths for the main program and functions
+    vector<int> depths;
+    ir_stack_depths(source, depths);
+    auto ir = build_ir(source, depths);
+    optimize_ir(ir, jit_options);
+    auto code = build_reg_code(ir);
+    if (ir_dump) {
+        *ir_dump << "; registers of " << (function ? "function" : "code") << " [" << ip_start << ", " << ip_end
+                 << ")\n" << dump_reg_code(code);
+    }
+    return code;
+}
+
+void VM::translate_registers() {
+    if (!register_code.empty()) {
+        return;
+    }
+    auto start = chrono::steady_clock::now();
+    for (auto& function : runtime.functions) {
+        register_code.push_back(translate_registers(function.entry, function.end, &function));
+    }
+    auto main_end = runtime.functions.empty() ? program.size : runtime.functions[0].entry;
+    register_code.push_back(translate_registers(program.entry, main_end, nullptr));
+    compile_seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+bool VM::enter_registers(const reg_function& function, int base, const int* args, int from) {
+    if (runtime.call_depth >= MAX_CALL_DEPTH) {
+        stop_program(&runtime, STOP_CALL_DEPTH, 0);
+        return false;
+    }
+    runtime.call_depth++;
+    // the frames overlap for tail calls
+    int values[MAX_FUNCTION_ARGS];
+    for (int i = 0; i < args[0]; i++) {
+        values[i] = registers[from + args[i + 1]];
+    }
+    auto end = base + function.frame.size();
+    if (registers.size() < end) {
+        registers.resize(max(end, 2 * registers.size()));
+    }
+    copy(function.frame.begin(), function.frame.end(), registers.begin() + base);
+    for (int i = 0; i < args[0]; i++) {
+        registers[base + function.inputs[i]] = values[i];
+    }
+    return true;
+}
+
+int VM::leave_registers(const reg_function* function, int exit, int base) {
+    auto& leaving = function->exits[exit];
+    spill_registers(leaving.spills, &registers[base]);
+    if (leaving.kind == EXIT_TO_INTERPRETER) {
+        for (size_t i = 0; i < leaving.stack.size(); i++) {
+            stack[i] = registers[base + leaving.stack[i]];
+        }
+        stack_size = (int) leaving.stack.size();
+        return leaving.ip;
+    }
+    if (leaving.kind == EXIT_STOP) {
+        stop_program(&runtime, leaving.reason, leaving.value >= 0 ? registers[base + leaving.value] : 0);
+    }
+    return unwind_registers();
+}
+
+int VM::unwind_registers() {
+    for (; !register_frames.empty(); register_frames.pop_back()) {
+        auto& frame = register_frames.back();
+        spill_registers(frame.function->exits[frame.return_to[-1].target].spills, &registers[frame.base]);
+    }
+    return -1;
+}
+
+template<bool counted>
+int VM::run_register_code() {
+    const reg_function* function = &register_code.back();
+    register_frames.clear();
+    int base = 0;
+    if (registers.size() < function->frame.size()) {
+        registers.resize(function->frame.size());
+    }
+    copy(function->frame.begin(), function->frame.end(), registers.begin());
+    auto r = registers.data();
+    auto cells = memory;
+    const reg_insn* pc = function->code.data();
+    for (;;) {
+        auto& insn = *pc++;
+        if (counted) {
+            register_count++;
+        }
+        switch (insn.opcode) {
+            case REG_MOVE:
+                r[insn.dst] = r[insn.a];
+                break;
+            // the way the interpreter computes them, where the C++ operators could overflow
+            case REG_ADD:
+                r[insn.dst] = (int) ((unsigned) r[insn.a] + (unsigned) r[insn.b]);
+                break;
+            case REG_SUB:
+                r[insn.dst] = (int) ((unsigned) r[insn.a] - (unsigned) r[insn.b]);
+                break;
+            case REG_MUL:
+                r[insn.dst] = (int) ((unsigned) r[insn.a] * (unsigned) r[insn.b]);
+                break;
+            case REG_DIV:
+                r[insn.dst] = r[insn.a] / r[insn.b];
+                break;
+            case REG_EQUAL:
+                r[insn.dst] = r[insn.a] == r[insn.b];
+                break;
+            case REG_LESS:
+                r[insn.dst] = r[insn.a] < r[insn.b];
+                break;
+            case REG_LESS_OR_EQUAL:
+                r[insn.dst] = r[insn.a] <= r[insn.b];
+                break;
+            case REG_GREATER:
+                r[insn.dst] = r[insn.a] > r[insn.b];
+                break;
+            case REG_GREATER_OR_EQUAL:
+                r[insn.dst] = r[insn.a] >= r[insn.b];
+                break;
+            case REG_LOAD:
+                r[insn.dst] = cells[r[insn.a]];
+                break;
+            case REG_STORE:
+                cells[r[insn.a]] = r[insn.b];
+                break;
+            case REG_LOAD_ALIASED: {
+                auto& aliases = function->aliases[insn.b];
+                auto addr = r[insn.a];
+                if ((unsigned) (addr - aliases.lowest) <= (unsigned) (aliases.highest - aliases.lowest)) {
+                    spill_registers(aliases.cells, r);
+                }
+                r[insn.dst] = cells[addr];
+                break;
+            }
+            case REG_STORE_ALIASED: {
+                auto& aliases = function->aliases[insn.dst];
+                auto addr = r[insn.a];
+                if ((unsigned) (addr - aliases.lowest) > (unsigned) (aliases.highest - aliases.lowest)) {
+                    cells[addr] = r[insn.b];
+                    break;
+                }
+                if (insn.target >= 0) {
+                    // the interpreter runs the STORE again, after the exit wrote the cells back
+                    return leave_registers(function, insn.target, base);
+                }
+                spill_registers(aliases.cells, r);
+                cells[addr] = r[insn.b];
+                for (auto cell : aliases.cells) {
+                    r[cell.reg] = cells[cell.cell];
+                }
+                break;
+            }
+            case REG_CHECK_ADDRESS:
+                if ((unsigned) r[insn.a] >= (unsigned) program.memory_size) {
+                    return leave_registers(function, insn.target, base);
+                }
+                break;
+            case REG_CHECK_NONZERO:
+                if (!r[insn.a]) {
+                    return leave_registers(function, insn.target, base);
+                }
+                break;
+            case REG_CHECK_QUOTIENT:
+                if (r[insn.a] == INT_MIN && r[insn.b] == -1) {
+                    return leave_registers(function, insn.target, base);
+                }
+                break;
+            case REG_PRINT:
+                print_int(&output, r[insn.a]);
+                break;
+            case REG_BULK: {
+                // functions report a bad address or native themselves, see jit_fill(), SPAWN, JOIN and
+                // POP_RES always do
+                auto helper_runtime = function == &register_code.back() && insn.b != OP_SPAWN &&
+                                      insn.b != OP_JOIN && insn.b != OP_POP_RES ? nullptr : &runtime;
+                auto args = &function->operands[insn.a + 1];
+                int64_t result;
+                switch (insn.b) {
+                    case OP_FILL:
+                        result = jit_fill(helper_runtime, cells, program.memory_size, r[args[0]], r[args[1]],
+                                          r[args[2]], r[args[3]]);
+                        break;
+                    case OP_COPY:
+                        result = jit_copy(helper_runtime, cells, program.memory_size, r[args[0]], r[args[1]],
+                                          r[args[2]]);
+                        break;
+                    case OP_ATOMIC_ADD:
+                        result = jit_atomic_add(helper_runtime, cells, program.memory_size, r[args[0]], r[args[1]]);
+                        break;
+                    case OP_CAS:
+                        result = jit_cas(helper_runtime, cells, program.memory_size, r[args[0]], r[args[1]],
+                                         r[args[2]]);
+                        break;
+                    case OP_SPAWN:
+                        result = jit_spawn(helper_runtime, cells, program.memory_size, r[args[0]], r[args[1]]);
+                        break;
+                    case OP_JOIN:
+                        result = jit_join(helper_runtime, cells, program.memory_size, r[args[0]]);
+                        break;
+                    case OP_POP_RES:
+                        result = jit_pop_res(helper_runtime, cells, program.memory_size, r[args[0]]);
+                        break;
+                    case OP_NATIVE:
+                        if ((unsigned) r[args[0]] < runtime.natives.size()) {
+                            auto& native = runtime.natives[r[args[0]]];
+                            result = native.function(native.data, r[args[1]]);
+                        } else {
+                            if (helper_runtime) {
+                                stop_program(helper_runtime, STOP_BAD_NATIVE, r[args[0]]);
+                            }
+                            result = numeric_limits<int64_t>::min();
+                        }
+                        break;
+                    default:
+                        result = jit_scan(helper_runtime, cells, program.memory_size, r[args[0]], r[args[1]],
+                                          insn.b == OP_SCAN_ZERO);
+                        break;
+                }
+                if (result == numeric_limits<int64_t>::min()) {
+                    return leave_registers(function, insn.target, base);
+                }
+                if (insn.dst >= 0) {
+                    r[insn.dst] = (int) result;
+                }
+                break;
+            }
+            case REG_CALL: {
+                auto callee = &register_code[insn.b];
+                register_frames.push_back({function, pc, base});
+                auto callee_base = base + (int) function->frame.size();
+                if (!enter_registers(*callee, callee_base, &function->operands[insn.a], base)) {
+                    return unwind_registers();
+                }
+                function = callee;
+                base = callee_base;
+                r = &registers[base];
+                pc = function->code.data();
+                break;
+            }
+            case REG_JUMP:
+                pc = function->code.data() + insn.target;
+                break;
+            case REG_JUMP_IF_TRUE:
+                if (r[insn.a]) {
+                    pc = function->code.data() + insn.target;
+                }
+                break;
+            case REG_JUMP_IF_FALSE:
+                if (!r[insn.a]) {
+                    pc = function->code.data() + insn.target;
+                }
+                break;
+            case REG_JUMP_IF_EQUAL:
+                if (r[insn.a] == r[insn.b]) {
+                    pc = function->code.data() + insn.target;
+                }
+                break;
+            case REG_JUMP_IF_NOT_EQUAL:
+                if (r[insn.a] != r[insn.b]) {
+                    pc = function->code.data() + insn.target;
+                }
+                break;
+            case REG_JUMP_IF_LESS:
+                if (r[insn.a] < r[insn.b]) {
+                    pc = function->code.data() + insn.target;
+                }
+                break;
+            case REG_JUMP_IF_LESS_OR_EQUAL:
+                if (r[insn.a] <= r[insn.b]) {
+                    pc = function->code.data() + insn.target;
+                }
+                break;
+            case REG_JUMP_IF_GREATER:
+                if (r[insn.a] > r[insn.b]) {
+                    pc = function->code.data() + insn.target;
+                }
+                break;
+            case REG_JUMP_IF_GREATER_OR_EQUAL:
+                if (r[insn.a] >= r[insn.b]) {
+                    pc = function->code.data() + insn.target;
+                }
+                break;
+            case REG_EXIT:
+                return leave_registers(function, insn.target, base);
+            case REG_RETURN: {
+                runtime.call_depth--;
+                auto result = insn.a >= 0 ? r[insn.a] : 0;
+                auto frame = register_frames.back();
+                register_frames.pop_back();
+                function = frame.function;
+                base = frame.base;
+                r = &registers[base];
+                pc = frame.return_to;
+                if (pc[-1].dst >= 0) {
+                    r[pc[-1].dst] = result;
+                }
+                break;
+            }
+            case REG_TAIL_CALL: {
+                // the callee takes the place of this function
+                runtime.call_depth--;
+                auto callee = &register_code[insn.b];
+                if (!enter_registers(*callee, base, &function->operands[insn.a], base)) {
+                    return unwind_registers();
+                }
+                function = callee;
+                r = &registers[base];
+                pc = function->code.data();
+                break;
+            }
+        }
+    }
+}
+
+#if HAVE_THREADED_DISPATCH
+
+bool VM::decode_threaded(const void* const* handlers, int handlers_count, const void* end_handler) {
+    auto size = program.size;
+    // ip -> index of the first decoded instruction at or after it
+    vector<int> index(size + 1);
+    int count = 0;
+    for (int ip = 0; ip < size; ip += program.length(program.opcode(ip))) {
+        index[ip] = count;
+        if (program.opcode(ip) != LABEL_MARK) {
+            count++;
+        }
+    }
+    index[size] = count;
+    threaded_code.clear();
+    for (int ip = 0; ip < size; ip += program.length(program.opcode(ip))) {
+        auto opcode = program.opcode(ip);
+        if (opcode == LABEL_MARK) {
+            continue;
+        }
+        if (opcode < 0 || opcode >= handlers_count) {
+            *err << "UNKNOWN INSTRUCTION: " << opcode << endl;
+            threaded_code.clear();
+            return false;
+        }
+        // arguments of all the parts of a superinstruction, in order
+        int args[2] = {0, 0};
+        int args_count = 0;
+        auto part_ip = ip;
+        do {
+            auto part = base_opcode(program.opcode(part_ip));
+            if (argument_count(part) > 0) {
+                int arg = program.arg(part_ip + 1);
+                if (is_jump(part) || part == OP_CALL) {
+                    if (arg < 0 || arg > size) {
+                        *err << "BAD JUMP TARGET: " << arg << endl;
+                        threaded_code.clear();
+                        return false;
+                    }
+                    if (part == OP_CALL) {
+                        // do_call finds the function's frame size by its index
+                        args[1] = function_at(runtime.functions, arg);
+                        if (args[1] < 0) {
+                            *err << "BAD CALL TARGET: " << arg << endl;
+                            threaded_code.clear();
+                            return false;
+                        }
+                    }
+                    arg = index[arg];
+                }
+                args[args_count++] = arg;
+            }
+            part_ip += program.length(part);
+        } while (part_ip < ip + program.length(opcode));
+        threaded_code.push_back({handlers[opcode], args[0], args[1]});
+    }
+    threaded_code.push_back({end_handler, 0, 0});
+    threaded_entry = index[program.entry];
+    return true;
+}
+
+#endif
+
+void VM::profile_instruction(size_t ip) {
+    if (profiled_ip >= 0) {
+        auto last_opcode = program.opcode(profiled_ip);
+        if (is_conditional_jump(last_opcode) && ip != (size_t) (profiled_ip + program.length(last_opcode))) {
+            profile->taken[profiled_ip]++;
+        }
+    }
+    if (profile->has_cycles) {
+        auto now = read_cycles();
+        if (profiled_ip >= 0) {
+            profile->cycles[profiled_ip] += now - profiled_cycles;
+        }
+        profiled_cycles = now;
+    }
+    profile->counts[ip]++;
+    profiled_ip = (int) ip;
+}
+
+void VM::compile(jit_compiled_func& func) {
+    auto start = chrono::steady_clock::now();
+    func.compile_now(jit_options, ir_dump);
+    compile_seconds += chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    if (perf_map) {
+        auto kind = &func == main_func.get() ? "main" : func.compiles_function() ? "function" : "loop";
+        write_perf_map(func.closure(), func.code_size(),
+                       jit_symbol(program_name, symbols, func.get_ip_start(), func.get_ip_end(), kind));
+    }
+}
+
+void VM::create_functions() {
+    if (!compiled_functions.empty()) {
+        return;
+    }
+    for (auto& function : runtime.functions) {
+        compiled_functions.push_back(make_unique<jit_compiled_func>(
+                context, program, function.results == 0, function.args, function.entry, function.end, function.args,
+                &memory[0], &stack[0], &stack_size, &output, &runtime, 0, nullptr, &runtime.natives,
+                checks_addresses()));
+        runtime.code.push_back(compiled_functions.back()->raw());
+    }
+    function_compiled.assign(runtime.functions.size(), false);
+}
+
+jit_compiled_func& VM::compile_function(int index) {
+    create_functions();
+    vector<int> work = {index};
+    while (!work.empty()) {
+        auto i = work.back();
+        work.pop_back();
+        if (function_compiled[i]) {
+            continue;
+        }
+        function_compiled[i] = true;
+        compile(*compiled_functions[i]);
+        auto& function = runtime.functions[i];
+        for (int ip = function.entry; ip < function.end; ip += program.length(program.opcode(ip))) {
+            if (program.opcode(ip) == OP_CALL) {
+                work.push_back(function_at(runtime.functions, program.arg(ip + 1)));
+            }
+        }
+    }
+    return *compiled_functions[index];
+}
+
+bool VM::can_call(const function_info& function) {
+    if (frames.size() >= (size_t) MAX_CALL_DEPTH) {
+        *err << "CALL STACK OVERFLOW\n";
+        return false;
+    }
+    if (stack_size - function.args + function.frame_size > stack_capacity) {
+        *err << "STACK OVERFLOW\n";
+        return false;
+    }
+    return true;
+}
+
+bool VM::call_function(int target, size_t& ip) {
+    auto index = function_at(runtime.functions, target);
+    if (!can_call(runtime.functions[index])) {
+        return false;
+    }
+    if (backedge_counters[target] < hot_loop_threshold) {
+        backedge_counters[target]++;
+    } else if (hot_loop_threshold != 0 && !metered) {
+        return call_compiled(index);
+    }
+    frames.push_back({(int) ip, fp});
+    ip = target;
+    return !metered || take_fuel(target);
+}
+
+bool VM::call_compiled(int index) {
+    auto& func = compile_function(index);
+    auto& function = runtime.functions[index];
+    auto base = stack_size - function.args;
+    void* args[MAX_FUNCTION_ARGS];
+    for (int i = 0; i < function.args; i++) {
+        args[i] = &stack[base + i];
+    }
+    int result = 0;
+    runtime.call_depth = (int) frames.size();
+    func.apply(args, &result);
+    stack_size = base;
+    if (runtime.stopped) {
+        return false;
+    }
+    if (function.results) {
+        stack[stack_size++] = result;
+    }
+    return true;
+}
+
+bool VM::bulk_memory(int opcode, int* top) {
+    int result = 0;
+    bool done;
+    switch (opcode) {
+        case OP_ATOMIC_ADD:
+            done = atomic_add(memory, program.memory_size, top[-2], top[-1], result);
+            top[-2] = result;
+            break;
+        case OP_CAS:
+            done = atomic_cas(memory, program.memory_size, top[-3], top[-2], top[-1], result);
+            top[-3] = result;
+            break;
+        case OP_FILL:
+            done = bulk_fill(memory, program.memory_size, top[-4], top[-3], top[-2], top[-1], result);
+            break;
+        case OP_COPY:
+            done = bulk_copy(memory, program.memory_size, top[-3], top[-2], top[-1], result);
+            break;
+        default:
+            done = bulk_scan(memory, program.memory_size, top[-2], top[-1], opcode == OP_SCAN_ZERO, result);
+            top[-2] = result;
+            break;
+    }
+    if (!done) {
+        *err << "BAD MEMORY ACCESS: " << result << "\n";
+    }
+    return done;
+}
+
+bool VM::call_native(int index, int& value) {
+    if (index < 0 || index >= (int) runtime.natives.size()) {
+        *err << "BAD NATIVE: " << index << "\n";
+        return false;
+    }
+    auto& native = runtime.natives[index];
+    value = native.function(native.data, value);
+    return true;
+}
+
+template<typename Run>
+void VM::run_guarded(Run run, bool resuming) {
+    if (!resuming) {
+        // a run that ended inside a function left its frames behind
+        frames.clear();
+        fp = 0;
+        runtime.results.clear();
+    }
+    suspended = false;
+    runtime.stopped = 0;
+    runtime.call_depth = 0;
+    runtime.done = 0;
+    guarded_run guard;
+    guard.memory = root ? root->memory_area.get() : memory_area.get();
+    auto outer = current_run;
+    current_run = &guard;
+    // the fault handler has SA_NODEFER, so there is no signal mask to restore
+    if (sigsetjmp(guard.jump, 0) == 0) {
+        run();
+    } else {
+        *err << "BAD MEMORY ACCESS: " << guard.bad_cell << "\n";
+    }
+    current_run = outer;
+    if (!suspended) {
+        join_all();
+    }
+    output.flush();
+}
+
+void VM::free_stack() {
+    if (stack) {
+        munmap(stack, stack_capacity * sizeof(int));
+    }
+    stack = nullptr;
+    stack_capacity = 0;
+}
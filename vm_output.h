@@ -0,0 +1,270 @@
+#ifndef VM_OUTPUT_H
+#define VM_OUTPUT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// What PRINT and DONE write goes through a VM owned buffer instead of an ostream per value. Numbers
+// are formatted by hand, two digits at a time, and the buffer goes out in large pieces: with write(2)
+// to a file descriptor, to an ostream, or not at all for a mapped output file, where the buffer is the
+// mapping itself. In binary mode PRINT writes each value as a 4 byte little endian int, without any
+// formatting, and DONE writes nothing.
+
+// "00" "01" ... "99"
+struct digit_pair_table {
+    char pairs[200];
+
+    constexpr digit_pair_table() : pairs() {
+        for (int i = 0; i < 100; i++) {
+            pairs[2 * i] = (char) ('0' + i / 10);
+            pairs[2 * i + 1] = (char) ('0' + i % 10);
+        }
+    }
+};
+
+inline constexpr digit_pair_table digit_pairs;
+
+// "-2147483648\n"
+const size_t MAX_PRINTED_SIZE = 12;
+
+// writes n in decimal at to and returns the end, which is at most 11 chars further
+inline char* format_int(char* to, int n) {
+    unsigned value = n < 0 ? 0u - (unsigned) n : (unsigned) n;
+    if (n < 0) {
+        *to++ = '-';
+    }
+    char digits[10];
+    char* end = digits + sizeof(digits);
+    char* start = end;
+    while (value >= 100) {
+        start -= 2;
+        memcpy(start, &digit_pairs.pairs[value % 100 * 2], 2);
+        value /= 100;
+    }
+    if (value >= 10) {
+        start -= 2;
+        memcpy(start, &digit_pairs.pairs[value * 2], 2);
+    } else {
+        *--start = (char) ('0' + value);
+    }
+    memcpy(to, start, end - start);
+    return to + (end - start);
+}
+
+class vm_output {
+public:
+    static const size_t BUFFER_SIZE = 1 << 16;
+
+    vm_output() : buffer(BUFFER_SIZE) {
+        reset_buffer();
+    }
+
+    vm_output(const vm_output&) = delete;
+    vm_output& operator=(const vm_output&) = delete;
+
+    ~vm_output() {
+        close();
+    }
+
+    // The destinations. Each one first sends what is buffered to the one before
+    void to_stream(std::ostream& output) {
+        close();
+        stream = &output;
+    }
+
+    // fd stays open; a terminal gets every line right away
+    void to_fd(int output_fd) {
+        close();
+        fd = output_fd;
+        line_buffered = isatty(fd);
+    }
+
+    // Creates or truncates the file at path and maps it; close() cuts it to what was written
+    bool to_file(const std::string& path, std::string& error) {
+        close();
+        auto file_fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (file_fd < 0) {
+            error = path + ": " + strerror(errno);
+            return false;
+        }
+        fd = file_fd;
+        mapped_size = 0;
+        if (!grow_file(BUFFER_SIZE)) {
+            error = path + ": " + strerror(errno);
+            ::close(fd);
+            fd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    void set_binary(bool binary_values) {
+        binary = binary_values;
+    }
+
+    bool is_binary() const {
+        return binary;
+    }
+
+    void print(int n) {
+        if ((size_t) (end - pos) < MAX_PRINTED_SIZE) {
+            make_room(MAX_PRINTED_SIZE);
+        }
+        if (binary) {
+            // every host the VM runs on is little endian
+            memcpy(pos, &n, sizeof(n));
+            pos += sizeof(n);
+        } else {
+            pos = format_int(pos, n);
+            *pos++ = '\n';
+        }
+        if (line_buffered) {
+            flush();
+        }
+    }
+
+    // text that isn't a printed value, like "program DONE"; binary output leaves it out
+    void message(const char* text) {
+        if (binary) {
+            return;
+        }
+        auto size = strlen(text);
+        if ((size_t) (end - pos) < size) {
+            make_room(size);
+        }
+        memcpy(pos, text, size);
+        pos += size;
+        if (line_buffered) {
+            flush();
+        }
+    }
+
+    // output that is formatted already, like what a worker of the VM wrote
+    void append(const std::string& text) {
+        for (size_t done = 0; done < text.size();) {
+            if (pos == end) {
+                make_room(1);
+            }
+            auto size = std::min(text.size() - done, (size_t) (end - pos));
+            memcpy(pos, text.data() + done, size);
+            pos += size;
+            done += size;
+        }
+        if (line_buffered) {
+            flush();
+        }
+    }
+
+    // hands the buffer to the stream or the file descriptor; a mapped file has it already
+    void flush() {
+        if (mapping) {
+            return;
+        }
+        auto size = pos - begin;
+        if (stream) {
+            stream->write(begin, size);
+            stream->flush();
+        } else if (fd >= 0 && !failed) {
+            for (ssize_t done = 0; done < size;) {
+                auto written = write(fd, begin + done, size - done);
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (written < 0) {
+                    std::cerr << "CAN'T WRITE OUTPUT: " << strerror(errno) << std::endl;
+                    failed = true;
+                    break;
+                }
+                done += written;
+            }
+        }
+        pos = begin;
+    }
+
+    // flushes and lets go of the destination; a mapped file is cut to its size and closed
+    void close() {
+        if (mapping) {
+            unmap_file();
+        } else {
+            flush();
+        }
+        stream = nullptr;
+        fd = -1;
+        line_buffered = failed = false;
+    }
+
+private:
+    void reset_buffer() {
+        begin = pos = buffer.data();
+        end = begin + buffer.size();
+    }
+
+    // at least size bytes after pos
+    void make_room(size_t size) {
+        if (mapping) {
+            if (grow_file(mapped_size * 2 + size)) {
+                return;
+            }
+            std::cerr << "CAN'T WRITE OUTPUT: " << strerror(errno) << std::endl;
+            // the file keeps what fits, the rest of the output goes nowhere
+            unmap_file();
+            failed = true;
+        }
+        flush();
+    }
+
+    // cuts the mapped file to what was written and closes it
+    void unmap_file() {
+        auto size = pos - begin;
+        munmap(mapping, mapped_size);
+        if (ftruncate(fd, size) < 0) {
+            std::cerr << "CAN'T WRITE OUTPUT: " << strerror(errno) << std::endl;
+        }
+        ::close(fd);
+        mapping = nullptr;
+        fd = -1;
+        reset_buffer();
+    }
+
+    bool grow_file(size_t size) {
+        auto offset = pos - begin;
+        if (ftruncate(fd, size) < 0) {
+            return false;
+        }
+        auto grown = mapping ? mremap(mapping, mapped_size, size, MREMAP_MAYMOVE)
+                             : mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (grown == MAP_FAILED) {
+            return false;
+        }
+        mapping = grown;
+        mapped_size = size;
+        begin = (char*) mapping;
+        pos = begin + offset;
+        end = begin + size;
+        return true;
+    }
+
+    std::vector<char> buffer;
+    // where the next value goes, in buffer or the mapping
+    char* begin;
+    char* pos;
+    char* end;
+    bool binary = false;
+    bool line_buffered = false;
+    // a write failed, the rest of the output goes nowhere
+    bool failed = false;
+    std::ostream* stream = nullptr;
+    int fd = -1;
+    // of the output file, when there is one
+    void* mapping = nullptr;
+    size_t mapped_size = 0;
+};
+
+#endif //VM_OUTPUT_H